@@ -6,6 +6,8 @@ CONFIG		+= qt release
 QT		+= core gui svg widgets
 
 HEADERS		+= src/audiobuffer.h
+HEADERS		+= src/audiofile.h
+HEADERS		+= src/capture.h
 HEADERS		+= src/chatdlg.h
 HEADERS		+= src/clientdlg.h
 HEADERS		+= src/compressor.h
@@ -21,12 +23,18 @@ HEADERS		+= src/mixerdlg.h
 HEADERS		+= src/multiply.h
 HEADERS		+= src/peer.h
 HEADERS		+= src/protocol.h
+HEADERS		+= src/recorder.h
+HEADERS		+= src/server.h
+HEADERS		+= src/simulate.h
 HEADERS		+= src/socket.h
 HEADERS		+= src/statsdlg.h
 HEADERS		+= src/timer.h
+HEADERS		+= src/transport.h
 HEADERS		+= src/volumedlg.h
 
 SOURCES		+= src/audiobuffer.cpp
+SOURCES		+= src/audiofile.cpp
+SOURCES		+= src/capture.cpp
 SOURCES		+= src/chatdlg.cpp
 SOURCES		+= src/clientdlg.cpp
 SOURCES		+= src/compressor.cpp
@@ -34,6 +42,7 @@ SOURCES		+= src/configdlg.cpp
 SOURCES		+= src/connectdlg.cpp
 SOURCES		+= src/eqdlg.cpp
 SOURCES		+= src/equalizer.cpp
+SOURCES		+= src/globals.cpp
 SOURCES		+= src/helpdlg.cpp
 SOURCES		+= src/hpsjam.cpp
 SOURCES		+= src/jitter.cpp
@@ -42,6 +51,9 @@ SOURCES		+= src/mixerdlg.cpp
 SOURCES		+= src/multiply.cpp
 SOURCES		+= src/peer.cpp
 SOURCES		+= src/protocol.cpp
+SOURCES		+= src/recorder.cpp
+SOURCES		+= src/server.cpp
+SOURCES		+= src/simulate.cpp
 SOURCES		+= src/socket.cpp
 SOURCES		+= src/statsdlg.cpp
 SOURCES		+= src/timer.cpp
@@ -54,6 +66,14 @@ SOURCES		+= mac/activity.mm
 
 isEmpty(WITHOUT_AUDIO) {
 
+# Null audio backend, for testing without an audio device
+!isEmpty(NULL_AUDIO) {
+SOURCES		+= null/sound_null.cpp
+DEFINES		+= HAVE_NULL_AUDIO
+}
+
+isEmpty(NULL_AUDIO) {
+
 # ASIO audio backend
 win32 {
 DEFINES         -= UNICODE
@@ -86,6 +106,8 @@ DEFINES		+= HAVE_JACK_AUDIO
 
 }
 
+}
+
 RESOURCES	+= HpsJam.qrc
 
 TARGET		= HpsJam
@@ -0,0 +1,63 @@
+#
+# QMAKE project file for the HPSJAM load generator
+#
+TEMPLATE	= app
+CONFIG		+= qt release console
+CONFIG		-= app_bundle
+QT		= core
+
+HEADERS		+= src/audiobuffer.h
+HEADERS		+= src/audiofile.h
+HEADERS		+= src/capture.h
+HEADERS		+= src/compressor.h
+HEADERS		+= src/equalizer.h
+HEADERS		+= src/hpsjam.h
+HEADERS		+= src/jitter.h
+HEADERS		+= src/multiply.h
+HEADERS		+= src/peer.h
+HEADERS		+= src/protocol.h
+HEADERS		+= src/recorder.h
+HEADERS		+= src/server.h
+HEADERS		+= src/simulate.h
+HEADERS		+= src/socket.h
+HEADERS		+= src/timer.h
+HEADERS		+= src/transport.h
+
+SOURCES		+= src/audiobuffer.cpp
+SOURCES		+= src/audiofile.cpp
+SOURCES		+= src/capture.cpp
+SOURCES		+= src/compressor.cpp
+SOURCES		+= src/equalizer.cpp
+SOURCES		+= src/globals.cpp
+SOURCES		+= src/jitter.cpp
+SOURCES		+= src/loadgen.cpp
+SOURCES		+= src/multiply.cpp
+SOURCES		+= src/peer.cpp
+SOURCES		+= src/protocol.cpp
+SOURCES		+= src/recorder.cpp
+SOURCES		+= src/server.cpp
+SOURCES		+= src/simulate.cpp
+SOURCES		+= src/socket.cpp
+SOURCES		+= src/timer.cpp
+
+macx {
+HEADERS		+= mac/activity.h
+SOURCES		+= mac/activity.mm
+}
+
+TARGET		= HpsJamLoad
+
+macx {
+INCLUDEPATH 	+= /opt/local/include
+LIBS		+= /opt/local/lib/libfftw3.a
+}
+
+!macx:!win32 {
+INCLUDEPATH     += $${PREFIX}/include
+LIBS		+= -L$${PREFIX}/lib -lfftw3
+}
+
+LIBS		+= -pthread
+
+target.path	= $${PREFIX}/bin
+INSTALLS	+= target
@@ -0,0 +1,7 @@
+#
+# QMAKE project file for the HPSJAM server without Qt
+#
+TEMPLATE	= subdirs
+SUBDIRS		= engine server
+
+server.depends	= engine
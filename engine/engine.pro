@@ -0,0 +1,45 @@
+#
+# QMAKE project file for the HPSJAM server engine library
+#
+TEMPLATE	= lib
+CONFIG		+= staticlib release
+CONFIG		-= qt
+TARGET		= hpsjam-engine
+DEFINES		+= HPSJAM_SERVER_ONLY
+
+HEADERS		+= ../src/audiobuffer.h
+HEADERS		+= ../src/capture.h
+HEADERS		+= ../src/compressor.h
+HEADERS		+= ../src/hpsjam.h
+HEADERS		+= ../src/jitter.h
+HEADERS		+= ../src/protocol.h
+HEADERS		+= ../src/recorder.h
+HEADERS		+= ../src/server.h
+HEADERS		+= ../src/socket.h
+HEADERS		+= ../src/timer.h
+HEADERS		+= ../src/transport.h
+
+SOURCES		+= ../src/audiobuffer.cpp
+SOURCES		+= ../src/capture.cpp
+SOURCES		+= ../src/compressor.cpp
+SOURCES		+= ../src/globals.cpp
+SOURCES		+= ../src/jitter.cpp
+SOURCES		+= ../src/protocol.cpp
+SOURCES		+= ../src/recorder.cpp
+SOURCES		+= ../src/server.cpp
+SOURCES		+= ../src/socket.cpp
+SOURCES		+= ../src/timer.cpp
+
+win32 {
+DEFINES         -= UNICODE
+QMAKE_CXXFLAGS	+= -include winsock2.h
+QMAKE_CXXFLAGS	+= -include windows.h
+QMAKE_CXXFLAGS	+= -include ws2ipdef.h
+QMAKE_CXXFLAGS	+= -include ws2tcpip.h
+QMAKE_CXXFLAGS	+= -include winsock.h
+INCLUDEPATH	+= ../windows/include
+}
+
+!macx:!win32 {
+INCLUDEPATH     += $${PREFIX}/include
+}
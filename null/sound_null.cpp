@@ -0,0 +1,144 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <QObject>
+#include <QString>
+
+#include "../src/peer.h"
+#include "../src/timer.h"
+#include "../src/audiofile.h"
+
+#include <pthread.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+/*
+ * The null audio backend has no audio device. A thread calls the
+ * audio processing of the client once per millisecond, with audio
+ * from a WAV file or a sine tone as input. The output is discarded.
+ * This is useful for testing on headless machines.
+ */
+static struct hpsjam_audio_file hpsjam_sound_file;
+static struct hpsjam_audio_player hpsjam_sound_player;
+static const char *hpsjam_sound_name;
+static std::atomic<bool> hpsjam_sound_running;
+static pthread_t hpsjam_sound_thread;
+
+static void *
+hpsjam_sound_loop(void *)
+{
+	float left[HPSJAM_DEF_SAMPLES];
+	float right[HPSJAM_DEF_SAMPLES];
+	auto next = std::chrono::steady_clock::now();
+
+	hpsjam_thread_set_priority();
+
+	while (hpsjam_sound_running) {
+		next += std::chrono::microseconds(1000000 * HPSJAM_DEF_SAMPLES / HPSJAM_SAMPLE_RATE);
+		std::this_thread::sleep_until(next);
+
+		hpsjam_sound_player.getSamples(left, right, HPSJAM_DEF_SAMPLES);
+		hpsjam_client_peer->sound_process(left, right, HPSJAM_DEF_SAMPLES);
+	}
+	return (0);
+}
+
+Q_DECL_EXPORT bool
+hpsjam_sound_init(const char *name, bool)
+{
+	if (name != 0 && hpsjam_sound_file.load(name))
+		return (true);
+
+	hpsjam_sound_name = name;
+	hpsjam_sound_player.init(&hpsjam_sound_file, 440.0f);
+	hpsjam_sound_running = true;
+
+	if (pthread_create(&hpsjam_sound_thread, 0, &hpsjam_sound_loop, 0) != 0) {
+		hpsjam_sound_running = false;
+		return (true);
+	}
+	return (false);			/* success */
+}
+
+Q_DECL_EXPORT void
+hpsjam_sound_uninit()
+{
+	if (hpsjam_sound_running.exchange(false) == false)
+		return;
+	pthread_join(hpsjam_sound_thread, 0);
+}
+
+Q_DECL_EXPORT int
+hpsjam_sound_toggle_input_device(int)
+{
+	return (0);
+}
+
+Q_DECL_EXPORT int
+hpsjam_sound_toggle_output_device(int)
+{
+	return (0);
+}
+
+Q_DECL_EXPORT int
+hpsjam_sound_toggle_input_channel(int ch, int)
+{
+	return (ch);
+}
+
+Q_DECL_EXPORT int
+hpsjam_sound_toggle_output_channel(int ch, int)
+{
+	return (ch);
+}
+
+Q_DECL_EXPORT int
+hpsjam_sound_max_input_channel()
+{
+	return (2);
+}
+
+Q_DECL_EXPORT int
+hpsjam_sound_max_output_channel()
+{
+	return (2);
+}
+
+Q_DECL_EXPORT void
+hpsjam_sound_get_input_status(QString &status)
+{
+	if (hpsjam_sound_name != 0)
+		status = QString("Null audio input from %1").arg(QString::fromUtf8(hpsjam_sound_name));
+	else
+		status = "Null audio input with a sine tone";
+}
+
+Q_DECL_EXPORT void
+hpsjam_sound_get_output_status(QString &status)
+{
+	status = "Null audio output";
+}
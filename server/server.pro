@@ -0,0 +1,37 @@
+#
+# QMAKE project file for the HPSJAM server without Qt
+#
+TEMPLATE	= app
+CONFIG		+= release console
+CONFIG		-= qt app_bundle
+TARGET		= hpsjam-server
+DEFINES		+= HPSJAM_SERVER_ONLY
+
+SOURCES		+= ../src/hpsjam.cpp
+
+LIBS		+= -L$${OUT_PWD}/../engine -lhpsjam-engine
+PRE_TARGETDEPS	+= $${OUT_PWD}/../engine/libhpsjam-engine.a
+
+win32 {
+DEFINES         -= UNICODE
+LIBS		+= \
+	-ladvapi32 \
+	-lwinmm \
+	-lws2_32
+
+QMAKE_CXXFLAGS	+= -include winsock2.h
+QMAKE_CXXFLAGS	+= -include windows.h
+QMAKE_CXXFLAGS	+= -include ws2ipdef.h
+QMAKE_CXXFLAGS	+= -include ws2tcpip.h
+QMAKE_CXXFLAGS	+= -include winsock.h
+INCLUDEPATH	+= ../windows/include
+}
+
+!macx:!win32 {
+INCLUDEPATH     += $${PREFIX}/include
+}
+
+LIBS		+= -pthread
+
+target.path	= $${PREFIX}/bin
+INSTALLS	+= target
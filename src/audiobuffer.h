@@ -29,12 +29,27 @@
 #include <math.h>
 #include <assert.h>
 
+#include <atomic>
+
 #include "hpsjam.h"
 #include "protocol.h"
 
 #define	HPSJAM_MAX_SAMPLES \
 	(HPSJAM_SEQ_MAX * 2 * HPSJAM_DEF_SAMPLES)	/* samples */
 
+#define	HPSJAM_PLC_HISTORY 1024	/* samples */
+
+#if (HPSJAM_PLC_HISTORY & (HPSJAM_PLC_HISTORY - 1))
+#error "HPSJAM_PLC_HISTORY must be power of two."
+#endif
+
+#define	HPSJAM_RING_SAMPLES 64	/* samples per channel per frame */
+#define	HPSJAM_RING_FRAMES 128	/* frames */
+
+#if (HPSJAM_RING_FRAMES & (HPSJAM_RING_FRAMES - 1))
+#error "HPSJAM_RING_FRAMES must be power of two."
+#endif
+
 static inline float
 level_encode(float value)
 {
@@ -61,38 +76,339 @@ level_decode(float value)
 		return multiplier * (powf(1.0f + 255.0f, value) - 1.0f);
 }
 
+/*
+ * The level is updated by the audio thread and read by the GUI
+ * thread, and is therefore atomic.
+ */
 class hpsjam_audio_level {
 public:
-	float level;
+	std::atomic<float> level;
 
 	hpsjam_audio_level() {
 		clear();
 	};
 	void clear() {
-		level = 0;
+		level.store(0.0f);
 	};
 	void addSamples(const float *ptr, size_t num) {
+		float max = 0.0f;
 		for (size_t x = 0; x != num; x++) {
 			const float v = fabsf(ptr[x]);
-			if (v > level)
-				level = v;
+			if (v > max)
+				max = v;
 		}
-		if (level > 1.0f)
-			level = 1.0f;
+		if (max > 1.0f)
+			max = 1.0f;
+
+		float old = level.load(std::memory_order_relaxed);
+		while (max > old &&
+		    !level.compare_exchange_weak(old, max, std::memory_order_relaxed))
+			;
 	};
 	float getLevel() {
-		float retval = level;
-		level = retval / 2.0f;
+		float retval = level.load(std::memory_order_relaxed);
+		while (!level.compare_exchange_weak(retval, retval / 2.0f,
+		    std::memory_order_relaxed))
+			;
 		return (retval);
 	};
 };
 
+struct hpsjam_audio_frame {
+	float samples[2][HPSJAM_RING_SAMPLES];
+	uint16_t num;
+	bool silence;
+	bool lost;	/* silence replaces lost audio */
+};
+
+/*
+ * Wait-free single producer, single consumer ring-buffer of stereo
+ * audio frames. It is used to pass audio between the sound card
+ * thread and the network tick without any locks. If the ring is full,
+ * new audio is dropped.
+ */
+class hpsjam_audio_ring {
+	struct hpsjam_audio_frame frames[HPSJAM_RING_FRAMES];
+	std::atomic<size_t> producer;
+	std::atomic<size_t> consumer;
+public:
+	hpsjam_audio_ring() : producer(0), consumer(0) {
+	};
+
+	/* producer side */
+	struct hpsjam_audio_frame *getWrite() {
+		const size_t p = producer.load(std::memory_order_relaxed);
+		if (p - consumer.load(std::memory_order_acquire) == HPSJAM_RING_FRAMES)
+			return (0);
+		return (frames + (p % HPSJAM_RING_FRAMES));
+	};
+	void commitWrite() {
+		producer.store(producer.load(std::memory_order_relaxed) + 1,
+		    std::memory_order_release);
+	};
+	void addSamples(const float *left, const float *right, size_t num) {
+		struct hpsjam_audio_frame *pf;
+
+		while (num != 0 && (pf = getWrite()) != 0) {
+			const size_t delta = (num > HPSJAM_RING_SAMPLES) ?
+			    HPSJAM_RING_SAMPLES : num;
+			memcpy(pf->samples[0], left, sizeof(left[0]) * delta);
+			memcpy(pf->samples[1], right, sizeof(right[0]) * delta);
+			pf->num = delta;
+			pf->silence = false;
+			pf->lost = false;
+			commitWrite();
+			left += delta;
+			right += delta;
+			num -= delta;
+		}
+	};
+	void addSilence(size_t num, bool lost) {
+		struct hpsjam_audio_frame *pf = getWrite();
+
+		if (pf != 0) {
+			pf->num = num;
+			pf->silence = true;
+			pf->lost = lost;
+			commitWrite();
+		}
+	};
+
+	/* consumer side */
+	const struct hpsjam_audio_frame *getRead() {
+		const size_t c = consumer.load(std::memory_order_relaxed);
+		if (producer.load(std::memory_order_acquire) == c)
+			return (0);
+		return (frames + (c % HPSJAM_RING_FRAMES));
+	};
+	void commitRead() {
+		consumer.store(consumer.load(std::memory_order_relaxed) + 1,
+		    std::memory_order_release);
+	};
+	void drain() {
+		while (getRead() != 0)
+			commitRead();
+	};
+};
+
+/*
+ * Packet loss concealment, PLC, using pitch based waveform
+ * repetition. The last pitch period of the received audio is
+ * repeated and slowly faded out, until real audio is available
+ * again.
+ */
+class hpsjam_audio_plc {
+	static constexpr size_t minPeriod = HPSJAM_SAMPLE_RATE / 400;	/* 2.5ms */
+	static constexpr size_t maxPeriod = HPSJAM_SAMPLE_RATE / 100;	/* 10ms */
+	static constexpr size_t corrSamples = HPSJAM_SAMPLE_RATE / 200;	/* 5ms */
+	static constexpr size_t holdSamples = 10 * HPSJAM_DEF_SAMPLES;	/* 10ms */
+	static constexpr size_t decaySamples = 40 * HPSJAM_DEF_SAMPLES;	/* 40ms */
+#if ((2 * HPSJAM_SAMPLE_RATE / 100) > HPSJAM_PLC_HISTORY)
+#error "Please increase HPSJAM_PLC_HISTORY"
+#endif
+public:
+	float history[HPSJAM_PLC_HISTORY];
+	float wave[maxPeriod];
+	size_t offset;
+	size_t period;
+	size_t phase;
+	size_t count;
+	bool active;
+
+	hpsjam_audio_plc() {
+		clear();
+	};
+	void clear() {
+		memset(history, 0, sizeof(history));
+		memset(wave, 0, sizeof(wave));
+		offset = 0;
+		period = minPeriod;
+		phase = 0;
+		count = 0;
+		active = false;
+	};
+
+	/* get sample from history, where age 1 is the last sample */
+	float getHistory(size_t age) const {
+		return (history[(offset - age) & (HPSJAM_PLC_HISTORY - 1)]);
+	};
+
+	/* keep track of the last played samples */
+	void addHistory(const float *src, size_t num) {
+		if (num > HPSJAM_PLC_HISTORY) {
+			src += num - HPSJAM_PLC_HISTORY;
+			num = HPSJAM_PLC_HISTORY;
+		}
+		while (num != 0) {
+			const size_t index = offset & (HPSJAM_PLC_HISTORY - 1);
+			size_t fwd = HPSJAM_PLC_HISTORY - index;
+
+			if (fwd > num)
+				fwd = num;
+			memcpy(history + index, src, sizeof(history[0]) * fwd);
+			src += fwd;
+			num -= fwd;
+			offset += fwd;
+		}
+	};
+
+	/* estimate the pitch period using normalized cross correlation */
+	size_t getPeriod() const {
+		float temp[maxPeriod + corrSamples];
+		const float *ref = temp + maxPeriod;
+		float best_score = 0.0f;
+		size_t best = 0;
+
+		for (size_t x = 0; x != maxPeriod + corrSamples; x++)
+			temp[x] = getHistory(maxPeriod + corrSamples - x);
+
+		/* coarse search first, then refine around the best match */
+		for (size_t pass = 0; pass != 2; pass++) {
+			const size_t step = pass ? 1 : 2;
+			const size_t start = pass ? (best > minPeriod ? best - 1 : minPeriod) : minPeriod;
+			const size_t stop = pass ? (best < maxPeriod ? best + 1 : maxPeriod) : maxPeriod;
+
+			if (pass != 0 && best == 0)
+				break;
+
+			for (size_t t = start; t <= stop; t += step) {
+				const float *cand = ref - t;
+				float corr = 0.0f;
+				float energy = 0.0f;
+
+				for (size_t x = 0; x != corrSamples; x++) {
+					corr += ref[x] * cand[x];
+					energy += cand[x] * cand[x];
+				}
+				if (corr <= 0.0f || energy <= 1e-9f)
+					continue;
+				corr = (corr * corr) / energy;
+				if (corr > best_score) {
+					best_score = corr;
+					best = t;
+				}
+			}
+		}
+		return (best ? best : minPeriod);
+	};
+
+	/* setup the waveform to repeat */
+	void start() {
+		period = getPeriod();
+
+		const size_t overlap = period / 4;
+
+		for (size_t x = 0; x != period; x++)
+			wave[x] = getHistory(period - x);
+
+		/* smooth the wrap-around from the end to the start of the period */
+		for (size_t x = 0; x != overlap; x++) {
+			const size_t y = period - overlap + x;
+			const float f = (x + 1.0f) / (overlap + 1.0f);
+
+			wave[y] = wave[y] * (1.0f - f) + getHistory(2 * period - y) * f;
+		}
+
+		phase = 0;
+		count = 0;
+		active = true;
+	};
+
+	void stop() {
+		active = false;
+	};
+
+	/* get one concealment sample */
+	float getSample() {
+		float gain;
+
+		if (active == false)
+			start();
+
+		if (count < holdSamples) {
+			gain = 1.0f;
+		} else if (count < holdSamples + decaySamples) {
+			gain = 1.0f - (float)(count - holdSamples) / (float)decaySamples;
+		} else {
+			return (0.0f);
+		}
+
+		const float retval = wave[phase] * gain;
+
+		if (++phase == period)
+			phase = 0;
+		count++;
+		return (retval);
+	};
+};
+
+/*
+ * The drift compensator tracks the clock ratio between a remote
+ * sound card and the local timer. The buffer level is low pass
+ * filtered and fed into a PI controller which outputs the number
+ * of input samples to consume for every output sample.
+ */
+class hpsjam_audio_drift {
+public:
+	static constexpr double maxPPM = 2000.0e-6;
+	static constexpr double kP = 1.0e-5;	/* per sample of error */
+	static constexpr double kI = 1.0e-9;	/* per sample of error, per tick */
+
+	double phase;		/* fractional read position */
+	double ratio;		/* input samples per output sample */
+	double level;		/* smoothed buffer level, in samples */
+	double integral;
+
+	void clear() {
+		phase = 0.0;
+		ratio = 1.0;
+		level = 0.0;
+		integral = 0.0;
+	};
+
+	hpsjam_audio_drift() {
+		clear();
+	};
+
+	/* compute new ratio, must be called once per tick */
+	void update(size_t total, size_t target) {
+		level += ((double)total - level) / 64.0;
+
+		const double error = level - (double)target;
+
+		integral += kI * error;
+		if (integral > maxPPM)
+			integral = maxPPM;
+		else if (integral < -maxPPM)
+			integral = -maxPPM;
+
+		double adjust = kP * error + integral;
+		if (adjust > maxPPM)
+			adjust = maxPPM;
+		else if (adjust < -maxPPM)
+			adjust = -maxPPM;
+
+		ratio = 1.0 + adjust;
+	};
+
+	/* number of whole input samples consumed by "num" output samples */
+	size_t consumed(size_t num) const {
+		return ((size_t)(phase + num * ratio));
+	};
+
+	/* advance fractional read position */
+	void advance(size_t num) {
+		const double pos = phase + num * ratio;
+		phase = pos - floor(pos);
+	};
+};
+
 class hpsjam_audio_buffer {
 	enum { fadeSamples = HPSJAM_DEF_SAMPLES };
 public:
 	float samples[HPSJAM_MAX_SAMPLES];
 	float stats[HPSJAM_SEQ_MAX * 2];
-	float last_sample;
+	class hpsjam_audio_plc plc;
 	size_t consumer;
 	size_t total;
 	uint16_t limit;
@@ -101,14 +417,14 @@ public:
 	void clear() {
 		memset(samples, 0, sizeof(samples));
 		memset(stats, 0, sizeof(stats));
-		last_sample = 0;
+		plc.clear();
 		consumer = 0;
 		total = 0;
 		limit = 3;	/* minimum value for handling one packet loss */
-		fade_in = fadeSamples;
+		fade_in = 0;
 	};
 	void set_jitter_limit_in_ms(uint16_t _limit) {
-		limit = _limit + 3;
+		limit = _limit;
 	};
 
 	hpsjam_audio_buffer() {
@@ -147,21 +463,8 @@ public:
 			return (1);
 	};
 
-	/* remove samples from buffer, must be called periodically */
-	void remSamples(float *dst, size_t num) {
-		size_t fwd = HPSJAM_MAX_SAMPLES - consumer;
-
-		/* fill missing samples with last value */
-		if (total < num) {
-			for (size_t x = total; x != num; x++) {
-				last_sample -= last_sample / HPSJAM_SAMPLE_RATE;
-				dst[x] = last_sample;
-			}
-			fade_in = fadeSamples;
-			num = total;
-		}
-
-		/* keep track of low water mark */
+	/* keep track of low water mark, and shrink buffer when needed */
+	void updateStats(size_t num) {
 		const uint8_t index = (total - num) / HPSJAM_DEF_SAMPLES;
 
 		stats[index] += 1.0f;
@@ -176,12 +479,27 @@ public:
 			 * Shrink the buffer depending on the amount
 			 * of supplied data:
 			 */
-			if (total >= num + HPSJAM_DEF_SAMPLES && high > 1) {
+			if (total >= num + HPSJAM_DEF_SAMPLES && high > 1)
 				shrink();
-				/* need to update FWD now consumer is changed */
-				fwd = HPSJAM_MAX_SAMPLES - consumer;
-			}
 		}
+	};
+
+	/* remove samples from buffer, must be called periodically */
+	void remSamples(float *dst, size_t num) {
+		size_t fwd;
+
+		/* conceal missing samples */
+		if (total < num) {
+			for (size_t x = total; x != num; x++)
+				dst[x] = plc.getSample();
+			plc.addHistory(dst + total, num - total);
+			fade_in = fadeSamples;
+			num = total;
+		}
+
+		updateStats(num);
+
+		fwd = HPSJAM_MAX_SAMPLES - consumer;
 
 		/* copy samples from ring-buffer */
 		while (num != 0) {
@@ -202,6 +520,53 @@ public:
 		}
 	};
 
+	/* get sample relative to the consumer position */
+	float peekSample(ssize_t offset) const {
+		return (samples[(consumer + HPSJAM_MAX_SAMPLES + offset) % HPSJAM_MAX_SAMPLES]);
+	};
+
+	/*
+	 * Remove samples from buffer at the rate given by the drift
+	 * compensator, using cubic Hermite interpolation. The sample
+	 * just before the consumer position is still in the ring-buffer
+	 * unless the buffer is completely full.
+	 */
+	void remSamplesDrift(float *dst, size_t num, const class hpsjam_audio_drift &drift) {
+		size_t need = drift.consumed(num);
+
+		/* conceal missing samples */
+		if (total < need + 2) {
+			remSamples(dst, num);
+			return;
+		}
+
+		updateStats(need);
+
+		/* check if buffer was shrunk */
+		if (total < need + 2) {
+			remSamples(dst, num);
+			return;
+		}
+
+		for (size_t x = 0; x != num; x++) {
+			const double pos = drift.phase + x * drift.ratio;
+			const ssize_t i = (ssize_t)pos;
+			const float t = pos - i;
+			const float ym1 = peekSample(i - 1);
+			const float y0 = peekSample(i);
+			const float y1 = peekSample(i + 1);
+			const float y2 = peekSample(i + 2);
+			const float c1 = 0.5f * (y1 - ym1);
+			const float c2 = ym1 - 2.5f * y0 + 2.0f * y1 - 0.5f * y2;
+			const float c3 = 0.5f * (y2 - ym1) + 1.5f * (y0 - y1);
+
+			dst[x] = ((c3 * t + c2) * t + c1) * t + y0;
+		}
+
+		consumer = (consumer + need) % HPSJAM_MAX_SAMPLES;
+		total -= need;
+	};
+
 	/* add samples to buffer */
 	void addSamples(const float *src, size_t num) {
 		size_t producer = (consumer + total) % HPSJAM_MAX_SAMPLES;
@@ -216,19 +581,21 @@ public:
 			if (fwd > num)
 				fwd = num;
 			if (fwd != 0) {
-				/* check if there was a discontinuity, and fade in audio */
+				/* check if there was a discontinuity, and cross-fade audio */
 				if (fade_in != 0) {
 					for (size_t x = 0; x != fwd; x++) {
 						const float f = (float)fade_in / (float)fadeSamples;
-						last_sample -= last_sample / HPSJAM_SAMPLE_RATE;
-						samples[producer + x] = src[x] - f * src[x] + last_sample * f;
+						samples[producer + x] = src[x] - f * src[x] +
+						    plc.getSample() * f;
 						fade_in -= (fade_in != 0);
 					}
+					if (fade_in == 0)
+						plc.stop();
 				} else {
 					memcpy(samples + producer, src, sizeof(samples[0]) * fwd);
 				}
-				/* update last sample */
-				last_sample = samples[producer + fwd - 1];
+				/* update history */
+				plc.addHistory(samples + producer, fwd);
 				src += fwd;
 				num -= fwd;
 				total += fwd;
@@ -244,8 +611,21 @@ public:
 		}
 	};
 
-	/* add silence to buffer */
-	void addSilence(size_t num) {
+	/* add silence to buffer, concealing lost audio */
+	void addSilence(size_t num, bool lost) {
+		static const float zero[HPSJAM_DEF_SAMPLES] = {};
+
+		/* real silence is cross-faded like any other audio */
+		if (lost == false) {
+			while (num != 0) {
+				const size_t delta = (num > HPSJAM_DEF_SAMPLES) ?
+				    HPSJAM_DEF_SAMPLES : num;
+				addSamples(zero, delta);
+				num -= delta;
+			}
+			return;
+		}
+
 		size_t producer = (consumer + total) % HPSJAM_MAX_SAMPLES;
 		size_t fwd = HPSJAM_MAX_SAMPLES - producer;
 		size_t max = HPSJAM_MAX_SAMPLES - total;
@@ -258,10 +638,9 @@ public:
 			if (fwd > num)
 				fwd = num;
 			if (fwd != 0) {
-				for (size_t x = 0; x != fwd; x++) {
-					last_sample -= last_sample / HPSJAM_SAMPLE_RATE;
-					samples[producer + x] = last_sample;
-				}
+				for (size_t x = 0; x != fwd; x++)
+					samples[producer + x] = plc.getSample();
+				plc.addHistory(samples + producer, fwd);
 				fade_in = fadeSamples;
 				num -= fwd;
 				total += fwd;
@@ -0,0 +1,163 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "audiofile.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static uint32_t
+hpsjam_audio_file_le16(const uint8_t *ptr)
+{
+	return (ptr[0] | (ptr[1] << 8));
+}
+
+static uint32_t
+hpsjam_audio_file_le32(const uint8_t *ptr)
+{
+	return (ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24));
+}
+
+static float
+hpsjam_audio_file_sample(const uint8_t *ptr, unsigned format, unsigned bits)
+{
+	int32_t value;
+	float temp;
+
+	switch (bits) {
+	case 16:
+		return ((int16_t)hpsjam_audio_file_le16(ptr) / 32768.0f);
+	case 24:
+		value = (int32_t)(((uint32_t)ptr[0] << 8) |
+		    ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 24));
+		return (value / 2147483648.0f);
+	default:
+		value = (int32_t)hpsjam_audio_file_le32(ptr);
+		if (format == 1)
+			return (value / 2147483648.0f);
+		memcpy(&temp, &value, sizeof(temp));
+		return (temp);
+	}
+}
+
+/*
+ * Load a 48kHz mono or stereo WAV file, in 16-, 24- or 32-bit
+ * integer or 32-bit floating point format. Returns true on failure.
+ */
+bool
+hpsjam_audio_file :: load(const char *fname)
+{
+	uint8_t hdr[12];
+	uint8_t fmt[40];
+	unsigned format = 0;
+	unsigned channels = 0;
+	unsigned bits = 0;
+	FILE *fp;
+
+	fp = fopen(fname, "rb");
+	if (fp == 0)
+		return (true);
+
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr, "RIFF", 4) != 0 || memcmp(hdr + 8, "WAVE", 4) != 0)
+		goto error;
+
+	while (fread(hdr, 8, 1, fp) == 1) {
+		const uint32_t size = hpsjam_audio_file_le32(hdr + 4);
+
+		if (memcmp(hdr, "fmt ", 4) == 0) {
+			if (size < 16 || size > sizeof(fmt) ||
+			    fread(fmt, size, 1, fp) != 1)
+				goto error;
+			format = hpsjam_audio_file_le16(fmt);
+			channels = hpsjam_audio_file_le16(fmt + 2);
+			bits = hpsjam_audio_file_le16(fmt + 14);
+
+			/* check for extensible format */
+			if (format == 0xFFFE && size >= 26)
+				format = hpsjam_audio_file_le16(fmt + 24);
+			if (hpsjam_audio_file_le32(fmt + 4) != HPSJAM_SAMPLE_RATE ||
+			    (channels != 1 && channels != 2) ||
+			    !((format == 1 && (bits == 16 || bits == 24 || bits == 32)) ||
+			      (format == 3 && bits == 32)))
+				goto error;
+			if (size & 1)
+				fseek(fp, 1, SEEK_CUR);
+		} else if (memcmp(hdr, "data", 4) == 0) {
+			const size_t frame = channels * (bits / 8);
+
+			if (frame == 0 || size < frame)
+				goto error;
+
+			uint8_t *temp = new uint8_t [size];
+			const size_t num = fread(temp, 1, size, fp) / frame;
+
+			delete [] data;
+			data = new float [2 * num];
+			samples = num;
+
+			for (size_t x = 0; x != num; x++) {
+				const uint8_t *ptr = temp + x * frame;
+
+				data[2 * x] = hpsjam_audio_file_sample(ptr, format, bits);
+				data[2 * x + 1] = (channels == 2) ?
+				    hpsjam_audio_file_sample(ptr + bits / 8, format, bits) :
+				    data[2 * x];
+			}
+			delete [] temp;
+			fclose(fp);
+			return (samples == 0);
+		} else {
+			fseek(fp, size + (size & 1), SEEK_CUR);
+		}
+	}
+error:
+	fclose(fp);
+	return (true);
+}
+
+/* get the next samples, looping the file, or a sine tone if no file */
+void
+hpsjam_audio_player :: getSamples(float *left, float *right, size_t num)
+{
+	if (file == 0 || file->samples == 0) {
+		for (size_t x = 0; x != num; x++) {
+			left[x] = right[x] = 0.25f * sinf(phase);
+			phase += step;
+			if (phase > 2.0f * 3.14159265f)
+				phase -= 2.0f * 3.14159265f;
+		}
+		return;
+	}
+
+	for (size_t x = 0; x != num; x++) {
+		left[x] = file->data[2 * offset];
+		right[x] = file->data[2 * offset + 1];
+		if (++offset == file->samples)
+			offset = 0;
+	}
+}
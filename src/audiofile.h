@@ -0,0 +1,67 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _HPSJAM_AUDIOFILE_H_
+#define	_HPSJAM_AUDIOFILE_H_
+
+#include <stddef.h>
+
+#include "hpsjam.h"
+
+/*
+ * Test audio for the null audio backend and the load generator. The
+ * audio is either a WAV file, which is played in a loop, or a sine
+ * tone. The file data can be shared by many players.
+ */
+struct hpsjam_audio_file {
+	float *data;		/* interleaved stereo samples */
+	size_t samples;
+
+	hpsjam_audio_file() {
+		data = 0;
+		samples = 0;
+	};
+	~hpsjam_audio_file() {
+		delete [] data;
+	};
+	bool load(const char *);
+};
+
+struct hpsjam_audio_player {
+	const struct hpsjam_audio_file *file;
+	size_t offset;
+	float phase;
+	float step;
+
+	void init(const struct hpsjam_audio_file *_file, float freq) {
+		file = _file;
+		offset = 0;
+		phase = 0.0f;
+		step = 2.0f * 3.14159265f * freq / HPSJAM_SAMPLE_RATE;
+	};
+	void getSamples(float *, float *, size_t);
+};
+
+#endif		/* _HPSJAM_AUDIOFILE_H_ */
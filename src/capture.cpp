@@ -0,0 +1,295 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsjam.h"
+#include "capture.h"
+#include "server.h"
+#include "timer.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <err.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+/*
+ * Each receive thread copies the received frames into its own
+ * lock-free ring buffer. A separate low priority thread merges the
+ * rings in arrival order and appends them to the capture file. If a
+ * ring overflows the frame is dropped from the capture, but is still
+ * processed as usual. The replay feeds the captured frames into the
+ * server in the same tick they were originally received, so that
+ * sessions can be reproduced and profiled offline.
+ */
+#define	HPSJAM_CAPTURE_PERIOD 20000	/* writer period in microseconds */
+
+struct hpsjam_capture_entry {
+	struct hpsjam_capture_record rec;
+	uint8_t data[HPSJAM_MAX_UDP];
+};
+
+struct hpsjam_capture_ring {
+	struct hpsjam_capture_entry entry[HPSJAM_CAPTURE_RING];
+	std::atomic<size_t> producer;	/* frames pushed by the receive thread */
+	std::atomic<size_t> consumer;	/* frames written by the writer */
+
+	hpsjam_capture_ring() : producer(0), consumer(0) { };
+};
+
+const char *hpsjam_capture_file;
+const char *hpsjam_replay_file;
+bool hpsjam_replay_fast;
+
+static struct hpsjam_capture_ring *hpsjam_capture_rings;
+static std::atomic<unsigned> hpsjam_capture_threads;
+static std::atomic<uint32_t> hpsjam_capture_ticks;
+static std::atomic<uint64_t> hpsjam_capture_dropped;
+static std::chrono::steady_clock::time_point hpsjam_capture_start;
+static FILE *hpsjam_capture_fp;
+
+static void
+hpsjam_capture_flush()
+{
+	const unsigned num = hpsjam_capture_threads.load(std::memory_order_acquire);
+	size_t prod[HPSJAM_CAPTURE_THREADS];
+	size_t cons[HPSJAM_CAPTURE_THREADS];
+
+	for (unsigned x = 0; x != num && x != HPSJAM_CAPTURE_THREADS; x++) {
+		prod[x] = hpsjam_capture_rings[x].producer.load(std::memory_order_acquire);
+		cons[x] = hpsjam_capture_rings[x].consumer.load(std::memory_order_relaxed);
+	}
+
+	/* merge the rings, oldest frame first */
+	while (1) {
+		const struct hpsjam_capture_entry *pe = 0;
+		unsigned y = 0;
+
+		for (unsigned x = 0; x != num && x != HPSJAM_CAPTURE_THREADS; x++) {
+			if (cons[x] == prod[x])
+				continue;
+			const struct hpsjam_capture_entry &entry =
+			    hpsjam_capture_rings[x].entry[cons[x] % HPSJAM_CAPTURE_RING];
+			if (pe == 0 || entry.rec.usec < pe->rec.usec) {
+				pe = &entry;
+				y = x;
+			}
+		}
+		if (pe == 0)
+			break;
+
+		fwrite(&pe->rec, sizeof(pe->rec), 1, hpsjam_capture_fp);
+		fwrite(pe->data, pe->rec.length, 1, hpsjam_capture_fp);
+
+		cons[y]++;
+		hpsjam_capture_rings[y].consumer.store(cons[y], std::memory_order_release);
+	}
+	fflush(hpsjam_capture_fp);
+}
+
+static void *
+hpsjam_capture_loop(void *)
+{
+	uint64_t dropped = 0;
+
+	while (1) {
+		usleep(HPSJAM_CAPTURE_PERIOD);
+
+		hpsjam_capture_flush();
+
+		const uint64_t value = hpsjam_capture_dropped.load(std::memory_order_relaxed);
+		if (value != dropped) {
+			warnx("Capture dropped %llu frames", (unsigned long long)(value - dropped));
+			dropped = value;
+		}
+	}
+	return (0);
+}
+
+Q_DECL_EXPORT void
+hpsjam_capture_init()
+{
+	pthread_t pt;
+	int ret;
+
+	if (hpsjam_capture_file == 0)
+		return;
+
+	hpsjam_capture_fp = fopen(hpsjam_capture_file, "wb");
+	if (hpsjam_capture_fp == 0)
+		errx(1, "Cannot create capture file %s", hpsjam_capture_file);
+	setvbuf(hpsjam_capture_fp, 0, _IOFBF, 1U << 20);
+	fwrite(HPSJAM_CAPTURE_MAGIC, 8, 1, hpsjam_capture_fp);
+
+	hpsjam_capture_rings = new struct hpsjam_capture_ring [HPSJAM_CAPTURE_THREADS];
+	hpsjam_capture_start = std::chrono::steady_clock::now();
+
+	ret = pthread_create(&pt, 0, &hpsjam_capture_loop, 0);
+	assert(ret == 0);
+}
+
+/* called from the receive threads for every valid frame */
+Q_DECL_EXPORT void
+hpsjam_capture_frame(const struct hpsjam_socket_address &src,
+    const union hpsjam_frame &frame, size_t length)
+{
+	static thread_local unsigned index = -1U;
+	struct hpsjam_capture_ring *pr;
+
+	if (index == -1U)
+		index = hpsjam_capture_threads.fetch_add(1);
+	if (index >= HPSJAM_CAPTURE_THREADS)
+		return;
+
+	pr = hpsjam_capture_rings + index;
+
+	const size_t prod = pr->producer.load(std::memory_order_relaxed);
+	if (prod - pr->consumer.load(std::memory_order_acquire) >= HPSJAM_CAPTURE_RING) {
+		hpsjam_capture_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	struct hpsjam_capture_entry &entry = pr->entry[prod % HPSJAM_CAPTURE_RING];
+
+	memset(&entry.rec, 0, sizeof(entry.rec));
+	entry.rec.usec = std::chrono::duration_cast<std::chrono::microseconds>(
+	    std::chrono::steady_clock::now() - hpsjam_capture_start).count();
+	entry.rec.tick = hpsjam_capture_ticks.load(std::memory_order_relaxed);
+	entry.rec.length = length;
+	entry.rec.addr_len = src.toBytes(entry.rec.addr);
+	memcpy(entry.data, frame.raw, length);
+
+	pr->producer.store(prod + 1, std::memory_order_release);
+}
+
+/* called from the server tick, after all audio has been sent */
+Q_DECL_EXPORT void
+hpsjam_capture_tick()
+{
+	hpsjam_capture_ticks.fetch_add(1, std::memory_order_relaxed);
+}
+
+static bool
+hpsjam_replay_read(FILE *fp, struct hpsjam_capture_record &rec, union hpsjam_frame &frame)
+{
+	const size_t last = rec.length;
+
+	if (fread(&rec, sizeof(rec), 1, fp) != 1)
+		return (false);
+	if (rec.length < sizeof(frame.hdr) || rec.length > sizeof(frame) ||
+	    rec.addr_len > sizeof(rec.addr)) {
+		warnx("Corrupt capture record at offset %ld", ftell(fp));
+		return (false);
+	}
+	if (fread(frame.raw, rec.length, 1, fp) != 1)
+		return (false);
+	/* zero end of previous frame, like the receive thread does */
+	frame.zero_tail(rec.length, last);
+	return (true);
+}
+
+/*
+ * Replay a capture file through the server. All packets the server
+ * sends are written to the null device, so nothing leaves this
+ * machine. The server must be configured with the same number of
+ * peers, rooms and passwords as when the capture was made.
+ */
+Q_DECL_EXPORT int
+hpsjam_replay()
+{
+	struct hpsjam_capture_record rec;
+	struct hpsjam_socket_address src;
+	union hpsjam_frame frame;
+	char magic[8];
+	uint64_t frames = 0;
+	uint32_t ticks = 0;
+	bool more;
+	FILE *fp;
+	int fd;
+
+	fp = fopen(hpsjam_replay_file, "rb");
+	if (fp == 0)
+		errx(1, "Cannot open capture file %s", hpsjam_replay_file);
+	if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+	    memcmp(magic, HPSJAM_CAPTURE_MAGIC, sizeof(magic)) != 0)
+		errx(1, "File %s is not a capture file", hpsjam_replay_file);
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0)
+		errx(1, "Cannot open the null device");
+
+	frame.clear();
+	rec.length = 0;
+	more = hpsjam_replay_read(fp, rec, frame);
+
+	/* start at the tick of the first frame */
+	const uint32_t first = more ? rec.tick : 0;
+	const auto start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::duration busy(0);
+
+	while (more) {
+		const auto tick_start = std::chrono::steady_clock::now();
+
+		/* feed all frames received before this tick completed */
+		while (more && rec.tick - first <= ticks) {
+			if (src.fromBytes(rec.addr, rec.addr_len)) {
+				src.fd = fd;
+				hpsjam_server_receive(src, frame, rec.length);
+				frames++;
+			}
+			more = hpsjam_replay_read(fp, rec, frame);
+		}
+
+		hpsjam_server_tick();
+		hpsjam_ticks++;
+		ticks++;
+
+		busy += std::chrono::steady_clock::now() - tick_start;
+
+		if (hpsjam_replay_fast == false)
+			std::this_thread::sleep_until(start + std::chrono::milliseconds(ticks));
+	}
+
+	const double wall = std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - start).count();
+	const double usec = std::chrono::duration<double, std::micro>(busy).count();
+
+	printf("HpsJam: replayed %llu frames in %u ticks, "
+	    "%.3f seconds wall time, %.2f us average per tick\n",
+	    (unsigned long long)frames, ticks, wall,
+	    ticks ? usec / ticks : 0.0);
+
+	::close(fd);
+	fclose(fp);
+	return (0);
+}
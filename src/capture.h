@@ -0,0 +1,59 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _HPSJAM_CAPTURE_H_
+#define	_HPSJAM_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hpsjam.h"
+
+#define	HPSJAM_CAPTURE_MAGIC "HPSJAMC1"
+#define	HPSJAM_CAPTURE_THREADS 4	/* receive threads */
+#define	HPSJAM_CAPTURE_RING 512		/* frames per receive thread */
+
+/* on-disk record header, in host byte order, followed by the frame */
+struct hpsjam_capture_record {
+	uint64_t usec;		/* arrival time, relative to start of capture */
+	uint32_t tick;		/* server ticks completed before arrival */
+	uint16_t length;	/* frame length in bytes */
+	uint8_t addr_len;
+	uint8_t addr[25];	/* source address, see hpsjam_socket_address::toBytes() */
+};
+
+struct hpsjam_socket_address;
+union hpsjam_frame;
+
+extern const char *hpsjam_capture_file;
+extern const char *hpsjam_replay_file;
+extern bool hpsjam_replay_fast;
+
+extern void hpsjam_capture_init();
+extern void hpsjam_capture_frame(const struct hpsjam_socket_address &, const union hpsjam_frame &, size_t);
+extern void hpsjam_capture_tick();
+extern int hpsjam_replay();
+
+#endif		/* _HPSJAM_CAPTURE_H_ */
@@ -97,6 +97,10 @@ HpsJamClient :: HpsJamClient() : gl(this), b_connect(tr("S&ERVER")),
 		w_lyrics, SLOT(handle_font_dialog()));
 
 	/* connect client signals */
+	connect(hpsjam_client_peer, SIGNAL(receivedChat(QString *)),
+		this, SLOT(handle_received_chat(QString *)));
+	connect(hpsjam_client_peer, SIGNAL(receivedLyrics(QString *)),
+		this, SLOT(handle_received_lyrics(QString *)));
 	connect(hpsjam_client_peer, SIGNAL(receivedFaderLevel(uint8_t,uint8_t,float,float)),
 		w_mixer, SLOT(handle_fader_level(uint8_t,uint8_t,float,float)));
 	connect(hpsjam_client_peer, SIGNAL(receivedFaderGain(uint8_t,uint8_t,float)),
@@ -204,6 +208,20 @@ HpsJamClient :: closeEvent(QCloseEvent *event)
 	QCoreApplication::exit(0);
 }
 
+void
+HpsJamClient :: handle_received_chat(QString *str)
+{
+	w_chat->append(*str);
+	delete str;
+}
+
+void
+HpsJamClient :: handle_received_lyrics(QString *str)
+{
+	w_lyrics->append(*str);
+	delete str;
+}
+
 void
 HpsJamClient :: saveSettings()
 {
@@ -220,6 +238,7 @@ HpsJamClient :: saveSettings()
 	settings.setValue("effects_level", w_config->effects.selection);
 	settings.setValue("uplink_format", w_config->up_fmt.selection);
 	settings.setValue("downlink_format", w_config->down_fmt.selection);
+	settings.setValue("jitter_target", w_config->jitter.selection);
 	settings.setValue("input_device", w_config->audio_dev.handle_toggle_input_device(-2));
 	settings.setValue("output_device", w_config->audio_dev.handle_toggle_output_device(-2));
 	settings.setValue("input_left", w_config->audio_dev.handle_toggle_input_left(-2));
@@ -242,6 +261,7 @@ HpsJamClient :: loadSettings()
 	HPSJAM_NO_SIGNAL(w_config->effects,setIndex(settings.value("config/effects_level", QString("0")).toInt()));
 	w_config->up_fmt.setIndex(settings.value("config/uplink_format", QString("1")).toInt());
 	w_config->down_fmt.setIndex(settings.value("config/downlink_format", QString("1")).toInt());
+	w_config->jitter.setIndex(settings.value("config/jitter_target", QString("%1").arg(HPSJAM_JITTER_TARGET_DEFAULT)).toInt());
 
 	input_device = settings.value("config/input_device", QString("-1")).toInt();
 	output_device = settings.value("config/output_device", QString("-1")).toInt();
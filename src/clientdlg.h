@@ -116,6 +116,8 @@ public slots:
 	void handle_stats();
 	void handle_help();
 	void handle_watchdog();
+	void handle_received_chat(QString *);
+	void handle_received_lyrics(QString *);
 };
 
 #endif		/* _HPSJAM_CLIENTDLG_H_ */
@@ -23,4 +23,70 @@
  * SUCH DAMAGE.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+
+#include "hpsjam.h"
 #include "compressor.h"
+
+#define	HPSJAM_LIMITER_BENCH (HPSJAM_SAMPLE_RATE * 10)	/* samples */
+
+static void
+hpsjam_limiter_signal(float *left, float *right, size_t num, unsigned &seed)
+{
+	/* noise bursts which are sometimes above the limit */
+	for (size_t x = 0; x != num; x++) {
+		seed = seed * 1103515245U + 12345U;
+		const float value = (float)(int)(seed >> 8) / (float)(1U << 23) - 1.0f;
+		left[x] = value * 1.5f;
+		right[x] = - value * 0.5f;
+	}
+}
+
+static double
+hpsjam_limiter_measure(bool block, bool lookahead)
+{
+	float left[HPSJAM_DEF_SAMPLES];
+	float right[HPSJAM_DEF_SAMPLES];
+	struct hpsjam_stereo_limiter limiter;
+	unsigned seed = 1;
+	float peak = 0.0f;
+	double total = 0.0;
+
+	limiter.init(lookahead);
+
+	for (size_t n = 0; n != HPSJAM_LIMITER_BENCH; n += HPSJAM_DEF_SAMPLES) {
+		hpsjam_limiter_signal(left, right, HPSJAM_DEF_SAMPLES, seed);
+
+		const auto start = std::chrono::steady_clock::now();
+
+		if (block) {
+			limiter.doit(HPSJAM_SAMPLE_RATE, left, right, HPSJAM_DEF_SAMPLES);
+		} else {
+			for (size_t x = 0; x != HPSJAM_DEF_SAMPLES; x++) {
+				hpsjam_stereo_compressor(HPSJAM_SAMPLE_RATE,
+				    peak, left[x], right[x]);
+			}
+		}
+
+		const auto delta = std::chrono::steady_clock::now() - start;
+		total += std::chrono::duration<double, std::nano>(delta).count();
+	}
+
+	/* return nanoseconds per sample */
+	return (total / HPSJAM_LIMITER_BENCH);
+}
+
+int
+hpsjam_limiter_benchmark()
+{
+	printf("Limiter, nanoseconds per stereo sample:\n");
+	printf("%10s %10s %10s\n", "compressor", "block", "lookahead");
+	printf("%10.2f %10.2f %10.2f\n",
+	    hpsjam_limiter_measure(false, false),
+	    hpsjam_limiter_measure(true, false),
+	    hpsjam_limiter_measure(true, true));
+	return (0);
+}
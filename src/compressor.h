@@ -26,6 +26,10 @@
 #ifndef _HPSJAM_COMPRESSOR_H_
 #define	_HPSJAM_COMPRESSOR_H_
 
+#include "multiply.h"
+
+#define	HPSJAM_LIMITER_BLOCK 16	/* samples */
+
 static inline bool
 hpsjam_float_is_valid(const float x)
 {
@@ -97,4 +101,152 @@ hpsjam_mono_compressor(const float div, float &pv, float &l)
 	}
 }
 
+/*
+ * The stereo limiter is the block based version of the stereo
+ * compressor above. Invalid samples are zeroed and the peak is
+ * computed for up to HPSJAM_LIMITER_BLOCK samples at a time. The gain
+ * is then ramped towards the new value across the block. Without
+ * lookahead the gain is lowered immediately, while with lookahead the
+ * output is delayed by HPSJAM_LIMITER_BLOCK samples, so that the ramp
+ * completes before the peak reaches the output.
+ */
+struct hpsjam_stereo_limiter {
+	float peak;
+	float gain;
+	float delay[2][HPSJAM_LIMITER_BLOCK];
+	size_t delay_offset;
+	bool lookahead;
+
+	void clear() {
+		peak = 0.0f;
+		gain = 1.0f;
+		memset(delay, 0, sizeof(delay));
+		delay_offset = 0;
+	};
+
+	void init(bool _lookahead = false) {
+		clear();
+		lookahead = _lookahead;
+	};
+
+	hpsjam_stereo_limiter() {
+		init();
+	};
+
+	static float sanitize(float *l, float *r, size_t num) {
+		const hpsjam_x3_vec_t zero = {};
+		hpsjam_x3_vec_t vmax = {};
+		float retval = 0.0f;
+		size_t x;
+
+		for (x = 0; x + HPSJAM_X3_VEC <= num; x += HPSJAM_X3_VEC) {
+			hpsjam_x3_vec_t vl = hpsjam_x3_load(l + x);
+			hpsjam_x3_vec_t vr = hpsjam_x3_load(r + x);
+
+			/* NaN and infinity multiplied by zero is not zero */
+			vl = (vl * zero == zero) ? vl : zero;
+			vr = (vr * zero == zero) ? vr : zero;
+
+			hpsjam_x3_store(l + x, vl);
+			hpsjam_x3_store(r + x, vr);
+
+			vl = (vl < zero) ? -vl : vl;
+			vr = (vr < zero) ? -vr : vr;
+			vmax = (vl > vmax) ? vl : vmax;
+			vmax = (vr > vmax) ? vr : vmax;
+		}
+		for (size_t y = 0; y != HPSJAM_X3_VEC; y++) {
+			if (vmax[y] > retval)
+				retval = vmax[y];
+		}
+		for (; x != num; x++) {
+			if (!hpsjam_float_is_valid(l[x]))
+				l[x] = 0.0f;
+			if (!hpsjam_float_is_valid(r[x]))
+				r[x] = 0.0f;
+			if (l[x] > retval)
+				retval = l[x];
+			else if (l[x] < -retval)
+				retval = -l[x];
+			if (r[x] > retval)
+				retval = r[x];
+			else if (r[x] < -retval)
+				retval = -r[x];
+		}
+		return (retval);
+	};
+
+	void process(const float div, float *l, float *r, size_t num) {
+		/* see hpsjam_stereo_compressor() */
+		constexpr float __limit = 1.0f - (1.0f / 10.0f);
+		const float max = sanitize(l, r, num);
+		float target = 1.0f;
+		float step;
+		float g;
+
+		if (!hpsjam_float_is_valid(peak))
+			peak = 0.0f;
+		if (max > peak)
+			peak = max;
+		if (peak > __limit) {
+			target = __limit / peak;
+			peak -= peak * (float)num / div;
+		}
+
+		if (lookahead) {
+			for (size_t x = 0; x != num; x++) {
+				const float tl = delay[0][delay_offset];
+				const float tr = delay[1][delay_offset];
+
+				delay[0][delay_offset] = l[x];
+				delay[1][delay_offset] = r[x];
+				l[x] = tl;
+				r[x] = tr;
+				if (++delay_offset == HPSJAM_LIMITER_BLOCK)
+					delay_offset = 0;
+			}
+		}
+
+		if (lookahead == false && target < gain) {
+			g = target;
+			step = 0.0f;
+		} else {
+			g = gain;
+			step = (target - gain) / (float)num;
+		}
+		gain = target;
+
+		/* check for unity gain */
+		if (g == 1.0f && step == 0.0f)
+			return;
+
+		for (size_t x = 0; x != num; x++) {
+			g += step;
+
+			float tl = l[x] * g;
+			float tr = r[x] * g;
+
+			/* clip any residual overshoot from the ramp */
+			tl = (tl > __limit) ? __limit : ((tl < -__limit) ? -__limit : tl);
+			tr = (tr > __limit) ? __limit : ((tr < -__limit) ? -__limit : tr);
+
+			l[x] = tl;
+			r[x] = tr;
+		}
+	};
+
+	void doit(const float div, float *l, float *r, size_t num) {
+		while (num != 0) {
+			const size_t delta = (num > HPSJAM_LIMITER_BLOCK) ?
+			    HPSJAM_LIMITER_BLOCK : num;
+			process(div, l, r, delta);
+			l += delta;
+			r += delta;
+			num -= delta;
+		}
+	};
+};
+
+extern int hpsjam_limiter_benchmark();
+
 #endif		/* _HPSJAM_COMPRESSOR_H_ */
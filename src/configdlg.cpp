@@ -31,18 +31,6 @@
 #include "configdlg.h"
 #include "clientdlg.h"
 
-const struct hpsjam_audio_format hpsjam_audio_format[HPSJAM_AUDIO_FORMAT_MAX] = {
-	{ HPSJAM_TYPE_AUDIO_SILENCE, "DISABLE" , Qt::Key_0 },
-	{ HPSJAM_TYPE_AUDIO_8_BIT_1CH, "1CH@8Bit", Qt::Key_1 },
-	{ HPSJAM_TYPE_AUDIO_16_BIT_1CH, "1CH@16Bit", Qt::Key_3 },
-	{ HPSJAM_TYPE_AUDIO_24_BIT_1CH, "1CH@24Bit", Qt::Key_5 },
-	{ HPSJAM_TYPE_AUDIO_32_BIT_1CH, "1CH@32Bit", Qt::Key_7 },
-	{ HPSJAM_TYPE_AUDIO_8_BIT_2CH, "2CH@8Bit", Qt::Key_2 },
-	{ HPSJAM_TYPE_AUDIO_16_BIT_2CH, "2CH@16Bit", Qt::Key_4 },
-	{ HPSJAM_TYPE_AUDIO_24_BIT_2CH, "2CH@24Bit", Qt::Key_6 },
-	{ HPSJAM_TYPE_AUDIO_32_BIT_2CH, "2CH@32Bit", Qt::Key_8 },
-};
-
 const struct hpsjam_audio_levels hpsjam_audio_levels[HPSJAM_AUDIO_LEVELS_MAX] = {
 	{ "OFF", 0.0f },
 	{ "LOW", 1.0f / 32.0f },
@@ -178,12 +166,21 @@ HpsJamConfigEffects :: handle_selection()
 	}
 }
 
+void
+HpsJamConfigJitter :: handle_selection()
+{
+	for (unsigned x = 0; x != HPSJAM_JITTER_TARGET_MAX; x++) {
+		if (sender() == b + x)
+			setIndex(x);
+	}
+}
+
 void
 HpsJamConfig :: handle_up_config()
 {
 	QMutexLocker locker(&hpsjam_client_peer->lock);
 
-	if (hpsjam_client_peer->address.valid())
+	if (hpsjam_client_peer->address.valid() && hpsjam_client_listen == false)
 		hpsjam_client_peer->output_fmt = up_fmt.format;
 }
 
@@ -194,7 +191,8 @@ HpsJamConfig :: handle_down_config()
 
 	if (hpsjam_client_peer->address.valid()) {
 		struct hpsjam_packet_entry *pkt = new struct hpsjam_packet_entry;
-		pkt->packet.setConfigure(down_fmt.format);
+		hpsjam_client_peer->input_pkt.jitter.setTarget(jitter.selection);
+		pkt->packet.setConfigure(down_fmt.format, jitter.selection);
 		pkt->packet.type = HPSJAM_TYPE_CONFIGURE_REQUEST;
 		pkt->insert_tail(&hpsjam_client_peer->output_pkt.head);
 	}
@@ -27,6 +27,8 @@
 #define	_HPSJAM_CONFIGDLG_H_
 
 #include "hpsjam.h"
+#include "jitter.h"
+#include "peer.h"
 
 #include <QWidget>
 #include <QLabel>
@@ -35,14 +37,6 @@
 #include <QGroupBox>
 #include <QSpinBox>
 
-struct hpsjam_audio_format {
-	uint8_t format;
-	const char *descr;
-	int key;
-};
-
-extern const struct hpsjam_audio_format hpsjam_audio_format[HPSJAM_AUDIO_FORMAT_MAX];
-
 class HpsJamDeviceSelection : public QGroupBox {
 	Q_OBJECT;
 public:
@@ -207,6 +201,43 @@ signals:
 	void valueChanged();
 };
 
+class HpsJamConfigJitter : public QGroupBox {
+	Q_OBJECT;
+public:
+	HpsJamConfigJitter() : gl(this) {
+		for (unsigned x = 0; x != HPSJAM_JITTER_TARGET_MAX; x++) {
+			b[x].setFlat(x != HPSJAM_JITTER_TARGET_DEFAULT);
+			b[x].setText(hpsjam_jitter_target[x].descr);
+			connect(&b[x], SIGNAL(released()), this, SLOT(handle_selection()));
+			gl.addWidget(b + x, 0, x);
+		}
+		selection = HPSJAM_JITTER_TARGET_DEFAULT;
+	};
+	uint8_t selection;
+	QPushButton b[HPSJAM_JITTER_TARGET_MAX];
+	QGridLayout gl;
+	QString description;
+
+	void titleRegen() {
+		setTitle(description + QString(" :: %1").arg(hpsjam_jitter_target[selection].descr));
+	};
+
+	void setIndex(unsigned index) {
+		for (unsigned x = 0; x != HPSJAM_JITTER_TARGET_MAX; x++) {
+			b[x].setFlat(x != index);
+			if (x != index || index == selection)
+				continue;
+			selection = index;
+			titleRegen();
+			valueChanged();
+		}
+	};
+public slots:
+	void handle_selection();
+signals:
+	void valueChanged();
+};
+
 class HpsJamLyricsFormat : public QGroupBox {
 public:
 	HpsJamLyricsFormat() : gl(this), b_font_select(tr("Select font")) {
@@ -227,24 +258,30 @@ public:
 		down_fmt.description = tr("Downlink audio format");
 		down_fmt.titleRegen();
 
+		jitter.description = tr("Jitter buffer target");
+		jitter.titleRegen();
+
 		effects.description = tr("Sound effects");
 		effects.titleRegen();
 
 		gl.addWidget(&up_fmt, 0,0);
 		gl.addWidget(&down_fmt, 1,0);
-		gl.addWidget(&audio_dev, 2,0);
-		gl.addWidget(&effects, 3,0);
-		gl.addWidget(&lyrics_fmt, 4,0);
-		gl.setRowStretch(5,1);
+		gl.addWidget(&jitter, 2,0);
+		gl.addWidget(&audio_dev, 3,0);
+		gl.addWidget(&effects, 4,0);
+		gl.addWidget(&lyrics_fmt, 5,0);
+		gl.setRowStretch(6,1);
 
 		connect(&up_fmt, SIGNAL(valueChanged()), this, SLOT(handle_up_config()));
 		connect(&down_fmt, SIGNAL(valueChanged()), this, SLOT(handle_down_config()));
+		connect(&jitter, SIGNAL(valueChanged()), this, SLOT(handle_down_config()));
 		connect(&effects, SIGNAL(valueChanged()), this, SLOT(handle_effects_config()));
 	};
 	void keyPressEvent(QKeyEvent *);
 	QGridLayout gl;
 	HpsJamConfigFormat up_fmt;
 	HpsJamConfigFormat down_fmt;
+	HpsJamConfigJitter jitter;
 	HpsJamDeviceSelection audio_dev;
 	HpsJamConfigEffects effects;
 	HpsJamLyricsFormat lyrics_fmt;
@@ -26,6 +26,7 @@
 #include <QMutexLocker>
 #include <QMessageBox>
 #include <QFile>
+#include <QRandomGenerator>
 
 #include "hpsjam.h"
 #include "peer.h"
@@ -137,7 +138,7 @@ HpsJamConnect :: HpsJamConnect() : gl(this)
 	connect(&buttons.b_connect, SIGNAL(released()), this, SLOT(handle_connect()));
 	connect(&buttons.b_disconnect, SIGNAL(released()), this, SLOT(handle_disconnect()));
 
-	connect(&hpsjam_client_peer->output_pkt, SIGNAL(pendingTimeout()), this, SLOT(handle_disconnect()));
+	connect(hpsjam_client_peer, SIGNAL(pendingTimeout()), this, SLOT(handle_disconnect()));
 
 	buttons.b_disconnect.setEnabled(false);
 }
@@ -224,15 +225,27 @@ HpsJamConnect :: handle_connect()
 	/* set destination address */
 	hpsjam_client_peer->address = address;
 
+	/* set second path, if any */
+	if (hpsjam_alt.valid() && hpsjam_alt.v4.sin_family == address.v4.sin_family) {
+		hpsjam_client_peer->alt_address = address;
+		hpsjam_client_peer->alt_address.fd = hpsjam_alt.fd;
+	}
+
 	/* send initial ping */
 	pkt = new struct hpsjam_packet_entry;
-	pkt->packet.setPing(0, hpsjam_ticks, key);
+	pkt->packet.setPing((hpsjam_client_listen ? HPSJAM_PING_LISTENER :
+	    (hpsjam_client_p2p ? HPSJAM_PING_P2P : 0)) |
+	    (hpsjam_client_peer->alt_address.valid() ? HPSJAM_PING_MULTIPATH : 0) |
+	    hpsjam_client_room, hpsjam_ticks, key);
+	if (hpsjam_client_peer->alt_address.valid())
+		pkt->packet.setPingToken(QRandomGenerator::system()->generate64() | 1);
 	pkt->packet.type = HPSJAM_TYPE_PING_REQUEST;
 	pkt->insert_tail(&hpsjam_client_peer->output_pkt.head);
 
 	/* send initial configuration */
 	pkt = new struct hpsjam_packet_entry;
-	pkt->packet.setConfigure(hpsjam_client->w_config->down_fmt.format);
+	pkt->packet.setConfigure(hpsjam_client->w_config->down_fmt.format,
+	    hpsjam_client->w_config->jitter.selection);
 	pkt->packet.type = HPSJAM_TYPE_CONFIGURE_REQUEST;
 	pkt->insert_tail(&hpsjam_client_peer->output_pkt.head);
 
@@ -249,8 +262,12 @@ HpsJamConnect :: handle_connect()
 	pkt->packet.type = HPSJAM_TYPE_ICON_REQUEST;
 	pkt->insert_tail(&hpsjam_client_peer->output_pkt.head);
 
-	/* set local format, nickname and icon */
-	hpsjam_client_peer->output_fmt = hpsjam_client->w_config->up_fmt.format;
+	/* set local format, jitter target, nickname and icon */
+	if (hpsjam_client_listen)
+		hpsjam_client_peer->output_fmt = HPSJAM_TYPE_AUDIO_SILENCE;
+	else
+		hpsjam_client_peer->output_fmt = hpsjam_client->w_config->up_fmt.format;
+	hpsjam_client_peer->input_pkt.jitter.setTarget(hpsjam_client->w_config->jitter.selection);
 	hpsjam_client->w_mixer->self_strip.w_name.setText(nick);
 	hpsjam_client->w_mixer->self_strip.w_icon.svg.load(idata);
 	hpsjam_client->w_mixer->self_strip.w_icon.update();
@@ -45,6 +45,7 @@ HpsJamEqualizer :: HpsJamEqualizer() : gl(this),
 	b_lowpass.setText(tr("&LowPass"));
 	b_highpass.setText(tr("&HighPass"));
 	b_bandpass.setText(tr("&BandPass"));
+	b_parametric.setText(tr("&Parametric"));
 	b_longdelay.setText(tr("LongDela&y"));
 
 	b_disable.setText(tr("&Disable"));
@@ -61,9 +62,10 @@ HpsJamEqualizer :: HpsJamEqualizer() : gl(this),
 	gl_control.addWidget(&b_bandpass, 1,1);
 
 	gl_control.addWidget(&b_longdelay, 0,2);
+	gl_control.addWidget(&b_parametric, 1,2);
 	gl_control.addWidget(&b_disable, 0,3);
-	gl_control.addWidget(&b_apply, 1,2);
-	gl_control.addWidget(&b_close, 1,3);
+	gl_control.addWidget(&b_close, 0,4);
+	gl_control.addWidget(&b_apply, 1,3,1,2);
 
 	gl.addWidget(&g_spec, 0,0);
 	gl.addWidget(&g_control, 1,0);
@@ -76,6 +78,7 @@ HpsJamEqualizer :: HpsJamEqualizer() : gl(this),
 	connect(&b_lowpass, SIGNAL(released()), this, SLOT(handle_lowpass()));
 	connect(&b_highpass, SIGNAL(released()), this, SLOT(handle_highpass()));
 	connect(&b_bandpass, SIGNAL(released()), this, SLOT(handle_bandpass()));
+	connect(&b_parametric, SIGNAL(released()), this, SLOT(handle_parametric()));
 	connect(&b_longdelay, SIGNAL(released()), this, SLOT(handle_longdelay()));
 
 	handle_disable();
@@ -162,6 +165,18 @@ HpsJamEqualizer :: handle_bandpass()
 	));
 };
 
+void
+HpsJamEqualizer :: handle_parametric()
+{
+	edit.setText(QString(
+	    "filtersize 0.0ms iir\n"
+	    "highpass 80 0.707\n"
+	    "lowshelf 200 0 0.707\n"
+	    "peaking 1000 0 1.0\n"
+	    "highshelf 6000 0 0.707\n"
+	));
+};
+
 void
 HpsJamEqualizer :: handle_longdelay()
 {
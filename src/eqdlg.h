@@ -55,6 +55,7 @@ public:
 	QPushButton b_lowpass;
 	QPushButton b_highpass;
 	QPushButton b_bandpass;
+	QPushButton b_parametric;
 	QPushButton b_longdelay;
 
 public slots:
@@ -65,6 +66,7 @@ public slots:
 	void handle_lowpass();
 	void handle_highpass();
 	void handle_bandpass();
+	void handle_parametric();
 	void handle_longdelay();
 };
 
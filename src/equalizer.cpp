@@ -26,9 +26,15 @@
  */
 
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fftw3.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <chrono>
 
 #include "hpsjam.h"
 #include "multiply.h"
@@ -61,7 +67,7 @@ hpsjam_parse_double(const char **pp, bool is_ms, double &out)
 	}
 
 	if (*ptr == '.') {
-		double k = 1.0 / 1.0;
+		double k = 1.0 / 10.0;
 		ptr ++;
 		while (*ptr >= '0' && *ptr <= '9') {
 			out += k * (*ptr - '0');
@@ -82,6 +88,87 @@ hpsjam_parse_double(const char **pp, bool is_ms, double &out)
 	return (any);
 }
 
+/*
+ * FFTW wisdom is cached in a per-user file, so that FFTW_MEASURE
+ * only needs to be run once for every transform size. The FFTW
+ * planner is not thread safe and must only be used by the
+ * equalizer worker thread, or before it is started.
+ */
+static bool hpsjam_fftw_wisdom_dirty;
+
+static bool
+hpsjam_fftw_wisdom_file(char *buf, size_t size)
+{
+#ifdef _WIN32
+	const char *base = getenv("APPDATA");
+	const char *name = "\\HpsJam.fftw_wisdom";
+#else
+	const char *base = getenv("HOME");
+	const char *name = "/.hpsjam_fftw_wisdom";
+#endif
+	if (base == 0 || base[0] == 0)
+		return (false);
+	return (snprintf(buf, size, "%s%s", base, name) < (int)size);
+}
+
+static void
+hpsjam_fftw_wisdom_import()
+{
+	char path[1024];
+
+	if (hpsjam_fftw_wisdom_file(path, sizeof(path)))
+		fftw_import_wisdom_from_filename(path);
+}
+
+static void
+hpsjam_fftw_wisdom_export()
+{
+	char path[1024];
+
+	if (hpsjam_fftw_wisdom_dirty == false)
+		return;
+	hpsjam_fftw_wisdom_dirty = false;
+
+	if (hpsjam_fftw_wisdom_file(path, sizeof(path)))
+		fftw_export_wisdom_to_filename(path);
+}
+
+static fftw_plan
+hpsjam_fftw_plan_r2r(int n, double *in, double *out, fftw_r2r_kind kind)
+{
+	fftw_plan plan = fftw_plan_r2r_1d(n, in, out, kind, FFTW_MEASURE | FFTW_WISDOM_ONLY);
+
+	if (plan == 0) {
+		plan = fftw_plan_r2r_1d(n, in, out, kind, FFTW_MEASURE);
+		hpsjam_fftw_wisdom_dirty = true;
+	}
+	return (plan);
+}
+
+static fftw_plan
+hpsjam_fftw_plan_r2c(int n, double *in, fftw_complex *out)
+{
+	fftw_plan plan = fftw_plan_dft_r2c_1d(n, in, out, FFTW_MEASURE | FFTW_WISDOM_ONLY);
+
+	if (plan == 0) {
+		plan = fftw_plan_dft_r2c_1d(n, in, out, FFTW_MEASURE);
+		hpsjam_fftw_wisdom_dirty = true;
+	}
+	return (plan);
+}
+
+static fftw_plan
+hpsjam_fftw_plan_c2r(int n, fftw_complex *in, double *out)
+{
+	fftw_plan plan = fftw_plan_dft_c2r_1d(n, in, out, FFTW_MEASURE | FFTW_WISDOM_ONLY);
+
+	if (plan == 0) {
+		plan = fftw_plan_dft_c2r_1d(n, in, out, FFTW_MEASURE);
+		hpsjam_fftw_wisdom_dirty = true;
+	}
+	return (plan);
+}
+
 struct equalizer {
 	double rate;
 	size_t block_size;
@@ -103,8 +190,8 @@ struct equalizer {
 		fftw_time = new double [block_size];
 		fftw_freq = new double [block_size];
 
-		forward = fftw_plan_r2r_1d(block_size, fftw_time, fftw_freq, FFTW_R2HC, FFTW_MEASURE);
-		inverse = fftw_plan_r2r_1d(block_size, fftw_freq, fftw_time, FFTW_HC2R, FFTW_MEASURE);
+		forward = hpsjam_fftw_plan_r2r(block_size, fftw_time, fftw_freq, FFTW_R2HC);
+		inverse = hpsjam_fftw_plan_r2r(block_size, fftw_freq, fftw_time, FFTW_HC2R);
 	};
 	void cleanup() {
 		fftw_destroy_plan(forward);
@@ -208,7 +295,7 @@ struct equalizer {
 };
 
 bool
-hpsjam_equalizer :: init(const char *pfilter)
+hpsjam_equalizer_filter :: init(const char *pfilter)
 {
 	/* check if filter starts with filtersize */
 	if (strncasecmp(pfilter, "filtersize ", 11) != 0)
@@ -218,8 +305,15 @@ hpsjam_equalizer :: init(const char *pfilter)
 	/* get filter sizes */
 	double ms[2];
 
-	if (hpsjam_parse_double(&pfilter, true, ms[0]) == false ||
-	    hpsjam_parse_double(&pfilter, true, ms[1]) == false)
+	if (hpsjam_parse_double(&pfilter, true, ms[0]) == false)
+		return (true);
+
+	/* check for parametric equalizer */
+	hpsjam_skip_space(&pfilter, false);
+	if (strncasecmp(pfilter, "iir", 3) == 0)
+		return (init_iir(pfilter + 3, ms[0]));
+
+	if (hpsjam_parse_double(&pfilter, true, ms[1]) == false)
 		return (true);
 
 	ssize_t osize = (HPSJAM_SAMPLE_RATE * ms[0]) / 1000.0;
@@ -266,45 +360,270 @@ hpsjam_equalizer :: init(const char *pfilter)
 		}
 	}
 
-	/* allocate new buffers, if any */
-	if (filter_size != (size_t)size || filter_predelay != (size_t)osize) {
-		cleanup();
+	/* allocate new buffers */
+	setup(size, osize, (size != 0) ? hpsjam_equalizer_mode(size) : HPSJAM_EQ_MODE_DIRECT);
 
-		if (size != 0) {
-			filter_data = new float [size];
-			filter_in[0] = new float [size];
-			filter_in[1] = new float [size];
-			filter_out[0] = new float [2 * size];
-			filter_out[1] = new float [2 * size];
+	if (size != 0) {
+		load(eq.fftw_time);
+		eq.cleanup();
+	}
+	return (false);
+}
 
-			memset(filter_out[0], 0, sizeof(float) * 2 * size);
-			memset(filter_out[1], 0, sizeof(float) * 2 * size);
+static bool
+hpsjam_parse_signed_double(const char **pp, double &out)
+{
+	bool negative;
 
-			filter_size = size;
-		}
+	hpsjam_skip_space(pp, false);
 
-		if (osize != 0) {
-			filter_delay[0] = new float [osize];
-			filter_delay[1] = new float [osize];
+	negative = (**pp == '-');
+	if (negative || **pp == '+')
+		(*pp)++;
+	if (hpsjam_parse_double(pp, false, out) == false)
+		return (false);
+	if (negative)
+		out = -out;
+	return (true);
+}
 
-			memset(filter_delay[0], 0, sizeof(float) * osize);
-			memset(filter_delay[1], 0, sizeof(float) * osize);
+/*
+ * Compute biquad coefficients, see the "Cookbook formulae for audio
+ * EQ biquad filter coefficients" by Robert Bristow-Johnson.
+ */
+static bool
+hpsjam_biquad_design(struct hpsjam_biquad &bq, const char *type, double freq, double db, double q)
+{
+	const double A = pow(10.0, db / 40.0);
+	const double w0 = 2.0 * M_PI * freq / HPSJAM_SAMPLE_RATE;
+	const double cw = cos(w0);
+	const double alpha = sin(w0) / (2.0 * q);
+	const double sa = 2.0 * sqrt(A) * alpha;
+	double b0, b1, b2, a0, a1, a2;
 
-			filter_predelay = osize;
+	if (strcasecmp(type, "peaking") == 0) {
+		b0 = 1.0 + alpha * A;
+		b1 = -2.0 * cw;
+		b2 = 1.0 - alpha * A;
+		a0 = 1.0 + alpha / A;
+		a1 = -2.0 * cw;
+		a2 = 1.0 - alpha / A;
+	} else if (strcasecmp(type, "lowshelf") == 0) {
+		b0 = A * ((A + 1.0) - (A - 1.0) * cw + sa);
+		b1 = 2.0 * A * ((A - 1.0) - (A + 1.0) * cw);
+		b2 = A * ((A + 1.0) - (A - 1.0) * cw - sa);
+		a0 = (A + 1.0) + (A - 1.0) * cw + sa;
+		a1 = -2.0 * ((A - 1.0) + (A + 1.0) * cw);
+		a2 = (A + 1.0) + (A - 1.0) * cw - sa;
+	} else if (strcasecmp(type, "highshelf") == 0) {
+		b0 = A * ((A + 1.0) + (A - 1.0) * cw + sa);
+		b1 = -2.0 * A * ((A - 1.0) + (A + 1.0) * cw);
+		b2 = A * ((A + 1.0) + (A - 1.0) * cw - sa);
+		a0 = (A + 1.0) - (A - 1.0) * cw + sa;
+		a1 = 2.0 * ((A - 1.0) - (A + 1.0) * cw);
+		a2 = (A + 1.0) - (A - 1.0) * cw - sa;
+	} else if (strcasecmp(type, "lowpass") == 0) {
+		b0 = (1.0 - cw) / 2.0;
+		b1 = 1.0 - cw;
+		b2 = (1.0 - cw) / 2.0;
+		a0 = 1.0 + alpha;
+		a1 = -2.0 * cw;
+		a2 = 1.0 - alpha;
+	} else if (strcasecmp(type, "highpass") == 0) {
+		b0 = (1.0 + cw) / 2.0;
+		b1 = -(1.0 + cw);
+		b2 = (1.0 + cw) / 2.0;
+		a0 = 1.0 + alpha;
+		a1 = -2.0 * cw;
+		a2 = 1.0 - alpha;
+	} else {
+		return (true);
+	}
+
+	memset(&bq, 0, sizeof(bq));
+	bq.b0 = b0 / a0;
+	bq.b1 = b1 / a0;
+	bq.b2 = b2 / a0;
+	bq.a1 = a1 / a0;
+	bq.a2 = a2 / a0;
+	return (false);
+}
+
+/*
+ * Parametric equalizer, one filter per line:
+ *
+ * filtersize <predelay>ms iir
+ * highpass <frequency> <Q>
+ * lowpass <frequency> <Q>
+ * peaking <frequency> <gain dB> <Q>
+ * lowshelf <frequency> <gain dB> <Q>
+ * highshelf <frequency> <gain dB> <Q>
+ */
+bool
+hpsjam_equalizer_filter :: init_iir(const char *pfilter, double ms)
+{
+	struct hpsjam_biquad bq[HPSJAM_EQ_BIQUAD_MAX];
+	size_t num = 0;
+
+	while (1) {
+		char type[16];
+		size_t len = 0;
+		double freq;
+		double db = 0.0;
+		double q;
+
+		hpsjam_skip_space(&pfilter, true);
+		if (*pfilter == 0)
+			break;
+
+		while (len != sizeof(type) - 1 &&
+		       ((*pfilter >= 'a' && *pfilter <= 'z') ||
+			(*pfilter >= 'A' && *pfilter <= 'Z')))
+			type[len++] = *pfilter++;
+		type[len] = 0;
+
+		if (num == HPSJAM_EQ_BIQUAD_MAX ||
+		    hpsjam_parse_double(&pfilter, false, freq) == false)
+			return (true);
+
+		if (strcasecmp(type, "peaking") == 0 ||
+		    strcasecmp(type, "lowshelf") == 0 ||
+		    strcasecmp(type, "highshelf") == 0) {
+			if (hpsjam_parse_signed_double(&pfilter, db) == false)
+				return (true);
 		}
+
+		if (hpsjam_parse_double(&pfilter, false, q) == false)
+			return (true);
+
+		/* range check */
+		if (freq < 1.0 || freq >= HPSJAM_SAMPLE_RATE / 2 ||
+		    q < 0.01 || db < -48.0 || db > 48.0)
+			return (true);
+
+		if (hpsjam_biquad_design(bq[num++], type, freq, db, q))
+			return (true);
 	}
 
+	ssize_t osize = (HPSJAM_SAMPLE_RATE * ms) / 1000.0;
+
+	/* range check prefilter size */
+	if (osize < 0)
+		osize = 0;
+	else if (osize > HPSJAM_SAMPLE_RATE)
+		osize = HPSJAM_SAMPLE_RATE;
+
+	setup(0, osize, HPSJAM_EQ_MODE_DIRECT);
+
+	memcpy(filter_iir, bq, sizeof(bq[0]) * num);
+	filter_biquads = num;
+	return (false);
+}
+
+void
+hpsjam_equalizer_filter :: setup(size_t size, size_t osize, int mode)
+{
+	cleanup();
+
 	if (size != 0) {
-		for (ssize_t x = 0; x != size; x++)
-			filter_data[x] = eq.fftw_time[x];
+		size_t block;
 
-		eq.cleanup();
+		switch (mode) {
+		case HPSJAM_EQ_MODE_DIRECT:
+			block = size;
+			break;
+		default:
+			block = (size > HPSJAM_EQ_BLOCK) ? HPSJAM_EQ_BLOCK : size;
+			break;
+		}
+
+		const size_t parts = size / block;
+
+		filter_data = new float [block];
+		filter_in[0] = new float [2 * block];
+		filter_in[1] = new float [2 * block];
+		filter_out[0] = new float [block];
+		filter_out[1] = new float [block];
+
+		memset(filter_in[0], 0, sizeof(float) * 2 * block);
+		memset(filter_in[1], 0, sizeof(float) * 2 * block);
+		memset(filter_out[0], 0, sizeof(float) * block);
+		memset(filter_out[1], 0, sizeof(float) * block);
+
+		if (parts > 1 && mode == HPSJAM_EQ_MODE_X3) {
+			filter_tail = new float [size - block];
+			filter_acc[0] = new float [size];
+			filter_acc[1] = new float [size];
+
+			memset(filter_acc[0], 0, sizeof(float) * size);
+			memset(filter_acc[1], 0, sizeof(float) * size);
+		} else if (parts > 1) {
+			const size_t nfreq = (parts - 1) * (block + 1);
+
+			filter_freq = fftw_alloc_complex(nfreq);
+			filter_line[0] = fftw_alloc_complex(nfreq);
+			filter_line[1] = fftw_alloc_complex(nfreq);
+			fftw_freq = fftw_alloc_complex(block + 1);
+			fftw_time = fftw_alloc_real(2 * block);
+
+			memset(filter_line[0], 0, sizeof(fftw_complex) * nfreq);
+			memset(filter_line[1], 0, sizeof(fftw_complex) * nfreq);
+
+			forward = hpsjam_fftw_plan_r2c(2 * block, fftw_time, fftw_freq);
+			inverse = hpsjam_fftw_plan_c2r(2 * block, fftw_freq, fftw_time);
+		}
+
+		filter_size = size;
+		filter_block = block;
+		filter_parts = parts;
+		filter_mode = (parts > 1) ? mode : HPSJAM_EQ_MODE_DIRECT;
+	}
+
+	if (osize != 0) {
+		filter_delay[0] = new float [osize];
+		filter_delay[1] = new float [osize];
+
+		memset(filter_delay[0], 0, sizeof(float) * osize);
+		memset(filter_delay[1], 0, sizeof(float) * osize);
+
+		filter_predelay = osize;
 	}
-	return (false);
 }
 
 void
-hpsjam_equalizer :: cleanup()
+hpsjam_equalizer_filter :: load(const double *taps)
+{
+	const size_t block = filter_block;
+
+	/* first partition is stored time reversed */
+	for (size_t x = 0; x != block; x++)
+		filter_data[x] = taps[block - 1 - x];
+
+	switch (filter_mode) {
+	case HPSJAM_EQ_MODE_X3:
+		/* remaining partitions are stored in the time domain */
+		for (size_t x = block; x != filter_size; x++)
+			filter_tail[x - block] = taps[x];
+		break;
+	case HPSJAM_EQ_MODE_FFT:
+		/* remaining partitions are stored in the frequency domain */
+		for (size_t p = 1; p != filter_parts; p++) {
+			for (size_t x = 0; x != block; x++) {
+				fftw_time[x] = taps[p * block + x] / (2 * block);
+				fftw_time[x + block] = 0;
+			}
+			fftw_execute(forward);
+			memcpy(filter_freq + (p - 1) * (block + 1), fftw_freq,
+			    sizeof(fftw_complex) * (block + 1));
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void
+hpsjam_equalizer_filter :: cleanup()
 {
 	delete [] filter_data;
 	delete [] filter_in[0];
@@ -313,12 +632,85 @@ hpsjam_equalizer :: cleanup()
 	delete [] filter_out[1];
 	delete [] filter_delay[0];
 	delete [] filter_delay[1];
+	delete [] filter_tail;
+	delete [] filter_acc[0];
+	delete [] filter_acc[1];
+
+	if (forward != 0)
+		fftw_destroy_plan(forward);
+	if (inverse != 0)
+		fftw_destroy_plan(inverse);
+
+	fftw_free(filter_freq);
+	fftw_free(filter_line[0]);
+	fftw_free(filter_line[1]);
+	fftw_free(fftw_freq);
+	fftw_free(fftw_time);
 
 	memset(this, 0, sizeof(*this));
 }
 
 void
-hpsjam_equalizer :: doit(float *left, float *right, size_t samples)
+hpsjam_equalizer_filter :: transform()
+{
+	const size_t block = filter_block;
+	const size_t lines = filter_parts - 1;
+
+	for (size_t x = 0; x != 2; x++) {
+		if (filter_mode == HPSJAM_EQ_MODE_X3) {
+			float *acc = filter_acc[x];
+
+			/* accumulate the product of the last input block and all partitions */
+			for (size_t p = 0; p != lines; p++) {
+				hpsjam_x3_multiply_float(filter_in[x] + block,
+				    filter_tail + p * block, acc + p * block, block);
+			}
+
+			/* the first block is the output for the next block */
+			memcpy(filter_out[x], acc, sizeof(float) * block);
+			memmove(acc, acc + block, sizeof(float) * (filter_size - block));
+			memset(acc + filter_size - block, 0, sizeof(float) * block);
+		} else if (filter_mode == HPSJAM_EQ_MODE_FFT) {
+			fftw_complex *line = filter_line[x];
+
+			/* transform the last two input blocks */
+			for (size_t y = 0; y != 2 * block; y++)
+				fftw_time[y] = filter_in[x][y];
+			fftw_execute(forward);
+			memcpy(line + filter_line_pos * (block + 1), fftw_freq,
+			    sizeof(fftw_complex) * (block + 1));
+
+			/* multiply and accumulate all partitions */
+			memset(fftw_freq, 0, sizeof(fftw_complex) * (block + 1));
+
+			for (size_t p = 0; p != lines; p++) {
+				const fftw_complex *pa = line +
+				    ((filter_line_pos + lines - p) % lines) * (block + 1);
+				const fftw_complex *pb = filter_freq + p * (block + 1);
+
+				for (size_t y = 0; y != block + 1; y++) {
+					fftw_freq[y][0] += pa[y][0] * pb[y][0] - pa[y][1] * pb[y][1];
+					fftw_freq[y][1] += pa[y][0] * pb[y][1] + pa[y][1] * pb[y][0];
+				}
+			}
+			fftw_execute(inverse);
+
+			/* overlap-save: the last block is the output for the next block */
+			for (size_t y = 0; y != block; y++)
+				filter_out[x][y] = fftw_time[block + y];
+		}
+
+		/* shift down input by one block */
+		for (size_t y = 0; y != block; y++)
+			filter_in[x][y] = filter_in[x][y + block];
+	}
+
+	if (filter_mode == HPSJAM_EQ_MODE_FFT && ++filter_line_pos == lines)
+		filter_line_pos = 0;
+}
+
+void
+hpsjam_equalizer_filter :: doit(float *left, float *right, size_t samples)
 {
 	if (samples == 0)
 		return;
@@ -333,41 +725,435 @@ hpsjam_equalizer :: doit(float *left, float *right, size_t samples)
 		}
 	}
 
+	/* execute parametric equalizer, if any */
+	if (filter_biquads != 0) {
+		/* small offset to avoid denormals */
+		const hpsjam_biquad_vec_t offset = { 1e-20, 1e-20 };
+
+		for (size_t y = 0; y != samples; y++) {
+			hpsjam_biquad_vec_t v = { left[y], right[y] };
+
+			v += offset;
+
+			for (size_t z = 0; z != filter_biquads; z++) {
+				struct hpsjam_biquad &bq = filter_iir[z];
+				const hpsjam_biquad_vec_t out = bq.b0 * v + bq.z1;
+
+				bq.z1 = bq.b1 * v - bq.a1 * out + bq.z2;
+				bq.z2 = bq.b2 * v - bq.a2 * out;
+				v = out;
+			}
+
+			left[y] = v[0];
+			right[y] = v[1];
+		}
+	}
+
 	/* execute equalizer, if any */
 	if (filter_size != 0) {
-		do {
-			size_t delta = filter_size - filter_offset;
+		const size_t block = filter_block;
+
+		for (size_t y = 0; y != samples; y++) {
+			float *pin[2] = {
+			    filter_in[0] + filter_offset + 1,
+			    filter_in[1] + filter_offset + 1,
+			};
+			float sum[2] = {
+			    filter_out[0][filter_offset],
+			    filter_out[1][filter_offset],
+			};
 
-			if (delta > samples)
-				delta = samples;
+			pin[0][block - 1] = left[y];
+			pin[1][block - 1] = right[y];
 
-			for (size_t y = 0; y != delta; y++) {
-				filter_in[0][y + filter_offset] = left[y];
-				left[y] = filter_out[0][y + filter_offset];
+			/* first partition in direct form */
+			hpsjam_x3_vec_t acc[2] = {};
 
-				filter_in[1][y + filter_offset] = right[y];
-				right[y] = filter_out[1][y + filter_offset];
+			for (size_t z = 0; z != block; z += HPSJAM_X3_VEC) {
+				const hpsjam_x3_vec_t h = hpsjam_x3_load(filter_data + z);
+
+				acc[0] += h * hpsjam_x3_load(pin[0] + z);
+				acc[1] += h * hpsjam_x3_load(pin[1] + z);
 			}
 
-			filter_offset += delta;
-			samples -= delta;
-			left += delta;
-			right += delta;
-
-			/* check if there is enough data for a new transform */
-			if (filter_offset == filter_size) {
-				for (size_t x = 0; x != 2; x++) {
-					/* shift down output by filter_size samples */
-					for (size_t y = 0; y != filter_size; y++) {
-						filter_out[x][y] = filter_out[x][y + filter_size];
-						filter_out[x][y + filter_size] = 0;
-					}
-					/* perform transform */
-					hpsjam_x3_multiply_float(filter_in[x],
-					    filter_data, filter_out[x], filter_size);
-				}
+			left[y] = sum[0] + acc[0][0] + acc[0][1] + acc[0][2] + acc[0][3];
+			right[y] = sum[1] + acc[1][0] + acc[1][1] + acc[1][2] + acc[1][3];
+
+			/* check if a block is complete */
+			if (++filter_offset == block) {
+				transform();
 				filter_offset = 0;
 			}
-		} while (samples != 0);
+		}
+	}
+}
+
+/*
+ * Equalizer filters are designed by a background worker thread,
+ * because parsing, memory allocation and FFTW planning are not
+ * real-time safe. The finished filter is published through the
+ * "pending" pointer and picked up by the audio path. Old filters
+ * are handed back through the "retired" pointer and freed by the
+ * worker thread.
+ */
+struct hpsjam_equalizer_job {
+	struct hpsjam_equalizer_job *next;
+	class hpsjam_equalizer *eq;
+	char *config;
+};
+
+static pthread_mutex_t hpsjam_equalizer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hpsjam_equalizer_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t hpsjam_equalizer_done_cv = PTHREAD_COND_INITIALIZER;
+static pthread_once_t hpsjam_equalizer_once = PTHREAD_ONCE_INIT;
+static struct hpsjam_equalizer_job *hpsjam_equalizer_head;
+static struct hpsjam_equalizer_job **hpsjam_equalizer_tail = &hpsjam_equalizer_head;
+static class hpsjam_equalizer *hpsjam_equalizer_list;
+static class hpsjam_equalizer *hpsjam_equalizer_busy;	/* job in progress */
+
+static void
+hpsjam_equalizer_collect()
+{
+	for (class hpsjam_equalizer *eq = hpsjam_equalizer_list; eq != 0; eq = eq->next)
+		delete eq->retired.exchange(0);
+}
+
+static void *
+hpsjam_equalizer_worker(void *arg)
+{
+	struct hpsjam_equalizer_job *job;
+	struct timespec ts;
+
+	pthread_mutex_lock(&hpsjam_equalizer_mtx);
+	while (1) {
+		job = hpsjam_equalizer_head;
+		if (job == 0) {
+			/* free retired filters regularly */
+			hpsjam_equalizer_collect();
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_nsec -= 1000000000;
+				ts.tv_sec++;
+			}
+			pthread_cond_timedwait(&hpsjam_equalizer_cv, &hpsjam_equalizer_mtx, &ts);
+			continue;
+		}
+		hpsjam_equalizer_head = job->next;
+		if (hpsjam_equalizer_head == 0)
+			hpsjam_equalizer_tail = &hpsjam_equalizer_head;
+		hpsjam_equalizer_busy = job->eq;
+		pthread_mutex_unlock(&hpsjam_equalizer_mtx);
+
+		class hpsjam_equalizer_filter *filter = new class hpsjam_equalizer_filter;
+
+		if (job->config != 0 && filter->init(job->config)) {
+			/* invalid configuration, keep current filter */
+			delete filter;
+			filter = 0;
+		}
+
+		pthread_mutex_lock(&hpsjam_equalizer_mtx);
+		/* publish filter, replacing any unused one */
+		if (filter != 0)
+			delete job->eq->pending.exchange(filter);
+		hpsjam_equalizer_busy = 0;
+		pthread_cond_broadcast(&hpsjam_equalizer_done_cv);
+		pthread_mutex_unlock(&hpsjam_equalizer_mtx);
+
+		free(job->config);
+		delete job;
+
+		/* store any new plans */
+		hpsjam_fftw_wisdom_export();
+
+		pthread_mutex_lock(&hpsjam_equalizer_mtx);
+	}
+	return (0);
+}
+
+static void
+hpsjam_equalizer_start()
+{
+	pthread_t pt;
+
+	hpsjam_fftw_wisdom_import();
+
+	if (pthread_create(&pt, NULL, &hpsjam_equalizer_worker, NULL) == 0)
+		pthread_detach(pt);
+}
+
+static void
+hpsjam_equalizer_enqueue(class hpsjam_equalizer *eq, const char *config)
+{
+	struct hpsjam_equalizer_job *job = new struct hpsjam_equalizer_job;
+
+	job->next = 0;
+	job->eq = eq;
+	job->config = (config != 0) ? strdup(config) : 0;
+
+	pthread_once(&hpsjam_equalizer_once, &hpsjam_equalizer_start);
+
+	pthread_mutex_lock(&hpsjam_equalizer_mtx);
+	*hpsjam_equalizer_tail = job;
+	hpsjam_equalizer_tail = &job->next;
+	pthread_cond_signal(&hpsjam_equalizer_cv);
+	pthread_mutex_unlock(&hpsjam_equalizer_mtx);
+}
+
+void
+hpsjam_equalizer_init()
+{
+	pthread_once(&hpsjam_equalizer_once, &hpsjam_equalizer_start);
+}
+
+int
+hpsjam_equalizer_precompute()
+{
+	hpsjam_fftw_wisdom_import();
+
+	for (size_t size = 8; size <= 4096; size *= 2) {
+		struct equalizer eq = {};
+
+		eq.init(HPSJAM_SAMPLE_RATE, size);
+		eq.cleanup();
+
+		/* partition transforms */
+		if (size <= 2 * HPSJAM_EQ_BLOCK) {
+			double *time = fftw_alloc_real(size);
+			fftw_complex *freq = fftw_alloc_complex(size / 2 + 1);
+
+			fftw_destroy_plan(hpsjam_fftw_plan_r2c(size, time, freq));
+			fftw_destroy_plan(hpsjam_fftw_plan_c2r(size, freq, time));
+
+			fftw_free(time);
+			fftw_free(freq);
+		}
+	}
+
+	hpsjam_fftw_wisdom_dirty = true;
+	hpsjam_fftw_wisdom_export();
+	return (0);
+}
+
+/*
+ * The fastest equalizer mode depends on the filter size and the
+ * CPU. Measure all modes the first time a filter size is used.
+ */
+static int hpsjam_equalizer_mode_cache[13];	/* up to 4096 taps */
+
+static double
+hpsjam_equalizer_measure(size_t size, int mode)
+{
+	class hpsjam_equalizer_filter filter;
+	const size_t total = (size < 4096) ? 8192 : 2 * size;
+	float left[HPSJAM_DEF_SAMPLES];
+	float right[HPSJAM_DEF_SAMPLES];
+	double taps[size];
+	uint32_t seed = 1;
+
+	for (size_t x = 0; x != size; x++)
+		taps[x] = (double)(int)((x * 7919) % 13 - 6) / (64.0 * size);
+
+	filter.setup(size, 0, mode);
+	filter.load(taps);
+
+	const auto start = std::chrono::steady_clock::now();
+
+	for (size_t n = 0; n < total; n += HPSJAM_DEF_SAMPLES) {
+		for (size_t x = 0; x != HPSJAM_DEF_SAMPLES; x++) {
+			seed = seed * 1103515245U + 12345U;
+			left[x] = (float)(int32_t)seed / 2147483648.0f;
+			right[x] = -left[x];
+		}
+		filter.doit(left, right, HPSJAM_DEF_SAMPLES);
+	}
+
+	const auto delta = std::chrono::steady_clock::now() - start;
+
+	/* return nanoseconds per sample */
+	return (std::chrono::duration<double, std::nano>(delta).count() / total);
+}
+
+int
+hpsjam_equalizer_mode(size_t size)
+{
+	size_t index = 0;
+	double best = 0.0;
+	int mode = HPSJAM_EQ_MODE_DIRECT;
+
+	/* a single partition is always computed in direct form */
+	if (size <= HPSJAM_EQ_BLOCK)
+		return (HPSJAM_EQ_MODE_DIRECT);
+
+	while ((2UL << index) <= size)
+		index++;
+	if (index >= 13)
+		return (HPSJAM_EQ_MODE_FFT);
+
+	if (hpsjam_equalizer_mode_cache[index] != 0)
+		return (hpsjam_equalizer_mode_cache[index] - 1);
+
+	for (int x = 0; x != HPSJAM_EQ_MODE_MAX; x++) {
+		const double value = hpsjam_equalizer_measure(size, x);
+		if (x == 0 || value < best) {
+			best = value;
+			mode = x;
+		}
+	}
+	hpsjam_equalizer_mode_cache[index] = mode + 1;
+	return (mode);
+}
+
+int
+hpsjam_equalizer_benchmark()
+{
+	static const char *mode_descr[HPSJAM_EQ_MODE_MAX] = { "direct", "x3", "fft" };
+
+	hpsjam_fftw_wisdom_import();
+
+	printf("Equalizer, nanoseconds per stereo sample:\n");
+	printf("%8s %10s %10s %10s %10s\n", "taps",
+	    mode_descr[0], mode_descr[1], mode_descr[2], "selected");
+
+	for (size_t size = 8; size <= 4096; size *= 2) {
+		double value[HPSJAM_EQ_MODE_MAX];
+		int mode = 0;
+
+		for (int x = 0; x != HPSJAM_EQ_MODE_MAX; x++) {
+			value[x] = hpsjam_equalizer_measure(size, x);
+			if (value[x] < value[mode])
+				mode = x;
+		}
+		if (size <= HPSJAM_EQ_BLOCK)
+			mode = HPSJAM_EQ_MODE_DIRECT;
+		printf("%8zu %10.1f %10.1f %10.1f %10s\n", size,
+		    value[0], value[1], value[2], mode_descr[mode]);
+	}
+
+	hpsjam_fftw_wisdom_export();
+	return (0);
+}
+
+hpsjam_equalizer :: hpsjam_equalizer() : pending(0), retired(0)
+{
+	current = 0;
+	fading = 0;
+	fade_offset = HPSJAM_EQ_FADE;
+
+	pthread_mutex_lock(&hpsjam_equalizer_mtx);
+	next = hpsjam_equalizer_list;
+	hpsjam_equalizer_list = this;
+	pthread_mutex_unlock(&hpsjam_equalizer_mtx);
+}
+
+hpsjam_equalizer :: ~hpsjam_equalizer()
+{
+	struct hpsjam_equalizer_job **ppjob;
+	struct hpsjam_equalizer_job *job;
+	class hpsjam_equalizer **ppeq;
+
+	pthread_mutex_lock(&hpsjam_equalizer_mtx);
+
+	/* wait for a filter being designed for us, if any */
+	while (hpsjam_equalizer_busy == this)
+		pthread_cond_wait(&hpsjam_equalizer_done_cv, &hpsjam_equalizer_mtx);
+
+	/* unlink from the list of equalizers */
+	for (ppeq = &hpsjam_equalizer_list; *ppeq != 0; ppeq = &(*ppeq)->next) {
+		if (*ppeq == this) {
+			*ppeq = next;
+			break;
+		}
+	}
+
+	/* drop queued jobs */
+	hpsjam_equalizer_tail = &hpsjam_equalizer_head;
+	for (ppjob = &hpsjam_equalizer_head; (job = *ppjob) != 0; ) {
+		if (job->eq == this) {
+			*ppjob = job->next;
+			free(job->config);
+			delete job;
+		} else {
+			ppjob = &job->next;
+			hpsjam_equalizer_tail = ppjob;
+		}
+	}
+	pthread_mutex_unlock(&hpsjam_equalizer_mtx);
+
+	delete current;
+	delete fading;
+	delete pending.exchange(0);
+	delete retired.exchange(0);
+}
+
+bool
+hpsjam_equalizer :: init(const char *config)
+{
+	/* check if filter starts with filtersize */
+	if (strncasecmp(config, "filtersize ", 11) != 0)
+		return (true);
+	hpsjam_equalizer_enqueue(this, config);
+	return (false);
+}
+
+void
+hpsjam_equalizer :: reset()
+{
+	hpsjam_equalizer_enqueue(this, 0);
+}
+
+void
+hpsjam_equalizer :: doit(float *left, float *right, size_t samples)
+{
+	class hpsjam_equalizer_filter *filter;
+
+	if (samples == 0)
+		return;
+
+	/* check for a new filter, unless cross-fading */
+	if (fade_offset == HPSJAM_EQ_FADE &&
+	    (filter = pending.exchange(0)) != 0) {
+		fading = current;
+		current = filter;
+		fade_offset = 0;
+	}
+
+	if (fade_offset == HPSJAM_EQ_FADE) {
+		if (current != 0)
+			current->doit(left, right, samples);
+		return;
+	}
+
+	float temp_l[samples];
+	float temp_r[samples];
+
+	/* run old and new filter in parallel */
+	memcpy(temp_l, left, sizeof(temp_l));
+	memcpy(temp_r, right, sizeof(temp_r));
+
+	if (fading != 0)
+		fading->doit(temp_l, temp_r, samples);
+	current->doit(left, right, samples);
+
+	/* cross-fade from old to new filter */
+	for (size_t x = 0; x != samples; x++) {
+		const float f = (float)fade_offset / (float)HPSJAM_EQ_FADE;
+
+		left[x] = temp_l[x] + (left[x] - temp_l[x]) * f;
+		right[x] = temp_r[x] + (right[x] - temp_r[x]) * f;
+
+		fade_offset += (fade_offset != HPSJAM_EQ_FADE);
+	}
+
+	/* hand old filter over to the worker thread, when possible */
+	if (fade_offset == HPSJAM_EQ_FADE && fading != 0) {
+		class hpsjam_equalizer_filter *expected = 0;
+
+		if (retired.compare_exchange_strong(expected, fading))
+			fading = 0;
+		else
+			fade_offset--;	/* try again next time */
 	}
 }
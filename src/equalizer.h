@@ -30,23 +30,113 @@
 #include <string.h>
 #include <sys/types.h>
 
-class hpsjam_equalizer {
+#include <fftw3.h>
+
+#include <atomic>
+
+#define	HPSJAM_EQ_BLOCK 64	/* samples */
+#define	HPSJAM_EQ_FADE 1024	/* samples */
+
+#define	HPSJAM_EQ_BIQUAD_MAX 16
+
+typedef double hpsjam_biquad_vec_t __attribute__((__vector_size__(16)));
+
+/* transposed direct form II, left and right channel in one vector */
+struct hpsjam_biquad {
+	double b0;
+	double b1;
+	double b2;
+	double a1;
+	double a2;
+	hpsjam_biquad_vec_t z1;
+	hpsjam_biquad_vec_t z2;
+};
+
+enum {
+	HPSJAM_EQ_MODE_DIRECT,
+	HPSJAM_EQ_MODE_X3,
+	HPSJAM_EQ_MODE_FFT,
+	HPSJAM_EQ_MODE_MAX,
+};
+
+/*
+ * The equalizer is a uniformly partitioned convolution. The first
+ * partition is computed in direct form, so that no latency is added.
+ * The remaining partitions are computed once per partition block,
+ * either by the x3 multiply or in the frequency domain, using a
+ * frequency domain delay line. In direct mode there is only a
+ * single partition. The mode is selected by a benchmark.
+ *
+ * Alternatively a cascade of biquads can be used, which adds no
+ * latency at all.
+ */
+class hpsjam_equalizer_filter {
 public:
-	hpsjam_equalizer() {
+	hpsjam_equalizer_filter() {
 		memset(this, 0, sizeof(*this));
 	};
+	~hpsjam_equalizer_filter() {
+		cleanup();
+	};
 	size_t filter_size;
+	size_t filter_block;
+	size_t filter_parts;
 	size_t filter_predelay;
 	size_t filter_offset;
 	size_t filter_doffset;
+	size_t filter_line_pos;
+	int filter_mode;
 	float *filter_data;
+	float *filter_tail;
+	float *filter_acc[2];
+	size_t filter_biquads;
+	struct hpsjam_biquad filter_iir[HPSJAM_EQ_BIQUAD_MAX];
 	float *filter_in[2];
 	float *filter_out[2];
 	float *filter_delay[2];
+	fftw_complex *filter_freq;
+	fftw_complex *filter_line[2];
+	fftw_complex *fftw_freq;
+	double *fftw_time;
+	fftw_plan forward;
+	fftw_plan inverse;
 
 	bool init(const char *);
+	bool init_iir(const char *, double);
+	void setup(size_t, size_t, int);
+	void load(const double *);
 	void cleanup();
+	void transform();
 	void doit(float *left, float *right, size_t samples);
 };
 
+/*
+ * The equalizer front end is used by the audio path. New filters
+ * are designed asynchronously and are cross-faded in, so that
+ * changing the filter never blocks the audio path.
+ */
+class hpsjam_equalizer {
+public:
+	hpsjam_equalizer();
+	~hpsjam_equalizer();
+	hpsjam_equalizer(const hpsjam_equalizer &) = delete;
+	hpsjam_equalizer &operator=(const hpsjam_equalizer &) = delete;
+
+	class hpsjam_equalizer *next;
+	std::atomic<class hpsjam_equalizer_filter *> pending;
+	std::atomic<class hpsjam_equalizer_filter *> retired;
+	class hpsjam_equalizer_filter *current;
+	class hpsjam_equalizer_filter *fading;
+	size_t fade_offset;
+
+	bool init(const char *);
+	void reset();
+	void doit(float *left, float *right, size_t samples);
+};
+
+extern void hpsjam_equalizer_init();
+extern int hpsjam_equalizer_precompute();
+extern int hpsjam_equalizer_mode(size_t);
+extern int hpsjam_equalizer_benchmark();
+
 #endif		/* _HPSJAM_EQUALIZER_ */
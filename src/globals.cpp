@@ -0,0 +1,53 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsjam.h"
+#include "socket.h"
+
+/*
+ * Global state shared by the client, the server, the engine library
+ * and the load generator. Each program sets the values it needs in
+ * its main() function.
+ */
+unsigned hpsjam_num_server_peers;
+unsigned hpsjam_num_server_listeners;
+unsigned hpsjam_udp_buffer_size;
+uint64_t hpsjam_server_passwd;
+uint64_t hpsjam_mixer_passwd;
+class hpsjam_server_peer *hpsjam_server_peers;
+class hpsjam_server_listener *hpsjam_server_listeners;
+bool hpsjam_client_listen;
+bool hpsjam_client_p2p;
+bool hpsjam_server_sfu;
+uint8_t hpsjam_client_room;
+struct hpsjam_room hpsjam_rooms[HPSJAM_ROOMS_MAX];
+class hpsjam_client_peer *hpsjam_client_peer;
+class HpsJamClient *hpsjam_client;
+struct hpsjam_socket_address hpsjam_v4;
+struct hpsjam_socket_address hpsjam_v6;
+struct hpsjam_socket_address hpsjam_cli;
+struct hpsjam_socket_address hpsjam_alt;
+const char *hpsjam_client_multipath;
+const char *hpsjam_welcome_message_file;
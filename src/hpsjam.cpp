@@ -24,34 +24,35 @@
  */
 
 #include "hpsjam.h"
+#ifdef HPSJAM_SERVER_ONLY
+#include "server.h"
+#else
 #include "peer.h"
 #include "clientdlg.h"
 #include "connectdlg.h"
 #include "configdlg.h"
+#include "simulate.h"
+#endif
 #include "timer.h"
+#include "recorder.h"
+#include "capture.h"
 
 #include "../mac/activity.h"
 
+#ifndef HPSJAM_SERVER_ONLY
 #include <QApplication>
 #include <QCoreApplication>
 #include <QMessageBox>
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <err.h>
 
-unsigned hpsjam_num_server_peers;
-unsigned hpsjam_udp_buffer_size;
-uint64_t hpsjam_server_passwd;
-uint64_t hpsjam_mixer_passwd;
-class hpsjam_server_peer *hpsjam_server_peers;
-class hpsjam_client_peer *hpsjam_client_peer;
-class HpsJamClient *hpsjam_client;
-struct hpsjam_socket_address hpsjam_v4;
-struct hpsjam_socket_address hpsjam_v6;
-struct hpsjam_socket_address hpsjam_cli;
-const char *hpsjam_welcome_message_file;
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 static const struct option hpsjam_opts[] = {
 	{ "NSDocumentRevisionsDebugMode", required_argument, NULL, ' ' },
@@ -60,25 +61,59 @@ static const struct option hpsjam_opts[] = {
 	{ "welcome-msg-file", required_argument, NULL, 'w' },
 	{ "server", no_argument, NULL, 's' },
 	{ "peers", required_argument, NULL, 'P' },
+	{ "listeners", required_argument, NULL, 'G' },
+	{ "room", required_argument, NULL, 'Z' },
+	{ "trunk", required_argument, NULL, 'k' },
+	{ "sfu", no_argument, NULL, 'f' },
+	{ "record", required_argument, NULL, 'W' },
+	{ "capture", required_argument, NULL, 'C' },
+	{ "replay", required_argument, NULL, 'Y' },
+	{ "replay-fast", no_argument, NULL, 'z' },
+#if !defined(_WIN32) && !defined(HPSJAM_SERVER_ONLY)
+	{ "simulate", required_argument, NULL, 'o' },
+#endif
 	{ "password", required_argument, NULL, 'K' },
 	{ "mixer-password", required_argument, NULL, 'M' },
 #ifndef _WIN32
 	{ "daemon", no_argument, NULL, 'B' },
 #endif
+#ifndef HPSJAM_SERVER_ONLY
 	{ "nickname", required_argument, NULL, 'N'},
 	{ "icon", required_argument, NULL, 'i'},
 	{ "connect", required_argument, NULL, 'c'},
+	{ "listen", no_argument, NULL, 'E'},
+	{ "join-room", required_argument, NULL, 'X'},
+	{ "p2p", no_argument, NULL, 'g'},
+	{ "multipath", required_argument, NULL, 'u'},
 	{ "audio-uplink-format", required_argument, NULL, 'U'},
 	{ "audio-downlink-format", required_argument, NULL, 'D'},
+	{ "jitter-target", required_argument, NULL, 'j'},
+	{ "audio-clock", no_argument, NULL, 'A'},
+#endif
+#ifndef _WIN32
+	{ "rt-priority", required_argument, NULL, 'T'},
+	{ "rt-cpu-timer", required_argument, NULL, 'x'},
+	{ "rt-cpu-receive", required_argument, NULL, 'y'},
+	{ "rt-mlock", no_argument, NULL, 'm'},
+	{ "rt-spin-us", required_argument, NULL, 'S'},
+	{ "rt-report", no_argument, NULL, 'V'},
+#endif
+	{ "benchmark", no_argument, NULL, 'b'},
+#ifndef HPSJAM_SERVER_ONLY
+	{ "fftw-precompute", no_argument, NULL, 'F'},
 	{ "audio-input-device", required_argument, NULL, 'I'},
 	{ "audio-output-device", required_argument, NULL, 'O'},
 	{ "audio-input-left", required_argument, NULL, 'l'},
 	{ "audio-output-left", required_argument, NULL, 'L'},
 	{ "audio-input-right", required_argument, NULL, 'r'},
 	{ "audio-output-right", required_argument, NULL, 'R'},
+#endif
 #ifdef HAVE_JACK_AUDIO
 	{ "jacknoconnect", no_argument, NULL, 'J' },
 	{ "jackname", required_argument, NULL, 'n' },
+#endif
+#ifdef HAVE_NULL_AUDIO
+	{ "audio-input-file", required_argument, NULL, 'a' },
 #endif
 	{ NULL, 0, NULL, 0 }
 };
@@ -86,61 +121,115 @@ static const struct option hpsjam_opts[] = {
 static void
 usage(void)
 {
-        fprintf(stderr, "HpsJam [--server --peers <1..256>] [--port " HPSJAM_DEFAULT_PORT_STR "] "
+#ifdef HPSJAM_SERVER_ONLY
+        fprintf(stderr, "hpsjam-server [--peers <1..256>] [--listeners <0..%u>] [--port " HPSJAM_DEFAULT_PORT_STR "] "
+#else
+        fprintf(stderr, "HpsJam [--server --peers <1..256>] [--listeners <0..%u>] [--port " HPSJAM_DEFAULT_PORT_STR "] "
+#endif
 #ifndef _WIN32
 		"[--daemon] \\\n"
 #endif
 		"	[--password <64_bit_hexadecimal_password>] \\\n"
+		"	[--room <1..%u>:<64_bit_hexadecimal_password>[:<welcome_msg_file>]] \\\n"
+		"	[--trunk <servername:port>] [--sfu] \\\n"
+		"	[--record <directory>] \\\n"
+		"	[--capture <filename>] [--replay <filename> [--replay-fast]] \\\n"
+#if !defined(_WIN32) && !defined(HPSJAM_SERVER_ONLY)
+		"	[--simulate <clients>:<seconds>[:<drift_ppm>[:<loss_per_mille>[:<jitter_ms>]]]] \\\n"
+#endif
 #ifdef HAVE_JACK_AUDIO
 		"	[--jacknoconnect] [--jackname <name>] \\\n"
 #endif
+#ifdef HAVE_NULL_AUDIO
+		"	[--audio-input-file <48kHz_WAV_file>] \\\n"
+#endif
+#ifndef HPSJAM_SERVER_ONLY
 		"	[--nickname <nickname>] \\\n"
 		"	[--icon <0..%u>] \\\n"
-		"	[--connect <servername:port>] \\\n"
+		"	[--connect <servername:port>] [--listen] [--join-room <0..%u>] [--p2p] \\\n"
+		"	[--multipath <local_IP_address>] \\\n"
 		"	[--audio-uplink-format <0..%u>] \\\n"
 		"	[--audio-downlink-format <0..%u>] \\\n"
-
+		"	[--jitter-target <0..%u, Default is %u>] \\\n"
+		"	[--audio-clock] \\\n"
+#endif
+#ifndef _WIN32
+		"	[--rt-priority <1..99>] [--rt-mlock] [--rt-report] \\\n"
+		"	[--rt-cpu-timer <cpu>] [--rt-cpu-receive <cpu>] \\\n"
+		"	[--rt-spin-us <0..1000>] \\\n"
+#endif
+#ifndef HPSJAM_SERVER_ONLY
 		"	[--audio-input-device <0,1,2,3 ... , Default is 0>] \\\n"
 		"	[--audio-output-device <0,1,2,3 ... , Default is 0>] \\\n"
 		"	[--audio-input-left <0,1,2,3 ... , Default is 0>] \\\n"
 		"	[--audio-output-left <0,1,2,3 ... , Default is 0>] \\\n"
 		"	[--audio-input-right <0,1,2,3 ... , Default is 1>] \\\n"
 		"	[--audio-output-right <0,1,2,3 ... , Default is 1>] \\\n"
+#endif
 		"	[--mixer-password <64_bit_hexadecimal_password>] \\\n"
 		"	[--welcome-msg-file <filename> \\\n"
-		"	[--cli-port <portnumber>]\n",
-		HPSJAM_NUM_ICONS - 1,
+		"	[--cli-port <portnumber>] \\\n"
+#ifndef HPSJAM_SERVER_ONLY
+		"	[--fftw-precompute] [--benchmark]\n",
+#else
+		"	[--benchmark]\n",
+#endif
+		HPSJAM_LISTENERS_MAX,
+		HPSJAM_ROOMS_MAX - 1
+#ifndef HPSJAM_SERVER_ONLY
+		, HPSJAM_NUM_ICONS - 1,
+		HPSJAM_ROOMS_MAX - 1,
 		HPSJAM_AUDIO_FORMAT_MAX - 1,
-		HPSJAM_AUDIO_FORMAT_MAX - 1);
+		HPSJAM_AUDIO_FORMAT_MAX - 1,
+		HPSJAM_JITTER_TARGET_MAX - 1,
+		HPSJAM_JITTER_TARGET_DEFAULT
+#endif
+		);
         exit(1);
 }
 
 Q_DECL_EXPORT int
 main(int argc, char **argv)
 {
+#ifdef HPSJAM_SERVER_ONLY
+	static const char hpsjam_short_opts[] = {
+	    "M:q:p:sP:G:Z:k:fW:C:Y:zhBK:w:T:x:y:mS:Vb"
+	};
+#else
 	static const char hpsjam_short_opts[] = {
-	    "M:q:p:sP:hBJ:n:K:w:N:i:c:U:D:I:O:l:L:r:R:"
+	    "M:q:p:sP:G:Z:k:fW:C:Y:zo:hBJ:n:a:K:w:N:i:c:EX:gu:U:D:j:AT:x:y:mS:VFbI:O:l:L:r:R:"
 	};
+#endif
 	int c;
 	int port = HPSJAM_DEFAULT_PORT;
 	int cliport = 0;
 #ifndef _WIN32
 	int do_fork = 0;
+	int do_mlock = 0;
 #endif
+	const char *trunk_to[HPSJAM_TRUNKS_MAX];
+	unsigned num_trunks = 0;
+#ifdef HPSJAM_SERVER_ONLY
+	/* this program is always a server */
+	hpsjam_num_server_peers = 1;
+#else
 	bool jackconnect = true;
 	const char *jackname = "hpsjam";
+	const char *audio_file = 0;
 	const char *nickname = 0;
 	const char *passwd = 0;
 	const char *connect_to = 0;
 	int icon_nr = -1;
 	int uplink_format = -1;
 	int downlink_format = -1;
+	int jitter_target = -1;
 	int input_device = -1;
 	int output_device = -1;
 	int input_left = -1;
 	int output_left = -1;
 	int input_right = -1;
 	int output_right = -1;
+#endif
 
 	while ((c = getopt_long_only(argc, argv, hpsjam_short_opts, hpsjam_opts, NULL)) != -1) {
 		switch (c) {
@@ -168,6 +257,14 @@ main(int argc, char **argv)
 			if (hpsjam_num_server_peers == 0 || hpsjam_num_server_peers > HPSJAM_PEERS_MAX)
 				usage();
 			break;
+		case 'G':
+			if (hpsjam_num_server_peers == 0)
+				usage();
+			hpsjam_num_server_listeners = atoi(optarg);
+			if (hpsjam_num_server_listeners > HPSJAM_LISTENERS_MAX)
+				usage();
+			break;
+#ifndef HPSJAM_SERVER_ONLY
 		case 'U':
 			uplink_format = atoi(optarg);
 			if (uplink_format < 0 || uplink_format > HPSJAM_AUDIO_FORMAT_MAX - 1)
@@ -178,6 +275,23 @@ main(int argc, char **argv)
 			if (downlink_format < 0 || downlink_format > HPSJAM_AUDIO_FORMAT_MAX - 1)
 				usage();
 			break;
+		case 'j':
+			jitter_target = atoi(optarg);
+			if (jitter_target < 0 || jitter_target > HPSJAM_JITTER_TARGET_MAX - 1)
+				usage();
+			break;
+		case 'A':
+			hpsjam_audio_clock = true;
+			break;
+		case 'F':
+			exit(hpsjam_equalizer_precompute());
+#endif
+		case 'b':
+			hpsjam_limiter_benchmark();
+#ifdef HPSJAM_SERVER_ONLY
+			exit(0);
+#else
+			exit(hpsjam_equalizer_benchmark());
 		case 'I':
 			input_device = atoi(optarg);
 			if (input_device < 0)
@@ -208,20 +322,53 @@ main(int argc, char **argv)
 			if (output_right < 0)
 				usage();
 			break;
+#endif
 #ifndef _WIN32
 		case 'B':
 			do_fork = 1;
 			break;
+		case 'T':
+			hpsjam_rt_priority = atoi(optarg);
+			if (hpsjam_rt_priority < 1 || hpsjam_rt_priority > 99)
+				usage();
+			break;
+		case 'x':
+			hpsjam_rt_cpu_timer = atoi(optarg);
+			if (hpsjam_rt_cpu_timer < 0)
+				usage();
+			break;
+		case 'y':
+			hpsjam_rt_cpu_receive = atoi(optarg);
+			if (hpsjam_rt_cpu_receive < 0)
+				usage();
+			break;
+		case 'm':
+			do_mlock = 1;
+			break;
+		case 'S':
+			hpsjam_rt_spin_us = atoi(optarg);
+			if (hpsjam_rt_spin_us < 0 || hpsjam_rt_spin_us > 1000)
+				usage();
+			break;
+		case 'V':
+			hpsjam_rt_report = true;
+			break;
 #endif
+#ifndef HPSJAM_SERVER_ONLY
 		case 'J':
 			jackconnect = false;
 			break;
 		case 'n':
 			jackname = optarg;
 			break;
+		case 'a':
+			audio_file = optarg;
+			break;
+#endif
 		case 'K':
+#ifndef HPSJAM_SERVER_ONLY
 			passwd = optarg;
-
+#endif
 			if (sscanf(optarg, "%llx", (long long *)&hpsjam_server_passwd) != 1)
 				usage();
 			break;
@@ -229,6 +376,7 @@ main(int argc, char **argv)
 			if (sscanf(optarg, "%llx", (long long *)&hpsjam_mixer_passwd) != 1)
 				usage();
 			break;
+#ifndef HPSJAM_SERVER_ONLY
 		case 'N':
 			nickname = optarg;
 			break;
@@ -240,6 +388,85 @@ main(int argc, char **argv)
 		case 'c':
 			connect_to = optarg;
 			break;
+		case 'E':
+			hpsjam_client_listen = true;
+			break;
+		case 'g':
+			hpsjam_client_p2p = true;
+			break;
+		case 'u':
+			hpsjam_client_multipath = optarg;
+			break;
+		case 'X':
+			c = atoi(optarg);
+			if (c < 0 || c > HPSJAM_ROOMS_MAX - 1)
+				usage();
+			hpsjam_client_room = c;
+			break;
+#endif
+		case 'k':
+			if (hpsjam_num_server_peers == 0 ||
+			    num_trunks == HPSJAM_TRUNKS_MAX)
+				usage();
+			trunk_to[num_trunks++] = optarg;
+			break;
+		case 'f':
+			if (hpsjam_num_server_peers == 0)
+				usage();
+			hpsjam_server_sfu = true;
+			break;
+		case 'W':
+			if (hpsjam_num_server_peers == 0)
+				usage();
+			hpsjam_record_dir = optarg;
+			break;
+		case 'C':
+			if (hpsjam_num_server_peers == 0)
+				usage();
+			hpsjam_capture_file = optarg;
+			break;
+		case 'Y':
+			if (hpsjam_num_server_peers == 0)
+				usage();
+			hpsjam_replay_file = optarg;
+			break;
+		case 'z':
+			if (hpsjam_num_server_peers == 0)
+				usage();
+			hpsjam_replay_fast = true;
+			break;
+#ifndef HPSJAM_SERVER_ONLY
+		case 'o': {
+			struct hpsjam_simulate_config &cfg = hpsjam_simulate_cfg;
+
+			if (hpsjam_num_server_peers == 0)
+				usage();
+			memset(&cfg, 0, sizeof(cfg));
+			if (sscanf(optarg, "%u:%u:%d:%u:%u", &cfg.clients, &cfg.seconds,
+			    &cfg.drift_ppm, &cfg.loss, &cfg.jitter_ms) < 2 ||
+			    cfg.clients == 0 || cfg.clients > HPSJAM_PEERS_MAX ||
+			    cfg.drift_ppm < -1000 || cfg.drift_ppm > 1000 ||
+			    cfg.loss > 1000 || cfg.jitter_ms > 1000)
+				usage();
+			break;
+		}
+#endif
+		case 'Z': {
+			unsigned id;
+			unsigned long long key;
+			int off = 0;
+
+			if (hpsjam_num_server_peers == 0)
+				usage();
+			if (sscanf(optarg, "%u:%llx%n", &id, &key, &off) != 2 ||
+			    id == 0 || id > HPSJAM_ROOMS_MAX - 1)
+				usage();
+			hpsjam_rooms[id].passwd = key;
+			hpsjam_rooms[id].welcome_message_file =
+			    (optarg[off] == ':') ? optarg + off + 1 : 0;
+			hpsjam_rooms[id].valid = true;
+			break;
+		}
 		case ' ':
 			/* ignore */
 			break;
@@ -249,11 +476,29 @@ main(int argc, char **argv)
 		}
 	}
 
+#ifndef HPSJAM_SERVER_ONLY
+	/* the simulated clients need a peer slot each */
+	if (hpsjam_simulate_cfg.clients > hpsjam_num_server_peers)
+		usage();
+#endif
+
+	/* trunk links need at least one peer slot left for clients */
+	if (num_trunks != 0 && num_trunks >= hpsjam_num_server_peers)
+		usage();
+
+	/* the default room */
+	hpsjam_rooms[0].passwd = hpsjam_server_passwd;
+	hpsjam_rooms[0].welcome_message_file = hpsjam_welcome_message_file;
+	hpsjam_rooms[0].valid = true;
+
 #ifndef _WIN32
 	if (do_fork && daemon(0, 0) != 0)
 		errx(1, "Cannot daemonize");
+	if (do_mlock && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		warn("Cannot lock memory");
 #endif
 
+#ifndef HPSJAM_SERVER_ONLY
 	qRegisterMetaType<uint8_t>("uint8_t");
 
 	if (hpsjam_num_server_peers == 0) {
@@ -262,6 +507,9 @@ main(int argc, char **argv)
 		/* set consistent double click interval */
 		app.setDoubleClickInterval(250);
 
+		/* load FFTW wisdom and start equalizer worker thread */
+		hpsjam_equalizer_init();
+
 		hpsjam_client_peer = new class hpsjam_client_peer;
 		hpsjam_client = new HpsJamClient();
 
@@ -289,6 +537,17 @@ main(int argc, char **argv)
 		atexit(&hpsjam_sound_uninit);
 #endif
 
+#ifdef HAVE_NULL_AUDIO
+		if (hpsjam_sound_init(audio_file, 0)) {
+			QMessageBox::information(hpsjam_client, QObject::tr("NO AUDIO"),
+				QObject::tr("Cannot load the audio input file.\n"
+					    "Check that it is a WAV file with a\n"
+					    "sample rate of %1Hz.").arg(HPSJAM_SAMPLE_RATE));
+		}
+		/* register exit hook for audio */
+		atexit(&hpsjam_sound_uninit);
+#endif
+
 #ifdef HAVE_MAC_AUDIO
 		if (hpsjam_sound_init(0, 0)) {
 			QMessageBox::information(hpsjam_client, QObject::tr("NO AUDIO"),
@@ -359,6 +618,8 @@ main(int argc, char **argv)
 			hpsjam_client->w_config->up_fmt.setIndex(uplink_format);
 		if (downlink_format > -1)
 			hpsjam_client->w_config->down_fmt.setIndex(downlink_format);
+		if (jitter_target > -1)
+			hpsjam_client->w_config->jitter.setIndex(jitter_target);
 
 		/* set a valid UDP buffer size */
 		hpsjam_udp_buffer_size = 2000 * HPSJAM_SEQ_MAX;
@@ -379,24 +640,66 @@ main(int argc, char **argv)
 		hpsjam_client->show();
 
 		return (app.exec());
-	} else {
-		QCoreApplication app(argc, argv);
+	}
+#endif
 
-		hpsjam_server_peers = new class hpsjam_server_peer [hpsjam_num_server_peers];
+	hpsjam_server_peers = new class hpsjam_server_peer [hpsjam_num_server_peers];
+	hpsjam_server_mix_alloc(hpsjam_num_server_peers);
+	if (hpsjam_num_server_listeners != 0)
+		hpsjam_server_listeners = new class hpsjam_server_listener [hpsjam_num_server_listeners];
+
+	/* set a valid UDP buffer size */
+	hpsjam_udp_buffer_size = 2000 * HPSJAM_SEQ_MAX * hpsjam_num_server_peers +
+	    2000 * hpsjam_num_server_listeners;
+
+	/* replay a capture file instead of serving, if any */
+	if (hpsjam_replay_file != 0)
+		return (hpsjam_replay());
+#if !defined(_WIN32) && !defined(HPSJAM_SERVER_ONLY)
+	/* run a simulation instead of serving, if any */
+	if (hpsjam_simulate_cfg.clients != 0)
+		return (hpsjam_simulate());
+#endif
 
-		/* set a valid UDP buffer size */
-		hpsjam_udp_buffer_size = 2000 * HPSJAM_SEQ_MAX * hpsjam_num_server_peers;
+	/* start capturing, if any */
+	hpsjam_capture_init();
 
-		/* create sockets, if any */
-		hpsjam_socket_init(port, cliport);
+	/* create sockets, if any */
+	hpsjam_socket_init(port, cliport);
 
-		/* create timer, if any */
-		hpsjam_timer_init();
+	/* start recording, if any */
+	hpsjam_recorder_init();
+
+	/* create timer, if any */
+	hpsjam_timer_init();
+
+	/* connect trunk links, if any, using the lowest peer slots */
+	for (unsigned x = 0; x != num_trunks; x++) {
+		class hpsjam_server_peer &peer = hpsjam_server_peers[x];
+		std::string host(trunk_to[x]);
+		std::string service(HPSJAM_DEFAULT_PORT_STR);
+		const size_t off = host.rfind(':');
+
+		if (off != std::string::npos) {
+			service = host.substr(off + 1);
+			host.resize(off);
+		}
+
+		std::unique_lock<std::mutex> locker(peer.lock);
+		if (hpsjam_v4.resolve(host.c_str(), service.c_str(), peer.trunk_address) == false &&
+		    hpsjam_v6.resolve(host.c_str(), service.c_str(), peer.trunk_address) == false)
+			errx(1, "Could not resolve trunk server at: %s", trunk_to[x]);
+		peer.trunk_connect();
+	}
 
-		/* prevent system from sleeping this program */
+	/* prevent system from sleeping this program */
 #if defined(Q_OS_MACX)
-		HpsJamBeginActivity();
+	HpsJamBeginActivity();
 #endif
-		return (app.exec());
-	}
+
+	/* the timer and receive threads do all the work */
+	while (1)
+		usleep(1000000);
+
+	return (0);
 }
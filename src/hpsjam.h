@@ -30,6 +30,13 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#ifdef HPSJAM_SERVER_ONLY
+/* the server only build does not depend on Qt */
+#define	Q_DECL_EXPORT
+#else
+#include <QtGlobal>
+#endif
+
 #define	HPSJAM_SAMPLE_RATE 48000
 #define	HPSJAM_DEF_SAMPLES (HPSJAM_SAMPLE_RATE / 1000)
 #define	HPSJAM_NOM_SAMPLES ((3 * HPSJAM_SAMPLE_RATE) / (2 * 1000))
@@ -37,10 +44,17 @@
 #define	HPSJAM_VERSION_STRING "v1.0.8"
 #define	HPSJAM_ICON_FILE ":/HpsJam.png"
 #define	HPSJAM_PEERS_MAX 256
+#define	HPSJAM_LISTENERS_MAX 4096
+#define	HPSJAM_ROOMS_MAX 256
+#define	HPSJAM_TRUNKS_MAX 8
+#define	HPSJAM_DIRECT_TIMEOUT 1000	/* ticks */
+#define	HPSJAM_TRUNK_FORMAT HPSJAM_TYPE_AUDIO_24_BIT_2CH
 #define	HPSJAM_SEQ_MAX 16
 #define	HPSJAM_NUM_ICONS 14
 #define	HPSJAM_AUDIO_FORMAT_MAX 9
 #define	HPSJAM_AUDIO_LEVELS_MAX 5
+#define	HPSJAM_JITTER_TARGET_MAX 5
+#define	HPSJAM_JITTER_TARGET_DEFAULT 2	/* P99 */
 #define	HPSJAM_ICON_SIZE 64 /* 64x64 px SVG */
 #define	HPSJAM_MAX_UDP 2048 /* bytes (need to have room for two packets) */
 #define	HPSJAM_DEFAULT_PORT 22124
@@ -63,21 +77,37 @@
 } while (0)
 
 class hpsjam_server_peer;
+class hpsjam_server_listener;
 class hpsjam_client_peer;
 class HpsJamClient;
 class QMutex;
 struct hpsjam_socket_address;
 
+struct hpsjam_room {
+	uint64_t passwd;
+	const char *welcome_message_file;
+	bool valid;
+};
+
+extern struct hpsjam_room hpsjam_rooms[HPSJAM_ROOMS_MAX];
+extern uint8_t hpsjam_client_room;
 extern uint64_t hpsjam_server_passwd;
 extern uint64_t hpsjam_mixer_passwd;
 extern unsigned hpsjam_num_server_peers;
+extern unsigned hpsjam_num_server_listeners;
 extern unsigned hpsjam_udp_buffer_size;
 extern class hpsjam_server_peer *hpsjam_server_peers;
+extern class hpsjam_server_listener *hpsjam_server_listeners;
+extern bool hpsjam_client_listen;
+extern bool hpsjam_client_p2p;
+extern bool hpsjam_server_sfu;
 extern class hpsjam_client_peer *hpsjam_client_peer;
 extern class HpsJamClient *hpsjam_client;
 extern struct hpsjam_socket_address hpsjam_v4;
 extern struct hpsjam_socket_address hpsjam_v6;
 extern struct hpsjam_socket_address hpsjam_cli;
+extern struct hpsjam_socket_address hpsjam_alt;
+extern const char *hpsjam_client_multipath;
 extern const char *hpsjam_welcome_message_file;
 
 extern void hpsjam_socket_init(unsigned short port, unsigned short cliport);
@@ -24,3 +24,11 @@
  */
 
 #include "jitter.h"
+
+const struct hpsjam_jitter_target hpsjam_jitter_target[HPSJAM_JITTER_TARGET_MAX] = {
+	{ "P90", 0.90f },
+	{ "P95", 0.95f },
+	{ "P99", 0.99f },
+	{ "P99.9", 0.999f },
+	{ "MAX", 1.0f },
+};
@@ -37,51 +37,89 @@
 #error "HPSJAM_MAX_JITTER must be power of two."
 #endif
 
+#define	HPSJAM_JITTER_DECAY 128.0f	/* updates of HPSJAM_MAX_JITTER packets, about 4 seconds */
+
+struct hpsjam_jitter_target {
+	const char *descr;
+	float percentile;
+};
+
+extern const struct hpsjam_jitter_target hpsjam_jitter_target[HPSJAM_JITTER_TARGET_MAX];
+
 struct hpsjam_jitter {
 	float stats[HPSJAM_MAX_JITTER];
 	uint64_t packet_loss;
 	uint16_t counter;
 	uint16_t jitter_ticks;
+	uint8_t target;
+	uint8_t update_count;
 
 	void clear() {
 		memset(this, 0, sizeof(*this));
+		target = HPSJAM_JITTER_TARGET_DEFAULT;
+	};
+	void setTarget(uint8_t value) {
+		if (value < HPSJAM_JITTER_TARGET_MAX)
+			target = value;
 	};
 	uint16_t get_jitter_in_ms() {
 		return (jitter_ticks);
 	};
-	void rx_packet() {
-		/* assume one packet per tick */
-		const uint8_t index = ((uint16_t)(hpsjam_ticks - counter)) % HPSJAM_MAX_JITTER;
-		stats[index] += 1.0f;
-		counter++;
+	void update() {
+		uint8_t start = 0;
+		uint8_t gap = 0;
+		uint8_t run = 0;
+		float sum = 0.0f;
+		float limit;
 
-		if (stats[index] >= HPSJAM_MAX_JITTER) {
-			unsigned mask = 0;
-			unsigned start;
+		/* apply exponential decay and compute total */
+		for (uint8_t x = 0; x != HPSJAM_MAX_JITTER; x++) {
+			stats[x] -= stats[x] / HPSJAM_JITTER_DECAY;
+			sum += stats[x];
+		}
 
-			for (uint8_t x = 0; x != HPSJAM_MAX_JITTER; x++) {
-				stats[x] /= 2.0f;
-				mask |= (stats[x] >= 0.5f) << x;
-			}
+		if (sum < 1.0f)
+			return;
 
-			start = mask;
-			for (uint8_t x = 0; x != HPSJAM_MAX_JITTER; x++) {
-				if (start > mask)
-					start = mask;
-				if (mask & 1) {
-					mask >>= 1;
-					mask |= 1U << (HPSJAM_MAX_JITTER - 1);
-				} else {
-					mask >>= 1;
+		/*
+		 * The histogram is circular. Find the end of the
+		 * longest run of empty buckets, which is where the
+		 * packets with the least delay are accounted:
+		 */
+		for (uint8_t x = 0; x != 2 * HPSJAM_MAX_JITTER; x++) {
+			const uint8_t y = x % HPSJAM_MAX_JITTER;
+
+			if (stats[y] < 0.5f) {
+				run++;
+			} else {
+				if (run > gap) {
+					gap = run;
+					start = y;
 				}
+				run = 0;
 			}
+		}
 
-			/* recompute jitter_ticks */
-			jitter_ticks = 0;
-			while (start > 1) {
-				jitter_ticks++;
-				start /= 2;
-			}
+		/* recompute jitter_ticks from selected percentile */
+		limit = sum * hpsjam_jitter_target[target].percentile - 0.25f;
+		sum = 0.0f;
+
+		for (jitter_ticks = 0; jitter_ticks != HPSJAM_MAX_JITTER - 1; jitter_ticks++) {
+			sum += stats[(start + jitter_ticks) % HPSJAM_MAX_JITTER];
+			if (sum >= limit)
+				break;
+		}
+	};
+	void rx_packet() {
+		/* assume one packet per tick */
+		const uint8_t index = ((uint16_t)(hpsjam_ticks - counter)) % HPSJAM_MAX_JITTER;
+		stats[index] += 1.0f;
+		counter++;
+
+		/* update estimate regularly */
+		if (++update_count == HPSJAM_MAX_JITTER) {
+			update_count = 0;
+			update();
 		}
 	};
 
@@ -0,0 +1,438 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsjam.h"
+#include "peer.h"
+#include "timer.h"
+#include "audiofile.h"
+
+#include <QCoreApplication>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <err.h>
+
+#include <chrono>
+#include <thread>
+
+/*
+ * The load generator runs many independent clients in one headless
+ * process, to test the capacity of a server. Each client has its own
+ * socket, audio format and audio input. The clients are ticked once
+ * per millisecond by a number of worker threads, and a single thread
+ * receives the frames of all clients. All clients share the same
+ * clock, so there is no clock drift between the audio and the
+ * network.
+ */
+#define	HPSJAM_LOAD_THREADS_MAX 64
+
+struct hpsjam_load_client {
+	class hpsjam_client_peer peer;
+	struct hpsjam_socket_address sock;
+	struct hpsjam_audio_player player;
+	uint64_t last_loss;
+};
+
+static struct hpsjam_load_client *hpsjam_load_clients;
+static unsigned hpsjam_load_num_clients = 1;
+static unsigned hpsjam_load_num_threads;
+static struct hpsjam_audio_file hpsjam_load_file;
+static std::chrono::steady_clock::time_point hpsjam_load_start;
+
+static const struct option hpsjam_load_opts[] = {
+	{ "connect", required_argument, NULL, 'c' },
+	{ "clients", required_argument, NULL, 'C' },
+	{ "threads", required_argument, NULL, 't' },
+	{ "password", required_argument, NULL, 'K' },
+	{ "nickname", required_argument, NULL, 'N' },
+	{ "join-room", required_argument, NULL, 'X' },
+	{ "listen", no_argument, NULL, 'E' },
+	{ "audio-uplink-format", required_argument, NULL, 'U' },
+	{ "audio-downlink-format", required_argument, NULL, 'D' },
+	{ "jitter-target", required_argument, NULL, 'j' },
+	{ "audio-input-file", required_argument, NULL, 'a' },
+	{ "duration", required_argument, NULL, 'd' },
+	{ "report", required_argument, NULL, 'r' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "HpsJamLoad --connect <servername:port> [--clients <1..%u>] \\\n"
+		"	[--threads <1..%u>] \\\n"
+		"	[--password <64_bit_hexadecimal_password>] \\\n"
+		"	[--nickname <prefix>] [--join-room <0..%u>] [--listen] \\\n"
+		"	[--audio-uplink-format <0..%u or all>] \\\n"
+		"	[--audio-downlink-format <0..%u>] \\\n"
+		"	[--jitter-target <0..%u, Default is %u>] \\\n"
+		"	[--audio-input-file <48kHz_WAV_file>] \\\n"
+		"	[--duration <seconds>] [--report <seconds, Default is 5>]\n",
+		HPSJAM_PEERS_MAX * 16,
+		HPSJAM_LOAD_THREADS_MAX,
+		HPSJAM_ROOMS_MAX - 1,
+		HPSJAM_AUDIO_FORMAT_MAX - 1,
+		HPSJAM_AUDIO_FORMAT_MAX - 1,
+		HPSJAM_JITTER_TARGET_MAX - 1,
+		HPSJAM_JITTER_TARGET_DEFAULT);
+	exit(1);
+}
+
+static void *
+hpsjam_load_receive(void *)
+{
+	const unsigned num = hpsjam_load_num_clients;
+	struct pollfd *pfd = new struct pollfd [num];
+	union hpsjam_frame frame;
+	size_t last = 0;
+
+	hpsjam_thread_set_priority(hpsjam_rt_cpu_receive);
+
+	for (unsigned x = 0; x != num; x++) {
+		pfd[x].fd = hpsjam_load_clients[x].sock.fd;
+		pfd[x].events = POLLIN;
+		pfd[x].revents = 0;
+	}
+
+	frame.clear();
+
+	while (1) {
+		if (poll(pfd, num, 1000) <= 0)
+			continue;
+
+		for (unsigned x = 0; x != num; x++) {
+			struct hpsjam_load_client &client = hpsjam_load_clients[x];
+
+			if ((pfd[x].revents & POLLIN) == 0)
+				continue;
+
+			while (1) {
+				struct hpsjam_socket_address src = client.sock;
+				const ssize_t ret = src.recvfrom((char *)&frame, sizeof(frame));
+
+				if (ret < 0)
+					break;
+				if (ret < (ssize_t)sizeof(frame.hdr))
+					continue;
+				/* zero end of previous frame to avoid garbage */
+				frame.zero_tail(ret, last);
+				last = ret;
+
+				QMutexLocker locker(&client.peer.lock);
+				if (client.peer.address == src)
+					client.peer.input_pkt.receive(frame, ret);
+			}
+		}
+	}
+	return (0);
+}
+
+static void *
+hpsjam_load_worker(void *arg)
+{
+	const unsigned index = (unsigned)(uintptr_t)arg;
+	const unsigned first = (hpsjam_load_num_clients * index) / hpsjam_load_num_threads;
+	const unsigned last = (hpsjam_load_num_clients * (index + 1)) / hpsjam_load_num_threads;
+	auto next = hpsjam_load_start;
+	float left[HPSJAM_DEF_SAMPLES];
+	float right[HPSJAM_DEF_SAMPLES];
+
+	hpsjam_thread_set_priority(hpsjam_rt_cpu_timer);
+
+	while (1) {
+		next += std::chrono::milliseconds(1);
+		std::this_thread::sleep_until(next);
+
+		/* the first worker owns the shared clock */
+		if (index == 0)
+			hpsjam_ticks++;
+
+		for (unsigned x = first; x != last; x++) {
+			struct hpsjam_load_client &client = hpsjam_load_clients[x];
+
+			client.player.getSamples(left, right, HPSJAM_DEF_SAMPLES);
+			client.peer.sound_process(left, right, HPSJAM_DEF_SAMPLES);
+			client.peer.tick();
+		}
+	}
+	return (0);
+}
+
+static void
+hpsjam_load_report(bool last)
+{
+	const unsigned num = hpsjam_load_num_clients;
+	unsigned connected = 0;
+	uint64_t loss = 0;
+	unsigned jitter_max = 0;
+	unsigned jitter_sum = 0;
+	unsigned rtt_max = 0;
+	unsigned rtt_sum = 0;
+
+	const double elapsed = std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - hpsjam_load_start).count();
+
+	for (unsigned x = 0; x != num; x++) {
+		struct hpsjam_load_client &client = hpsjam_load_clients[x];
+		QMutexLocker locker(&client.peer.lock);
+		const uint64_t packet_loss = client.peer.input_pkt.jitter.packet_loss;
+		const unsigned jitter = client.peer.input_pkt.jitter.get_jitter_in_ms();
+		const unsigned rtt = client.peer.output_pkt.ping_time;
+
+		if (rtt != 0)
+			connected++;
+		loss += packet_loss - client.last_loss;
+		client.last_loss = packet_loss;
+		jitter_sum += jitter;
+		rtt_sum += rtt;
+		if (jitter > jitter_max)
+			jitter_max = jitter;
+		if (rtt > rtt_max)
+			rtt_max = rtt;
+
+		if (last) {
+			printf("HpsJamLoad: client %u: packets lost %llu, "
+			    "jitter %u ms, RTT %u ms\n", x,
+			    (unsigned long long)packet_loss, jitter, rtt);
+		}
+	}
+
+	printf("HpsJamLoad: %.1fs: %u/%u clients connected, %llu packets lost, "
+	    "jitter avg %.1f max %u ms, RTT avg %.1f max %u ms\n",
+	    elapsed, connected, num, (unsigned long long)loss,
+	    (double)jitter_sum / num, jitter_max,
+	    (double)rtt_sum / num, rtt_max);
+	fflush(stdout);
+}
+
+Q_DECL_EXPORT int
+main(int argc, char **argv)
+{
+	static const char hpsjam_load_short_opts[] = {
+	    "c:C:t:K:N:X:EU:D:j:a:d:r:h"
+	};
+	struct hpsjam_socket_address server;
+	const char *connect_to = 0;
+	const char *nickname = "load";
+	const char *audio_file = 0;
+	int uplink_format = 6;		/* 2CH@16Bit */
+	int downlink_format = 6;
+	int jitter_target = HPSJAM_JITTER_TARGET_DEFAULT;
+	unsigned duration = 0;
+	unsigned report = 5;
+	pthread_t pt;
+	int c;
+
+	while ((c = getopt_long_only(argc, argv, hpsjam_load_short_opts, hpsjam_load_opts, NULL)) != -1) {
+		switch (c) {
+		case 'c':
+			connect_to = optarg;
+			break;
+		case 'C':
+			hpsjam_load_num_clients = atoi(optarg);
+			if (hpsjam_load_num_clients == 0 ||
+			    hpsjam_load_num_clients > HPSJAM_PEERS_MAX * 16)
+				usage();
+			break;
+		case 't':
+			hpsjam_load_num_threads = atoi(optarg);
+			if (hpsjam_load_num_threads == 0 ||
+			    hpsjam_load_num_threads > HPSJAM_LOAD_THREADS_MAX)
+				usage();
+			break;
+		case 'K':
+			if (sscanf(optarg, "%llx", (long long *)&hpsjam_server_passwd) != 1)
+				usage();
+			break;
+		case 'N':
+			nickname = optarg;
+			break;
+		case 'X':
+			c = atoi(optarg);
+			if (c < 0 || c > HPSJAM_ROOMS_MAX - 1)
+				usage();
+			hpsjam_client_room = c;
+			break;
+		case 'E':
+			hpsjam_client_listen = true;
+			break;
+		case 'U':
+			if (strcmp(optarg, "all") == 0) {
+				uplink_format = -1;
+				break;
+			}
+			uplink_format = atoi(optarg);
+			if (uplink_format < 0 || uplink_format > HPSJAM_AUDIO_FORMAT_MAX - 1)
+				usage();
+			break;
+		case 'D':
+			downlink_format = atoi(optarg);
+			if (downlink_format < 0 || downlink_format > HPSJAM_AUDIO_FORMAT_MAX - 1)
+				usage();
+			break;
+		case 'j':
+			jitter_target = atoi(optarg);
+			if (jitter_target < 0 || jitter_target > HPSJAM_JITTER_TARGET_MAX - 1)
+				usage();
+			break;
+		case 'a':
+			audio_file = optarg;
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'r':
+			report = atoi(optarg);
+			if (report == 0)
+				usage();
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (connect_to == 0)
+		usage();
+
+	if (hpsjam_load_num_threads == 0) {
+		hpsjam_load_num_threads = std::thread::hardware_concurrency();
+		if (hpsjam_load_num_threads == 0)
+			hpsjam_load_num_threads = 1;
+		else if (hpsjam_load_num_threads > HPSJAM_LOAD_THREADS_MAX)
+			hpsjam_load_num_threads = HPSJAM_LOAD_THREADS_MAX;
+	}
+	if (hpsjam_load_num_threads > hpsjam_load_num_clients)
+		hpsjam_load_num_threads = hpsjam_load_num_clients;
+
+	if (audio_file != 0 && hpsjam_load_file.load(audio_file))
+		errx(1, "Cannot load audio input file %s", audio_file);
+
+	QCoreApplication app(argc, argv);
+
+	/* resolve the server address */
+	QByteArray host(connect_to);
+	QByteArray service(HPSJAM_DEFAULT_PORT_STR);
+	const int off = host.lastIndexOf(':');
+
+	if (off > -1) {
+		service = host.mid(off + 1);
+		host.truncate(off);
+	}
+
+	/* set a valid UDP buffer size */
+	hpsjam_udp_buffer_size = 2000 * HPSJAM_SEQ_MAX;
+
+	hpsjam_v4.init(AF_INET);
+	hpsjam_v4.socket(hpsjam_udp_buffer_size);
+	hpsjam_v6.init(AF_INET6);
+	hpsjam_v6.socket(hpsjam_udp_buffer_size);
+
+	if (hpsjam_v4.resolve(host.constData(), service.constData(), server) == false &&
+	    hpsjam_v6.resolve(host.constData(), service.constData(), server) == false)
+		errx(1, "Could not resolve server at: %s", connect_to);
+
+	hpsjam_load_clients = new struct hpsjam_load_client [hpsjam_load_num_clients];
+
+	for (unsigned x = 0; x != hpsjam_load_num_clients; x++) {
+		struct hpsjam_load_client &client = hpsjam_load_clients[x];
+		struct hpsjam_packet_entry *pkt;
+		const uint8_t up = hpsjam_client_listen ? (uint8_t)HPSJAM_TYPE_AUDIO_SILENCE :
+		    hpsjam_audio_format[(uplink_format < 0) ?
+		    (1 + x % (HPSJAM_AUDIO_FORMAT_MAX - 1)) : uplink_format].format;
+		char name[64];
+
+		client.sock.init(server.v4.sin_family);
+		if (client.sock.socket(hpsjam_udp_buffer_size) < 0 || client.sock.bind() < 0)
+			errx(1, "Cannot allocate UDP socket for client %u", x);
+		fcntl(client.sock.fd, F_SETFL, fcntl(client.sock.fd, F_GETFL) | O_NONBLOCK);
+
+		client.player.init(hpsjam_load_file.samples ? &hpsjam_load_file : 0,
+		    220.0f + 10.0f * (x % 64));
+		client.last_loss = 0;
+
+		QMutexLocker locker(&client.peer.lock);
+
+		/* set destination address */
+		client.peer.address = server;
+		client.peer.address.fd = client.sock.fd;
+
+		/* send initial ping */
+		pkt = new struct hpsjam_packet_entry;
+		pkt->packet.setPing((hpsjam_client_listen ? HPSJAM_PING_LISTENER : 0) |
+		    hpsjam_client_room, hpsjam_ticks, hpsjam_server_passwd);
+		pkt->packet.type = HPSJAM_TYPE_PING_REQUEST;
+		pkt->insert_tail(&client.peer.output_pkt.head);
+
+		/* send initial configuration */
+		pkt = new struct hpsjam_packet_entry;
+		pkt->packet.setConfigure(hpsjam_audio_format[downlink_format].format, jitter_target);
+		pkt->packet.type = HPSJAM_TYPE_CONFIGURE_REQUEST;
+		pkt->insert_tail(&client.peer.output_pkt.head);
+
+		/* send name */
+		snprintf(name, sizeof(name), "%s-%u", nickname, x);
+		pkt = new struct hpsjam_packet_entry;
+		pkt->packet.setRawData(name, strlen(name));
+		pkt->packet.type = HPSJAM_TYPE_NAME_REQUEST;
+		pkt->insert_tail(&client.peer.output_pkt.head);
+
+		client.peer.output_fmt = up;
+		client.peer.input_pkt.jitter.setTarget(jitter_target);
+	}
+
+	hpsjam_load_start = std::chrono::steady_clock::now();
+
+	if (pthread_create(&pt, 0, &hpsjam_load_receive, 0) != 0)
+		errx(1, "Cannot create receive thread");
+
+	for (unsigned x = 0; x != hpsjam_load_num_threads; x++) {
+		if (pthread_create(&pt, 0, &hpsjam_load_worker, (void *)(uintptr_t)x) != 0)
+			errx(1, "Cannot create worker thread");
+	}
+
+	/* run the queued signals, if any, and report regularly */
+	for (unsigned n = 1; ; n++) {
+		unsigned when = n * report;
+		const bool last = (duration != 0 && when >= duration);
+
+		if (last)
+			when = duration;
+
+		while (std::chrono::steady_clock::now() <
+		    hpsjam_load_start + std::chrono::seconds(when)) {
+			QCoreApplication::processEvents();
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		hpsjam_load_report(last);
+		if (last)
+			break;
+	}
+	return (0);
+}
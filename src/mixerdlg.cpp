@@ -619,6 +619,7 @@ HpsJamMixer :: handle_fader_disconnect(uint8_t mix, uint8_t index)
 	case 0:
 		peer_strip[index].init();
 		disable(index);
+		hpsjam_client_peer->setMixBits(index, 0);
 		break;
 	case 255:
 		self_strip.init();
@@ -636,6 +637,9 @@ HpsJamMixer :: handle_bits_changed(int id)
 
 	bits = peer_strip[id].getBits();
 
+	/* the personal mix is computed locally for forwarded audio */
+	hpsjam_client_peer->setMixBits(id, bits);
+
 	ptr = new struct hpsjam_packet_entry;
 	ptr->packet.type = HPSJAM_TYPE_FADER_BITS_REQUEST;
 	ptr->packet.setFaderData(0, id, &bits, 1);
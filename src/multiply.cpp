@@ -29,21 +29,21 @@
 #define	HPSJAM_X3_LOG2_COMBA 5
 #endif
 
-#if (HPSJAM_X3_LOG2_COMBA < 2)
-#error "HPSJAM_X3_LOG2_COMBA must be greater than 1"
+#if (HPSJAM_X3_LOG2_COMBA < 3)
+#error "HPSJAM_X3_LOG2_COMBA must be greater than 2"
 #endif
 
-struct hpsjam_x3_input_float {
-	float	a;
-	float	b;
-};
-
 /*
+ * The input is stored as two separate arrays and all loops operate
+ * on four floats at a time. The smallest butterfly processes
+ * (1 << (HPSJAM_X3_LOG2_COMBA - 1)) elements, which is a multiple
+ * of the vector size.
+ *
  * <input size> = "stride"
  * <output size> = 2 * "stride"
  */
 static void
-hpsjam_x3_multiply_sub_float(struct hpsjam_x3_input_float *input, float *ptr_low, float *ptr_high,
+hpsjam_x3_multiply_sub_float(float *input_a, float *input_b, float *ptr_low, float *ptr_high,
     const size_t stride, const uint8_t toggle)
 {
 	size_t x;
@@ -55,91 +55,120 @@ hpsjam_x3_multiply_sub_float(struct hpsjam_x3_input_float *input, float *ptr_low
 		if (toggle) {
 
 			/* inverse step */
-			for (x = 0; x != strideh; x++) {
-				float a, b, c, d;
+			for (x = 0; x != strideh; x += HPSJAM_X3_VEC) {
+				hpsjam_x3_vec_t a, b, c, d;
 
-				a = ptr_low[x];
-				b = ptr_low[x + strideh];
-				c = ptr_high[x];
-				d = ptr_high[x + strideh];
+				a = hpsjam_x3_load(ptr_low + x);
+				b = hpsjam_x3_load(ptr_low + x + strideh);
+				c = hpsjam_x3_load(ptr_high + x);
+				d = hpsjam_x3_load(ptr_high + x + strideh);
 
-				ptr_low[x + strideh] = a + b;
-				ptr_high[x] = a + b + c + d;
+				hpsjam_x3_store(ptr_low + x + strideh, a + b);
+				hpsjam_x3_store(ptr_high + x, a + b + c + d);
 			}
 
-			hpsjam_x3_multiply_sub_float(input, ptr_low, ptr_low + strideh, strideh, 1);
+			hpsjam_x3_multiply_sub_float(input_a, input_b, ptr_low, ptr_low + strideh, strideh, 1);
 
-			for (x = 0; x != strideh; x++)
-				ptr_low[x + strideh] = -ptr_low[x + strideh];
+			for (x = 0; x != strideh; x += HPSJAM_X3_VEC)
+				hpsjam_x3_store(ptr_low + x + strideh, -hpsjam_x3_load(ptr_low + x + strideh));
 
-			hpsjam_x3_multiply_sub_float(input + strideh, ptr_low + strideh, ptr_high + strideh, strideh, 1);
+			hpsjam_x3_multiply_sub_float(input_a + strideh, input_b + strideh,
+			    ptr_low + strideh, ptr_high + strideh, strideh, 1);
 
 			/* forward step */
-			for (x = 0; x != strideh; x++) {
-				float a, b, c, d;
+			for (x = 0; x != strideh; x += HPSJAM_X3_VEC) {
+				hpsjam_x3_vec_t a, b, c, d;
 
-				a = ptr_low[x];
-				b = ptr_low[x + strideh];
-				c = ptr_high[x];
-				d = ptr_high[x + strideh];
+				a = hpsjam_x3_load(ptr_low + x);
+				b = hpsjam_x3_load(ptr_low + x + strideh);
+				c = hpsjam_x3_load(ptr_high + x);
+				d = hpsjam_x3_load(ptr_high + x + strideh);
 
-				ptr_low[x + strideh] = -a - b;
-				ptr_high[x] = c + b - d;
+				hpsjam_x3_store(ptr_low + x + strideh, -a - b);
+				hpsjam_x3_store(ptr_high + x, c + b - d);
 
-				input[x + strideh].a += input[x].a;
-				input[x + strideh].b += input[x].b;
+				hpsjam_x3_store(input_a + x + strideh,
+				    hpsjam_x3_load(input_a + x + strideh) + hpsjam_x3_load(input_a + x));
+				hpsjam_x3_store(input_b + x + strideh,
+				    hpsjam_x3_load(input_b + x + strideh) + hpsjam_x3_load(input_b + x));
 			}
 
-			hpsjam_x3_multiply_sub_float(input + strideh, ptr_low + strideh, ptr_high, strideh, 0);
+			hpsjam_x3_multiply_sub_float(input_a + strideh, input_b + strideh,
+			    ptr_low + strideh, ptr_high, strideh, 0);
 		} else {
-			hpsjam_x3_multiply_sub_float(input + strideh, ptr_low + strideh, ptr_high, strideh, 1);
+			hpsjam_x3_multiply_sub_float(input_a + strideh, input_b + strideh,
+			    ptr_low + strideh, ptr_high, strideh, 1);
 
 			/* inverse step */
-			for (x = 0; x != strideh; x++) {
-				float a, b, c, d;
+			for (x = 0; x != strideh; x += HPSJAM_X3_VEC) {
+				hpsjam_x3_vec_t a, b, c, d;
 
-				a = ptr_low[x];
-				b = ptr_low[x + strideh];
-				c = ptr_high[x];
-				d = ptr_high[x + strideh];
+				a = hpsjam_x3_load(ptr_low + x);
+				b = hpsjam_x3_load(ptr_low + x + strideh);
+				c = hpsjam_x3_load(ptr_high + x);
+				d = hpsjam_x3_load(ptr_high + x + strideh);
 
-				ptr_low[x + strideh] = -a - b;
-				ptr_high[x] = a + b + c + d;
+				hpsjam_x3_store(ptr_low + x + strideh, -a - b);
+				hpsjam_x3_store(ptr_high + x, a + b + c + d);
 
-				input[x + strideh].a -= input[x].a;
-				input[x + strideh].b -= input[x].b;
+				hpsjam_x3_store(input_a + x + strideh,
+				    hpsjam_x3_load(input_a + x + strideh) - hpsjam_x3_load(input_a + x));
+				hpsjam_x3_store(input_b + x + strideh,
+				    hpsjam_x3_load(input_b + x + strideh) - hpsjam_x3_load(input_b + x));
 			}
 
-			hpsjam_x3_multiply_sub_float(input + strideh, ptr_low + strideh, ptr_high + strideh, strideh, 0);
+			hpsjam_x3_multiply_sub_float(input_a + strideh, input_b + strideh,
+			    ptr_low + strideh, ptr_high + strideh, strideh, 0);
 
-			for (x = 0; x != strideh; x++)
-				ptr_low[x + strideh] = -ptr_low[x + strideh];
+			for (x = 0; x != strideh; x += HPSJAM_X3_VEC)
+				hpsjam_x3_store(ptr_low + x + strideh, -hpsjam_x3_load(ptr_low + x + strideh));
 
-			hpsjam_x3_multiply_sub_float(input, ptr_low, ptr_low + strideh, strideh, 0);
+			hpsjam_x3_multiply_sub_float(input_a, input_b, ptr_low, ptr_low + strideh, strideh, 0);
 
 			/* forward step */
-			for (x = 0; x != strideh; x++) {
-				float a, b, c, d;
+			for (x = 0; x != strideh; x += HPSJAM_X3_VEC) {
+				hpsjam_x3_vec_t a, b, c, d;
+
+				a = hpsjam_x3_load(ptr_low + x);
+				b = hpsjam_x3_load(ptr_low + x + strideh);
+				c = hpsjam_x3_load(ptr_high + x);
+				d = hpsjam_x3_load(ptr_high + x + strideh);
+
+				hpsjam_x3_store(ptr_low + x + strideh, b - a);
+				hpsjam_x3_store(ptr_high + x, c - b - d);
+			}
+		}
+	} else if ((stride % HPSJAM_X3_VEC) == 0) {
+		float temp[2 * stride];
 
-				a = ptr_low[x];
-				b = ptr_low[x + strideh];
-				c = ptr_high[x];
-				d = ptr_high[x + strideh];
+		/* multiply into a linear buffer, four products at a time */
+		memset(temp, 0, sizeof(temp));
 
-				ptr_low[x + strideh] = b - a;
-				ptr_high[x] = c - b - d;
+		for (x = 0; x != stride; x++) {
+			const hpsjam_x3_vec_t value = { input_a[x], input_a[x], input_a[x], input_a[x] };
+
+			for (y = 0; y != stride; y += HPSJAM_X3_VEC) {
+				hpsjam_x3_store(temp + x + y, hpsjam_x3_load(temp + x + y) +
+				    hpsjam_x3_load(input_b + y) * value);
 			}
 		}
+
+		for (x = 0; x != stride; x += HPSJAM_X3_VEC) {
+			hpsjam_x3_store(ptr_low + x, hpsjam_x3_load(ptr_low + x) +
+			    hpsjam_x3_load(temp + x));
+			hpsjam_x3_store(ptr_high + x, hpsjam_x3_load(ptr_high + x) +
+			    hpsjam_x3_load(temp + stride + x));
+		}
 	} else {
 		for (x = 0; x != stride; x++) {
-			float value = input[x].a;
+			float value = input_a[x];
 
 			for (y = 0; y != (stride - x); y++) {
-				ptr_low[x + y] += input[y].b * value;
+				ptr_low[x + y] += input_b[y] * value;
 			}
 
 			for (; y != stride; y++) {
-				ptr_high[x + y - stride] += input[y].b * value;
+				ptr_high[x + y - stride] += input_b[y] * value;
 			}
 		}
 	}
@@ -152,19 +181,17 @@ hpsjam_x3_multiply_sub_float(struct hpsjam_x3_input_float *input, float *ptr_low
 void
 hpsjam_x3_multiply_float(const float *va, const float *vb, float *pc, const size_t max)
 {
-	struct hpsjam_x3_input_float input[max];
-	size_t x;
+	float input_a[max];
+	float input_b[max];
 
 	/* check for non-power of two */
 	if (max & (max - 1))
 		return;
 
-	/* setup input vector */
-	for (x = 0; x != max; x++) {
-		input[x].a = va[x];
-		input[x].b = vb[x];
-	}
+	/* setup input vectors */
+	memcpy(input_a, va, sizeof(input_a));
+	memcpy(input_b, vb, sizeof(input_b));
 
 	/* do multiplication */
-	hpsjam_x3_multiply_sub_float(input, pc, pc + max, max, 1);
+	hpsjam_x3_multiply_sub_float(input_a, input_b, pc, pc + max, max, 1);
 }
@@ -27,8 +27,27 @@
 #define	_HPSJAM_MULTIPLY_
 
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 
+typedef float hpsjam_x3_vec_t __attribute__((__vector_size__(16)));
+
+#define	HPSJAM_X3_VEC (sizeof(hpsjam_x3_vec_t) / sizeof(float))
+
+static inline hpsjam_x3_vec_t
+hpsjam_x3_load(const float *ptr)
+{
+	hpsjam_x3_vec_t retval;
+	memcpy(&retval, ptr, sizeof(retval));
+	return (retval);
+}
+
+static inline void
+hpsjam_x3_store(float *ptr, hpsjam_x3_vec_t value)
+{
+	memcpy(ptr, &value, sizeof(value));
+}
+
 extern void hpsjam_x3_multiply_float(const float *, const float *, float *, const size_t);
 
 #endif		/* _HPSJAM_MULTIPLY_ */
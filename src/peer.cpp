@@ -24,131 +24,60 @@
  */
 
 #include <QFile>
-#include <QTextStream>
 #include <QMutexLocker>
 
 #include "hpsjam.h"
 #include "peer.h"
+#include "transport.h"
 #include "compressor.h"
-#include "clientdlg.h"
-#include "chatdlg.h"
-#include "lyricsdlg.h"
 
 #include "timer.h"
 
+const struct hpsjam_audio_format hpsjam_audio_format[HPSJAM_AUDIO_FORMAT_MAX] = {
+	{ HPSJAM_TYPE_AUDIO_SILENCE, "DISABLE" , Qt::Key_0 },
+	{ HPSJAM_TYPE_AUDIO_8_BIT_1CH, "1CH@8Bit", Qt::Key_1 },
+	{ HPSJAM_TYPE_AUDIO_16_BIT_1CH, "1CH@16Bit", Qt::Key_3 },
+	{ HPSJAM_TYPE_AUDIO_24_BIT_1CH, "1CH@24Bit", Qt::Key_5 },
+	{ HPSJAM_TYPE_AUDIO_32_BIT_1CH, "1CH@32Bit", Qt::Key_7 },
+	{ HPSJAM_TYPE_AUDIO_8_BIT_2CH, "2CH@8Bit", Qt::Key_2 },
+	{ HPSJAM_TYPE_AUDIO_16_BIT_2CH, "2CH@16Bit", Qt::Key_4 },
+	{ HPSJAM_TYPE_AUDIO_24_BIT_2CH, "2CH@24Bit", Qt::Key_6 },
+	{ HPSJAM_TYPE_AUDIO_32_BIT_2CH, "2CH@32Bit", Qt::Key_8 },
+};
+
 Q_DECL_EXPORT void
-hpsjam_peer_receive(const struct hpsjam_socket_address &src,
-    const union hpsjam_frame &frame)
+hpsjam_client_receive(const struct hpsjam_socket_address &src,
+    const union hpsjam_frame &frame, size_t len)
 {
-	if (hpsjam_num_server_peers == 0) {
-		QMutexLocker locker(&hpsjam_client_peer->lock);
-
-		if (hpsjam_client_peer->address.valid() &&
-		    hpsjam_client_peer->address == src)
-			hpsjam_client_peer->input_pkt.receive(frame);
-	} else {
-		const struct hpsjam_packet *ptr;
-
-		for (unsigned x = hpsjam_num_server_peers; x--; ) {
-			class hpsjam_server_peer &peer = hpsjam_server_peers[x];
-
-			QMutexLocker locker(&peer.lock);
-
-			if (peer.valid && peer.address == src) {
-				peer.input_pkt.receive(frame);
-				return;
-			}
-		}
-
-		/*
-		 * All new connections must start on a ping request
-		 * having sequence number zero:
-		 */
-		for (ptr = frame.start; ptr->valid(frame.end); ptr = ptr->next()) {
-			if (ptr->type == HPSJAM_TYPE_PING_REQUEST &&
-			    ptr->sequence[0] == 0 && ptr->sequence[1] == 0)
-				break;
-		}
-
-		/* check if we have a valid chunk */
-		if (ptr->valid(frame.end) == false)
-			return;
-
-		uint16_t packets;
-		uint16_t time_ms;
-		uint64_t passwd;
-
-		/* check if ping message is valid */
-		if (ptr->getPing(packets, time_ms, passwd) == false)
-			return;
-
-		/* don't respond if password is invalid */
-		if (hpsjam_server_passwd != 0 && passwd != hpsjam_server_passwd) {
-			if (hpsjam_mixer_passwd == 0 || passwd != hpsjam_mixer_passwd)
-				return;
-		}
-
-		/* create new connection, if any */
-		for (unsigned x = hpsjam_num_server_peers; x--; ) {
-			class hpsjam_server_peer &peer = hpsjam_server_peers[x];
-			QMutexLocker peer_locker(&peer.lock);
-
-			if (peer.valid == true)
-				continue;
+	QMutexLocker locker(&hpsjam_client_peer->lock);
 
-			peer.allow_mixer_access =
-			    (hpsjam_mixer_passwd == 0 || hpsjam_mixer_passwd == passwd);
-			peer.valid = true;
-			peer.address = src;
-			peer.input_pkt.receive(frame);
-			peer.send_welcome_message();
-
-			/* drop lock */
-			peer_locker.unlock();
-
-			/* reset bits for this client */
-			for (unsigned y = hpsjam_num_server_peers; y--; ) {
-				class hpsjam_server_peer &other = hpsjam_server_peers[y];
-				QMutexLocker other_locker(&other.lock);
-				other.bits[x] = 0;
-			}
-			return;
-		}
-	}
+	if (hpsjam_client_peer->address.valid() &&
+	    hpsjam_client_peer->address == src)
+		hpsjam_client_peer->input_pkt.receive(frame, len);
+	else if (hpsjam_client_p2p)
+		hpsjam_client_peer->receiveDirect(src, frame);
 }
-
-static void
-hpsjam_server_broadcast(const struct hpsjam_packet_entry &entry,
-    class hpsjam_server_peer *except = 0, bool single = false)
+void
+hpsjam_client_peer :: sound_process(float *left, float *right, size_t samples)
 {
-	struct hpsjam_packet_entry *ptr;
+	const struct hpsjam_audio_frame *pf;
 
-	for (unsigned x = 0; x != hpsjam_num_server_peers; x++) {
-		if (hpsjam_server_peers + x == except)
-			continue;
-
-		class hpsjam_server_peer &peer = hpsjam_server_peers[x];
-		QMutexLocker locker(&peer.lock);
-
-		if (peer.valid == false)
-			continue;
-
-		/* check if a level packet is already pending */
-		if (single && peer.output_pkt.find(entry.packet.type))
-			continue;
-		/* duplicate packet */
-		ptr = new struct hpsjam_packet_entry;
-		*ptr = entry;
-		ptr->insert_tail(&peer.output_pkt.head);
+	/* check for reset request */
+	if (audio_reset.exchange(false)) {
+		in_ring.drain();
+		in_audio[0].clear();
+		in_audio[1].clear();
+		in_limiter.clear();
+		local_limiter.clear();
 	}
-}
 
-void
-hpsjam_client_peer :: sound_process(float *left, float *right, size_t samples)
-{
-	QMutexLocker locker(&lock);
+	/* check for audio effects */
+	audio_effects.update();
+
+	if (audio_valid.load() == false) {
+		/* let the timer run the network tick */
+		hpsjam_timer_audio_clock(this, 0);
 
-	if (address.valid() == false) {
 		if (audio_effects.isActive()) {
 			for (size_t x = 0; x != samples; x++) {
 				float temp = audio_effects.getSample();
@@ -174,8 +103,10 @@ hpsjam_client_peer :: sound_process(float *left, float *right, size_t samples)
 	memcpy(temp_l, left, sizeof(temp_l));
 	memcpy(temp_r, right, sizeof(temp_r));
 
+	const uint8_t b = bits.load(std::memory_order_relaxed);
+
 	/* Process bits */
-	if (bits & HPSJAM_BIT_MUTE) {
+	if (b & HPSJAM_BIT_MUTE) {
 		memset(left, 0, sizeof(left[0]) * samples);
 		memset(right, 0, sizeof(right[0]) * samples);
 	}
@@ -183,9 +114,11 @@ hpsjam_client_peer :: sound_process(float *left, float *right, size_t samples)
 	/* Process equalizer */
 	eq.doit(left, right, samples);
 
+	const float ip = in_pan.load(std::memory_order_relaxed);
+
 	/* Process panning */
-	if (in_pan < 0.0f) {
-		const float g[3] = { 1.0f + in_pan, 2.0f + in_pan, - in_pan };
+	if (ip < 0.0f) {
+		const float g[3] = { 1.0f + ip, 2.0f + ip, - ip };
 		for (size_t x = 0; x != samples; x++) {
 			float l = (left[x] * g[1] + right[x] * g[2]) / 2.0f;
 			float r = right[x] * g[0];
@@ -193,8 +126,8 @@ hpsjam_client_peer :: sound_process(float *left, float *right, size_t samples)
 			left[x] = l;
 			right[x] = r;
 		}
-	} else if (in_pan > 0.0f) {
-		const float g[3] = { 1.0f - in_pan, 2.0f - in_pan, in_pan };
+	} else if (ip > 0.0f) {
+		const float g[3] = { 1.0f - ip, 2.0f - ip, ip };
 		for (size_t x = 0; x != samples; x++) {
 			float l = left[x] * g[0];
 			float r = (right[x] * g[1] + left[x] * g[2]) / 2.0f;
@@ -204,28 +137,48 @@ hpsjam_client_peer :: sound_process(float *left, float *right, size_t samples)
 		}
 	}
 
+	const float ig = in_gain.load(std::memory_order_relaxed);
+
 	/* Process gain */
-	if (in_gain < 1.0f) {
+	if (ig < 1.0f) {
 		for (size_t x = 0; x != samples; x++) {
-			left[x] *= in_gain;
-			right[x] *= in_gain;
+			left[x] *= ig;
+			right[x] *= ig;
 		}
 	}
 
-	/* Process compressor */
-	for (size_t x = 0; x != samples; x++) {
-		hpsjam_stereo_compressor(HPSJAM_SAMPLE_RATE,
-		    in_peak, left[x], right[x]);
+	/* Process limiter */
+	in_limiter.doit(HPSJAM_SAMPLE_RATE, left, right, samples);
+
+	out_ring.addSamples(left, right, samples);
+
+	/* run the network tick, if audio clocked */
+	hpsjam_timer_audio_clock(this, samples);
+
+	/* get received audio from the network tick */
+	while ((pf = in_ring.getRead()) != 0) {
+		if (pf->silence) {
+			in_audio[0].addSilence(pf->num, pf->lost);
+			in_audio[1].addSilence(pf->num, pf->lost);
+		} else {
+			in_audio[0].addSamples(pf->samples[0], pf->num);
+			in_audio[1].addSamples(pf->samples[1], pf->num);
+		}
+		in_ring.commitRead();
 	}
 
-	out_audio[0].addSamples(left, samples);
-	out_audio[1].addSamples(right, samples);
+	const uint16_t jitter = in_jitter_limit.load(std::memory_order_relaxed);
+	in_audio[0].set_jitter_limit_in_ms(jitter);
+	in_audio[1].set_jitter_limit_in_ms(jitter);
 
 	in_audio[0].remSamples(left, samples);
 	in_audio[1].remSamples(right, samples);
 
+	for (size_t x = 0; x != HPSJAM_SEQ_MAX * 2; x++)
+		in_stats[x].store(in_audio[0].stats[x], std::memory_order_relaxed);
+
 	/* Process bits */
-	if (bits & HPSJAM_BIT_SOLO) {
+	if (b & HPSJAM_BIT_SOLO) {
 		memset(left, 0, sizeof(left[0]) * samples);
 		memset(right, 0, sizeof(right[0]) * samples);
 	}
@@ -235,15 +188,16 @@ hpsjam_client_peer :: sound_process(float *left, float *right, size_t samples)
 
 	/* Balance fader */
 	const float mg[2] = {
-		(bits & HPSJAM_BIT_INVERT) ? - mon_gain[0] : mon_gain[0],
-		mon_gain[1],
+		(b & HPSJAM_BIT_INVERT) ? - mon_gain[0].load() : mon_gain[0].load(),
+		mon_gain[1].load(),
 	};
+	const float mp = mon_pan.load(std::memory_order_relaxed);
 
 	/* Add monitor */
 	if (mg[0] != 0.0f) {
 		/* Process panning and balance */
-		if (mon_pan < 0.0f) {
-			const float g[3] = { 1.0f + mon_pan, 2.0f + mon_pan, - mon_pan };
+		if (mp < 0.0f) {
+			const float g[3] = { 1.0f + mp, 2.0f + mp, - mp };
 			for (size_t x = 0; x != samples; x++) {
 				float l = (temp_l[x] * g[1] + temp_r[x] * g[2]) / 2.0f;
 				float r = temp_r[x] * g[0];
@@ -251,8 +205,8 @@ hpsjam_client_peer :: sound_process(float *left, float *right, size_t samples)
 				left[x] = left[x] * mg[1] + l * mg[0];
 				right[x] = right[x] * mg[1] + r * mg[0];
 			}
-		} else if (mon_pan > 0.0f) {
-			const float g[3] = { 1.0f - mon_pan, 2.0f - mon_pan, mon_pan };
+		} else if (mp > 0.0f) {
+			const float g[3] = { 1.0f - mp, 2.0f - mp, mp };
 			for (size_t x = 0; x != samples; x++) {
 				float l = temp_l[x] * g[0];
 				float r = (temp_r[x] * g[1] + temp_l[x] * g[2]) / 2.0f;
@@ -278,255 +232,57 @@ hpsjam_client_peer :: sound_process(float *left, float *right, size_t samples)
 		}
 	}
 
-	/* Process final compressor */
-	for (size_t x = 0; x != samples; x++) {
-		hpsjam_stereo_compressor(HPSJAM_SAMPLE_RATE,
-		    local_peak, left[x], right[x]);
-	}
+	/* Process final limiter */
+	local_limiter.doit(HPSJAM_SAMPLE_RATE, left, right, samples);
 }
 
-size_t
-hpsjam_server_peer :: serverID()
-{
-	return (this - hpsjam_server_peers);
-}
-
-void
-hpsjam_server_peer :: handle_pending_watchdog()
-{
-	QMutexLocker locker(&lock);
-
-	if (address.valid() && output_pkt.empty()) {
-		struct hpsjam_packet_entry *pkt = new struct hpsjam_packet_entry;
-		pkt->packet.setPing(0, hpsjam_ticks, 0);
-		pkt->packet.type = HPSJAM_TYPE_PING_REQUEST;
-		pkt->insert_tail(&output_pkt.head);
-	}
-}
 
+/*
+ * The network tick. In audio clocked mode it runs on the audio
+ * thread, which must not allocate memory nor emit signals. Only audio
+ * is handled here. Received control packets are queued for
+ * tick_control().
+ */
 void
-hpsjam_server_peer :: handle_pending_timeout()
-{
-	struct hpsjam_packet_entry *pkt;
-
-	QMutexLocker locker(&lock);
-	init();
-	locker.unlock();
-
-	/* tell other clients about disconnect */
-	pkt = new struct hpsjam_packet_entry;
-	pkt->packet.setFaderData(0, serverID(), 0, 0);
-	pkt->packet.type = HPSJAM_TYPE_FADER_DISCONNECT_REPLY;
-	hpsjam_server_broadcast(*pkt, this);
-	delete pkt;
-}
-
-template <typename T>
-void HpsJamProcessOutputAudio(T &s, float *left, float *right)
+hpsjam_client_peer :: tick_locked()
 {
-	/* check if we should downsample to mono */
-	switch (s.output_fmt) {
-	case HPSJAM_TYPE_AUDIO_8_BIT_1CH:
-	case HPSJAM_TYPE_AUDIO_16_BIT_1CH:
-	case HPSJAM_TYPE_AUDIO_24_BIT_1CH:
-	case HPSJAM_TYPE_AUDIO_32_BIT_1CH:
-		for (unsigned int x = 0; x != HPSJAM_DEF_SAMPLES; x++)
-			left[x] = right[x] = (left[x] + right[x]) / 2.0f;
-		break;
-	default:
-		break;
-	}
+	const struct hpsjam_audio_frame *pf;
 
-	/* run compressor */
-	for (unsigned int x = 0; x != HPSJAM_DEF_SAMPLES; x++) {
-		hpsjam_stereo_compressor(HPSJAM_SAMPLE_RATE,
-		    s.out_peak, left[x], right[x]);
+	if (address.valid() == false) {
+		out_ring.drain();
+		return;
 	}
 
-	/* add samples to final output buffer */
-	s.out_buffer[0].addSamples(left, HPSJAM_DEF_SAMPLES);
-	s.out_buffer[1].addSamples(right, HPSJAM_DEF_SAMPLES);
-}
-
-template <typename T>
-void HpsJamSendPacket(T &s)
-{
-	struct hpsjam_packet_entry entry;
-	float temp[2][HPSJAM_NOM_SAMPLES];
+	/* let the audio thread start processing */
+	audio_valid = true;
 
-	/* check if we are sending XOR data */
-	if (s.output_pkt.isXorFrame())
-		goto done;
-
-	/* get back correct amount of samples */
-	s.out_buffer[0].remSamples(temp[0], HPSJAM_NOM_SAMPLES);
-	s.out_buffer[1].remSamples(temp[1], HPSJAM_NOM_SAMPLES);
-
-	/* select output format */
-	switch (s.output_fmt) {
-	case HPSJAM_TYPE_AUDIO_8_BIT_1CH:
-		entry.packet.put8Bit1ChSample(temp[0], HPSJAM_NOM_SAMPLES);
-		s.output_pkt.append_pkt(entry);
-		break;
-	case HPSJAM_TYPE_AUDIO_16_BIT_1CH:
-		entry.packet.put16Bit1ChSample(temp[0], HPSJAM_NOM_SAMPLES);
-		s.output_pkt.append_pkt(entry);
-		break;
-	case HPSJAM_TYPE_AUDIO_24_BIT_1CH:
-		entry.packet.put24Bit1ChSample(temp[0], HPSJAM_NOM_SAMPLES);
-		s.output_pkt.append_pkt(entry);
-		break;
-	case HPSJAM_TYPE_AUDIO_32_BIT_1CH:
-		entry.packet.put32Bit1ChSample(temp[0], HPSJAM_NOM_SAMPLES);
-		s.output_pkt.append_pkt(entry);
-		break;
-	case HPSJAM_TYPE_AUDIO_8_BIT_2CH:
-		entry.packet.put8Bit2ChSample(temp[0], temp[1], HPSJAM_NOM_SAMPLES);
-		s.output_pkt.append_pkt(entry);
-		break;
-	case HPSJAM_TYPE_AUDIO_16_BIT_2CH:
-		entry.packet.put16Bit2ChSample(temp[0], temp[1], HPSJAM_NOM_SAMPLES);
-		s.output_pkt.append_pkt(entry);
-		break;
-	case HPSJAM_TYPE_AUDIO_24_BIT_2CH:
-		entry.packet.put24Bit2ChSample(temp[0], temp[1], HPSJAM_NOM_SAMPLES);
-		s.output_pkt.append_pkt(entry);
-		break;
-	case HPSJAM_TYPE_AUDIO_32_BIT_2CH:
-		entry.packet.put32Bit2ChSample(temp[0], temp[1], HPSJAM_NOM_SAMPLES);
-		s.output_pkt.append_pkt(entry);
-		break;
-	default:
-		entry.packet.putSilence(HPSJAM_NOM_SAMPLES);
-		s.output_pkt.append_pkt(entry);
-		break;
+	/* get recorded audio from the audio thread */
+	while ((pf = out_ring.getRead()) != 0) {
+		out_audio[0].addSamples(pf->samples[0], pf->num);
+		out_audio[1].addSamples(pf->samples[1], pf->num);
+		out_ring.commitRead();
 	}
-done:
-	/* send a packet */
-	s.output_pkt.send(s.address);
-}
-
-template <typename T>
-bool HpsJamReceiveUnSequenced(T &s, const struct hpsjam_packet *ptr, float *temp)
-{
-	size_t num;
 
-	switch (ptr->type) {
-	case HPSJAM_TYPE_AUDIO_8_BIT_1CH:
-		num = ptr->get8Bit1ChSample(temp);
-		assert(num <= HPSJAM_MAX_PKT);
-		s.in_audio[0].addSamples(temp, num);
-		s.in_audio[1].addSamples(temp, num);
-		s.in_level[0].addSamples(temp, num);
-		s.in_level[1].addSamples(temp, num);
-		return (true);
-	case HPSJAM_TYPE_AUDIO_16_BIT_1CH:
-		num = ptr->get16Bit1ChSample(temp);
-		assert(num <= HPSJAM_MAX_PKT);
-		s.in_audio[0].addSamples(temp, num);
-		s.in_audio[1].addSamples(temp, num);
-		s.in_level[0].addSamples(temp, num);
-		s.in_level[1].addSamples(temp, num);
-		return (true);
-	case HPSJAM_TYPE_AUDIO_24_BIT_1CH:
-		num = ptr->get24Bit1ChSample(temp);
-		assert(num <= HPSJAM_MAX_PKT);
-		s.in_audio[0].addSamples(temp, num);
-		s.in_audio[1].addSamples(temp, num);
-		s.in_level[0].addSamples(temp, num);
-		s.in_level[1].addSamples(temp, num);
-		return (true);
-	case HPSJAM_TYPE_AUDIO_32_BIT_1CH:
-		num = ptr->get32Bit1ChSample(temp);
-		assert(num <= HPSJAM_MAX_PKT);
-		s.in_audio[0].addSamples(temp, num);
-		s.in_audio[1].addSamples(temp, num);
-		s.in_level[0].addSamples(temp, num);
-		s.in_level[1].addSamples(temp, num);
-		return (true);
-	case HPSJAM_TYPE_AUDIO_8_BIT_2CH:
-		num = ptr->get8Bit2ChSample(temp, temp + (HPSJAM_MAX_PKT / 2));
-		assert(num <= (HPSJAM_MAX_PKT / 2));
-		s.in_audio[0].addSamples(temp, num);
-		s.in_audio[1].addSamples(temp + (HPSJAM_MAX_PKT / 2), num);
-		s.in_level[0].addSamples(temp, num);
-		s.in_level[1].addSamples(temp + (HPSJAM_MAX_PKT / 2), num);
-		return (true);
-	case HPSJAM_TYPE_AUDIO_16_BIT_2CH:
-		num = ptr->get16Bit2ChSample(temp, temp + (HPSJAM_MAX_PKT / 2));
-		assert(num <= (HPSJAM_MAX_PKT / 2));
-		s.in_audio[0].addSamples(temp, num);
-		s.in_audio[1].addSamples(temp + (HPSJAM_MAX_PKT / 2), num);
-		s.in_level[0].addSamples(temp, num);
-		s.in_level[1].addSamples(temp + (HPSJAM_MAX_PKT / 2), num);
-		return (true);
-	case HPSJAM_TYPE_AUDIO_24_BIT_2CH:
-		num = ptr->get24Bit2ChSample(temp, temp + (HPSJAM_MAX_PKT / 2));
-		assert(num <= (HPSJAM_MAX_PKT / 2));
-		s.in_audio[0].addSamples(temp, num);
-		s.in_audio[1].addSamples(temp + (HPSJAM_MAX_PKT / 2), num);
-		s.in_level[0].addSamples(temp, num);
-		s.in_level[1].addSamples(temp + (HPSJAM_MAX_PKT / 2), num);
-		return (true);
-	case HPSJAM_TYPE_AUDIO_32_BIT_2CH:
-		num = ptr->get32Bit2ChSample(temp, temp + (HPSJAM_MAX_PKT / 2));
-		assert(num <= (HPSJAM_MAX_PKT / 2));
-		s.in_audio[0].addSamples(temp, num);
-		s.in_audio[1].addSamples(temp + (HPSJAM_MAX_PKT / 2), num);
-		s.in_level[0].addSamples(temp, num);
-		s.in_level[1].addSamples(temp + (HPSJAM_MAX_PKT / 2), num);
-		return (true);
-	case HPSJAM_TYPE_AUDIO_32_BIT_2CH + 1 ... HPSJAM_TYPE_AUDIO_MAX:
-		/* for the future */
-		s.in_audio[0].addSilence(HPSJAM_NOM_SAMPLES);
-		s.in_audio[1].addSilence(HPSJAM_NOM_SAMPLES);
-		return (true);
-	case HPSJAM_TYPE_AUDIO_SILENCE:
-		num = ptr->getSilence();
-		s.in_audio[0].addSilence(num);
-		s.in_audio[1].addSilence(num);
-		return (true);
-	case HPSJAM_TYPE_ACK:
-		/* check if other side received packet */
-		if (ptr->getPeerSeqNo() == s.output_pkt.pend_seqno)
-			s.output_pkt.advance();
-		return (true);
-	default:
-		return (false);
-	}
-}
-
-static unsigned hpsjam_server_adjust[3];
-
-void
-hpsjam_server_peer :: audio_export()
-{
 	const union hpsjam_frame *pkt;
 	const struct hpsjam_packet *ptr;
 	struct hpsjam_packet_entry *pres;
-	float temp[HPSJAM_MAX_PKT];
+	union {
+		float temp[HPSJAM_MAX_PKT];
+		float audio[2][HPSJAM_DEF_SAMPLES];
+	};
 	uint16_t jitter;
-	size_t num;
-
-	QMutexLocker locker(&lock);
-
-	if (valid == false) {
-		memset(tmp_audio, 0, sizeof(tmp_audio));
-		return;
-	}
 
 	input_pkt.recovery();
 
-	/* update jitter */
-	jitter = input_pkt.jitter.get_jitter_in_ms();
-	in_audio[0].set_jitter_limit_in_ms(jitter);
-	in_audio[1].set_jitter_limit_in_ms(jitter);
+	/* update jitter, which applies to the received audio */
+	jitter = input_pkt.get_jitter_limit_in_ms();
+	in_jitter_limit = jitter;
 
 	while ((pkt = input_pkt.first_pkt())) {
 		for (ptr = pkt->start; ptr->valid(pkt->end); ptr = ptr->next()) {
 			/* check for unsequenced packets */
 			if (HpsJamReceiveUnSequenced
-			    <class hpsjam_server_peer>(*this, ptr, temp))
+			    <class hpsjam_client_peer>(*this, ptr, temp))
 				continue;
 			/* check if other side received packet */
 			if (ptr->getPeerSeqNo() == output_pkt.pend_seqno)
@@ -534,673 +290,504 @@ hpsjam_server_peer :: audio_export()
 			/* check if sequence number matches */
 			if (ptr->getLocalSeqNo() != output_pkt.peer_seqno)
 				continue;
+			/* don't acknowledge the packet, if it cannot be queued */
+			pres = TAILQ_FIRST(&ctrl_free);
+			if (pres == 0)
+				continue;
 			/* advance expected sequence number */
 			output_pkt.peer_seqno++;
 			output_pkt.send_ack = true;
 
-			switch (ptr->type) {
-			uint16_t packets;
-			uint16_t time_ms;
-			uint64_t passwd;
-			uint8_t mix;
-			uint8_t index;
-			const char *data;
-			size_t len;
-
-			case HPSJAM_TYPE_CONFIGURE_REQUEST:
-				if (ptr->getConfigure(output_fmt))
-					break;
-				output_fmt = HPSJAM_TYPE_AUDIO_SILENCE;
-				break;
-			case HPSJAM_TYPE_PING_REQUEST:
-				if (ptr->getPing(packets, time_ms, passwd) &&
-				    output_pkt.find(HPSJAM_TYPE_PING_REPLY) == 0) {
-					pres = new struct hpsjam_packet_entry;
-					pres->packet.setPing(0, time_ms, 0);
-					pres->packet.type = HPSJAM_TYPE_PING_REPLY;
-					pres->insert_tail(&output_pkt.head);
-				}
-				break;
-			case HPSJAM_TYPE_ICON_REQUEST:
-				if (ptr->getRawData(&data, len)) {
-					/* prepend username */
-					icon = QByteArray(data, len);
-
-					pres = new struct hpsjam_packet_entry;
-					pres->packet.setFaderData(0, serverID(), icon.constData(), icon.length());
-					pres->packet.type = HPSJAM_TYPE_FADER_ICON_REPLY;
-					pres->insert_tail(&output_pkt.head);
-					hpsjam_server_broadcast(*pres, this);
-
-					/* tell this client about other icons */
-					for (unsigned x = 0; x != hpsjam_num_server_peers; x++) {
-						if (hpsjam_server_peers + x == this)
-							continue;
-						class hpsjam_server_peer &peer = hpsjam_server_peers[x];
-						QMutexLocker locker(&peer.lock);
-						if (peer.valid == false)
-							continue;
-						QByteArray &t = peer.icon;
-						pres = new struct hpsjam_packet_entry;
-						pres->packet.setFaderData(0, x, t.constData(), t.length());
-						pres->packet.type = HPSJAM_TYPE_FADER_ICON_REPLY;
-						pres->insert_tail(&output_pkt.head);
-					}
-				}
-				break;
-			case HPSJAM_TYPE_NAME_REQUEST:
-				if (ptr->getRawData(&data, len)) {
-					/* prepend username */
-					QByteArray t(data, len);
-					name = QString::fromUtf8(t);
-
-					pres = new struct hpsjam_packet_entry;
-					pres->packet.setFaderData(0, serverID(), t.constData(), t.length());
-					pres->packet.type = HPSJAM_TYPE_FADER_NAME_REPLY;
-					pres->insert_tail(&output_pkt.head);
-					hpsjam_server_broadcast(*pres, this);
-
-					/* tell this client about other names */
-					for (unsigned x = 0; x != hpsjam_num_server_peers; x++) {
-						if (hpsjam_server_peers + x == this)
-							continue;
-						class hpsjam_server_peer &peer = hpsjam_server_peers[x];
-						QMutexLocker locker(&peer.lock);
-						if (peer.valid == false)
-							continue;
-						t = peer.name.toUtf8();
-						pres = new struct hpsjam_packet_entry;
-						pres->packet.setFaderData(0, x, t.constData(), t.length());
-						pres->packet.type = HPSJAM_TYPE_FADER_NAME_REPLY;
-						pres->insert_tail(&output_pkt.head);
-					}
-				}
-				break;
-			case HPSJAM_TYPE_LYRICS_REQUEST:
-				pres = new struct hpsjam_packet_entry;
-				if (ptr->getRawData(&data, len)) {
-					QByteArray t(data, len);
-
-					/* echo back lyrics */
-					pres = new struct hpsjam_packet_entry;
-					pres->packet.setRawData(t.constData(), t.length());
-					pres->packet.type = HPSJAM_TYPE_LYRICS_REPLY;
-					pres->insert_tail(&output_pkt.head);
-					hpsjam_server_broadcast(*pres, this);
-				}
-				break;
-			case HPSJAM_TYPE_CHAT_REQUEST:
-				if (ptr->getRawData(&data, len)) {
-					/* prepend username */
-					QByteArray t(data, len);
-					QString str = QString::fromUtf8(t);
-					str.prepend(QString("[") + name + QString("]: "));
-					str.truncate(128 + 32 + 4);
-					t = str.toUtf8();
-
-					/* echo back text */
-					pres = new struct hpsjam_packet_entry;
-					pres->packet.setRawData(t.constData(), t.length());
-					pres->packet.type = HPSJAM_TYPE_CHAT_REPLY;
-					pres->insert_tail(&output_pkt.head);
-					hpsjam_server_broadcast(*pres, this);
-				}
-				break;
-			case HPSJAM_TYPE_FADER_GAIN_REQUEST:
-				if (allow_mixer_access == false)
-					break;
-				if (ptr->getFaderValue(mix, index, temp, num)) {
-					assert(num <= HPSJAM_MAX_PKT);
-					if (mix != 0 || num <= 0)
-						break;
-					if (index + num > hpsjam_num_server_peers)
-						break;
-
-					/* echo gain */
-					pres = new struct hpsjam_packet_entry;
-					pres->packet.setFaderValue(mix, index, temp, num);
-					pres->packet.type = HPSJAM_TYPE_FADER_GAIN_REPLY;
-					hpsjam_server_broadcast(*pres, this);
-					delete pres;
-
-					/* local gain */
-					for (size_t x = 0; x != num; x++) {
-						pres = new struct hpsjam_packet_entry;
-						pres->packet.setFaderValue(0, 0, temp + x, 1);
-						pres->packet.type = HPSJAM_TYPE_LOCAL_GAIN_REPLY;
-
-						if (index + x == serverID()) {
-							pres->insert_tail(&output_pkt.head);
-						} else {
-							QMutexLocker other(&hpsjam_server_peers[index + x].lock);
-							pres->insert_tail(&hpsjam_server_peers[index + x].output_pkt.head);
-						}
-					}
-				}
-				break;
-			case HPSJAM_TYPE_FADER_PAN_REQUEST:
-				if (allow_mixer_access == false)
-					break;
-				if (ptr->getFaderValue(mix, index, temp, num)) {
-					assert(num <= HPSJAM_MAX_PKT);
-					if (mix != 0 || num <= 0)
-						break;
-					if (index + num > hpsjam_num_server_peers)
-						break;
-
-					/* echo pan */
-					pres = new struct hpsjam_packet_entry;
-					pres->packet.setFaderValue(mix, index, temp, num);
-					pres->packet.type = HPSJAM_TYPE_FADER_PAN_REPLY;
-					hpsjam_server_broadcast(*pres, this);
-					delete pres;
-
-					/* local pan */
-					for (size_t x = 0; x != num; x++) {
-						pres = new struct hpsjam_packet_entry;
-						pres->packet.setFaderValue(0, 0, temp + x, 1);
-						pres->packet.type = HPSJAM_TYPE_LOCAL_PAN_REPLY;
-
-						if (index + x == serverID()) {
-							pres->insert_tail(&output_pkt.head);
-						} else {
-							QMutexLocker other(&hpsjam_server_peers[index + x].lock);
-							pres->insert_tail(&hpsjam_server_peers[index + x].output_pkt.head);
-						}
-					}
-				}
-				break;
-			case HPSJAM_TYPE_FADER_EQ_REQUEST:
-				if (allow_mixer_access == false)
-					break;
-				if (ptr->getFaderData(mix, index, &data, num)) {
-					if (mix != 0 || num <= 0)
-						break;
-					if (index >= hpsjam_num_server_peers)
-						break;
-
-					/* echo EQ */
-					pres = new struct hpsjam_packet_entry;
-					pres->packet.setFaderData(mix, index, data, num);
-					pres->packet.type = HPSJAM_TYPE_FADER_EQ_REPLY;
-					hpsjam_server_broadcast(*pres, this);
-
-					pres->packet.setFaderData(0, 0, data, num);
-					pres->packet.type = HPSJAM_TYPE_LOCAL_EQ_REPLY;
-
-					/* local EQ */
-					if (index == serverID()) {
-						pres->insert_tail(&output_pkt.head);
-					} else {
-						QMutexLocker other(&hpsjam_server_peers[index].lock);
-						pres->insert_tail(&hpsjam_server_peers[index].output_pkt.head);
-					}
-				}
-				break;
-
-			case HPSJAM_TYPE_FADER_BITS_REQUEST:
-				if (ptr->getFaderData(mix, index, &data, num)) {
-					if (mix != 0 || num <= 0)
-						break;
-					if (index + num > hpsjam_num_server_peers)
-						break;
-					/* copy bits in place */
-					memcpy(bits + index, data, num);
-				}
-				break;
-			default:
-				break;
-			}
+			/* pass a copy on to the timer thread */
+			pres->remove(&ctrl_free);
+			memcpy(pres->raw, ptr, ptr->getBytes());
+			pres->insert_tail(&ctrl_recv);
 		}
 	}
 
-	/* send a ping, if idle */
-	if (output_pkt.empty()) {
-		pres = new struct hpsjam_packet_entry;
-		pres->packet.setPing(0, hpsjam_ticks, 0);
-		pres->packet.type = HPSJAM_TYPE_PING_REQUEST;
-		pres->insert_tail(&output_pkt.head);
-	}
+	/* compute the personal mix of forwarded audio, if any */
+	if (sfu_active)
+		mixForward(jitter);
 
 	/* extract samples for this tick */
-	in_audio[0].remSamples(tmp_audio[0], HPSJAM_DEF_SAMPLES);
-	in_audio[1].remSamples(tmp_audio[1], HPSJAM_DEF_SAMPLES);
+	out_audio[0].remSamples(audio[0], HPSJAM_DEF_SAMPLES);
+	out_audio[1].remSamples(audio[1], HPSJAM_DEF_SAMPLES);
 
 	/* check if we should adjust the timer */
-	hpsjam_server_adjust[in_audio[0].getLowWater()]++;
-
-	/* clear output audio */
-	memset(out_audio, 0, sizeof(out_audio));
-}
-
-void
-hpsjam_server_peer :: audio_import()
-{
-	QMutexLocker locker(&lock);
-
-	if (valid == false)
-		return;
+	switch (out_audio[0].getLowWater()) {
+	case 0:
+		hpsjam_timer_adjust = 1;	/* go slower */
+		break;
+	case 1:
+		hpsjam_timer_adjust = 0;	/* go normal */
+		break;
+	default:
+		hpsjam_timer_adjust = -1;	/* go faster */
+		break;
+	}
 
-	/* process output audio */
+	/* process output output */
 	HpsJamProcessOutputAudio
-	    <class hpsjam_server_peer>(*this, out_audio[0], out_audio[1]);
+	    <class hpsjam_client_peer>(*this, audio[0], audio[1]);
 
 	/* send a packet */
 	HpsJamSendPacket
-	    <class hpsjam_server_peer>(*this);
+	    <class hpsjam_client_peer>(*this);
 }
 
+/*
+ * Handle the received control packets and maintain the connection.
+ * This always runs on the timer thread, after the network tick.
+ */
 void
-hpsjam_server_peer :: send_welcome_message()
+hpsjam_client_peer :: tick_control()
 {
-	if (hpsjam_welcome_message_file == 0)
-		return;
+	struct hpsjam_packet_entry *entry;
+	struct hpsjam_packet_entry *pres;
+	float temp[HPSJAM_MAX_PKT];
+	size_t num;
 
-	QFile file(hpsjam_welcome_message_file);
+	/* free acknowledged packets */
+	while ((entry = TAILQ_FIRST(&ctrl_done))) {
+		entry->remove(&ctrl_done);
+		delete entry;
+	}
 
-	if(!file.open(QIODevice::ReadOnly | QIODevice::Text))
-		return;
+	while ((entry = TAILQ_FIRST(&ctrl_recv))) {
+		const struct hpsjam_packet *ptr = &entry->packet;
 
-	QTextStream in(&file);
+		switch (ptr->type) {
+		uint16_t packets;
+		uint16_t time_ms;
+		uint64_t passwd;
+		const char *data;
+		uint8_t mix;
+		uint8_t index;
 
-	while (in.atEnd() == false) {
-		QString line = in.readLine();
-		line.truncate(128);
+		case HPSJAM_TYPE_PING_REQUEST:
+			if (ptr->getPing(packets, time_ms, passwd) &&
+			    output_pkt.find(HPSJAM_TYPE_PING_REPLY) == 0) {
+				pres = new struct hpsjam_packet_entry;
+				pres->packet.setPing(0, time_ms, 0);
+				pres->packet.type = HPSJAM_TYPE_PING_REPLY;
+				pres->insert_tail(&output_pkt.head);
+			}
+			break;
+		case HPSJAM_TYPE_LYRICS_REPLY:
+			if (ptr->getRawData(&data, num)) {
+				QByteArray t(data, num);
+				emit receivedLyrics(new QString(QString::fromUtf8(t)));
+			}
+			break;
+		case HPSJAM_TYPE_CHAT_REPLY:
+			if (ptr->getRawData(&data, num)) {
+				QByteArray t(data, num);
+				emit receivedChat(new QString(QString::fromUtf8(t)));
+			}
+			break;
+		case HPSJAM_TYPE_FADER_ICON_REPLY:
+			if (ptr->getFaderData(mix, index, &data, num)) {
+				if (mix != 0)
+					break;
+				if (self_index == -1) {
+					self_index = index;
+					emit receivedFaderSelf(mix, index);
+				}
+				emit receivedFaderIcon(mix, index, new QByteArray(data, num));
+			}
+			break;
+		case HPSJAM_TYPE_FADER_NAME_REPLY:
+			if (ptr->getFaderData(mix, index, &data, num)) {
+				if (mix != 0)
+					break;
+				if (self_index == -1) {
+					self_index = index;
+					emit receivedFaderSelf(mix, index);
+				}
+				QByteArray t(data, num);
+				emit receivedFaderName(mix, index, new QString(QString::fromUtf8(t)));
+			}
+			break;
+		case HPSJAM_TYPE_FADER_GAIN_REPLY:
+			if (ptr->getFaderValue(mix, index, temp, num)) {
+				assert(num <= HPSJAM_MAX_PKT);
+				if (mix != 0 || num <= 0)
+					break;
+				if (index + num > HPSJAM_PEERS_MAX)
+					break;
+				for (size_t x = 0; x != num; x++)
+					emit receivedFaderGain(mix, index + x, temp[x]);
+			}
+			break;
+		case HPSJAM_TYPE_FADER_PAN_REPLY:
+			if (ptr->getFaderValue(mix, index, temp, num)) {
+				assert(num <= HPSJAM_MAX_PKT);
+				if (mix != 0 || num <= 0)
+					break;
+				if (index + num > HPSJAM_PEERS_MAX)
+					break;
+				for (size_t x = 0; x != num; x++)
+					emit receivedFaderPan(mix, index + x, temp[x]);
+			}
+			break;
+		case HPSJAM_TYPE_FADER_LEVEL_REPLY:
+			if (ptr->getFaderValue(mix, index, temp, num)) {
+				assert(num <= HPSJAM_MAX_PKT);
+				if (mix != 0 || (num % 2) != 0 || num <= 0)
+					break;
+				if (index + (num / 2) > HPSJAM_PEERS_MAX)
+					break;
+				for (size_t x = 0; x != (num / 2); x++)
+					emit receivedFaderLevel(mix, index + x, temp[2 * x], temp[2 * x + 1]);
+			}
+			break;
+		case HPSJAM_TYPE_LOCAL_GAIN_REPLY:
+			if (ptr->getFaderValue(mix, index, temp, num)) {
+				assert(num <= HPSJAM_MAX_PKT);
+				if (mix != 0 || index != 0 || num != 1)
+					break;
+				in_gain = temp[0];
+			}
+			break;
+		case HPSJAM_TYPE_LOCAL_PAN_REPLY:
+			if (ptr->getFaderValue(mix, index, temp, num)) {
+				assert(num <= HPSJAM_MAX_PKT);
+				if (mix != 0 || index != 0 || num != 1)
+					break;
+				in_pan = temp[0];
+			}
+			break;
+		case HPSJAM_TYPE_FADER_EQ_REPLY:
+			if (ptr->getFaderData(mix, index, &data, num)) {
+				if (mix != 0)
+					break;
+				QByteArray t(data, num);
+				emit receivedFaderEQ(mix, index, new QString(QString::fromLatin1(t)));
+			}
+			break;
+		case HPSJAM_TYPE_LOCAL_EQ_REPLY:
+			if (ptr->getFaderData(mix, index, &data, num)) {
+				if (mix != 0 || index != 0)
+					break;
+				char *ptr = new char [num + 1];
+				memcpy(ptr, data, num);
+				ptr[num] = 0;
+				eq.init(ptr);
+				delete [] ptr;
+			}
+			break;
+		case HPSJAM_TYPE_FADER_DISCONNECT_REPLY:
+			if (ptr->getFaderData(mix, index, &data, num)) {
+				if (mix != 0)
+					break;
+				direct[index].clear();
+				emit receivedFaderDisconnect(mix, index);
+			}
+			break;
+		case HPSJAM_TYPE_PEER_ADDRESS_REPLY:
+			if (hpsjam_client_p2p == false)
+				break;
+			if (ptr->getFaderData(mix, index, &data, num)) {
+				struct hpsjam_client_direct &link = direct[index];
 
-		QByteArray t = line.toUtf8();
+				if (mix != 0)
+					break;
+				link.clear();
+				if (link.address.fromBytes((const uint8_t *)data, num) == false)
+					break;
+				if (link.address.v4.sin_family == AF_INET)
+					link.address.fd = hpsjam_v4.fd;
+				else
+					link.address.fd = hpsjam_v6.fd;
+				link.valid = link.address.valid();
+			}
+			break;
+		case HPSJAM_TYPE_PEER_RTT_REPLY:
+			if (hpsjam_client_p2p == false)
+				break;
+			if (ptr->getFaderData(mix, index, &data, num)) {
+				if (mix != 0)
+					break;
+				for (size_t x = 0; x != num && index + x < HPSJAM_PEERS_MAX; x++)
+					direct[index + x].server_rtt = data[x];
+			}
+			break;
+		default:
+			break;
+		}
 
-		struct hpsjam_packet_entry *pres = new struct hpsjam_packet_entry;
-		pres->packet.setRawData(t.constData(), t.length());
-		pres->packet.type = HPSJAM_TYPE_CHAT_REPLY;
-		pres->insert_tail(&output_pkt.head);
+		entry->remove(&ctrl_recv);
+		entry->insert_tail(&ctrl_free);
 	}
-}
 
-static void
-hpsjam_send_levels()
-{
-	constexpr size_t maxLevel = 32;
-	static unsigned group;
-	struct hpsjam_packet_entry entry;
-	float temp[maxLevel][2];
-
-	if (hpsjam_ticks % 128)
+	if (address.valid() == false)
 		return;
 
-	for (unsigned x = 0; x != maxLevel; x++) {
-		unsigned index = x + group * maxLevel;
+	/* send a ping, if idle */
+	if (output_pkt.empty()) {
+		pres = new struct hpsjam_packet_entry;
+		pres->packet.setPing(0, hpsjam_ticks, 0);
+		pres->packet.type = HPSJAM_TYPE_PING_REQUEST;
+		pres->insert_tail(&output_pkt.head);
+	}
 
-		if (index >= hpsjam_num_server_peers) {
-			temp[x][0] = 0.0f;
-			temp[x][1] = 0.0f;
-			continue;
-		}
+	/* check if the server is responding */
+	const uint8_t events = output_pkt.getEvents();
 
-		QMutexLocker locker(&hpsjam_server_peers[index].lock);
-		if (hpsjam_server_peers[index].valid) {
-			temp[x][0] = hpsjam_server_peers[index].in_level[0].getLevel();
-			temp[x][1] = hpsjam_server_peers[index].in_level[1].getLevel();
-		} else {
-			temp[x][0] = 0.0f;
-			temp[x][1] = 0.0f;
-		}
+	if ((events & HPSJAM_OUTPUT_WATCHDOG) && output_pkt.empty()) {
+		pres = new struct hpsjam_packet_entry;
+		pres->packet.setPing(0, hpsjam_ticks, 0);
+		pres->packet.type = HPSJAM_TYPE_PING_REQUEST;
+		pres->insert_tail(&output_pkt.head);
 	}
-	entry.packet.setFaderValue(0, group * maxLevel, temp[0], 2 * maxLevel);
-	entry.packet.type = HPSJAM_TYPE_FADER_LEVEL_REPLY;
-	hpsjam_server_broadcast(entry, 0, true);
-
-	/* advance to next group */
-	group++;
-	if ((group * maxLevel) >= hpsjam_num_server_peers)
-		group = 0;
-}
+	if (events & HPSJAM_OUTPUT_TIMEOUT)
+		emit pendingTimeout();
 
-static inline float
-float_gain(float value, uint32_t gain)
-{
-	return (value * gain) * (1.0f / 256.0f);
+	/* maintain direct audio paths, if any */
+	if (hpsjam_client_p2p)
+		tickDirect();
 }
 
-static uint32_t
-get_gain_from_bits(uint8_t value)
+void
+hpsjam_client_peer :: receiveSource(uint8_t index, const struct hpsjam_packet *ptr, float *temp)
 {
-	int32_t temp = HPSJAM_BIT_GAIN_GET(value);
+	struct hpsjam_client_source *src = sfu_source[index];
+	float *right;
+	size_t num;
 
-	/* sign extend to fit float exponent */
-	temp <<= (32 - 5);
-	temp >>= (32 - 5);
+	src->valid = true;
+	src->ticks = hpsjam_ticks;
+	sfu_active = true;
 
-	return (powf(256.0f, (temp + 16) / 16.0f));
+	if (ptr->type == HPSJAM_TYPE_AUDIO_SFU) {
+		num = ptr->getSilence();
+		src->in_audio[0].addSilence(num, false);
+		src->in_audio[1].addSilence(num, false);
+	} else {
+		num = hpsjam_decode_audio(ptr,
+		    ptr->type - HPSJAM_TYPE_AUDIO_SFU, temp, right);
+		assert(num <= ((right == temp) ? HPSJAM_MAX_PKT : (HPSJAM_MAX_PKT / 2)));
+		src->in_audio[0].addSamples(temp, num);
+		src->in_audio[1].addSamples(right, num);
+	}
 }
 
+/*
+ * Compute the personal mix of the forwarded audio, using the same
+ * mixer bits as the server would, and pass it on to the audio thread.
+ */
 void
-hpsjam_server_peer :: audio_mixing()
+hpsjam_client_peer :: mixForward(uint16_t jitter)
 {
-	QMutexLocker locker(&lock);
+	float mix[2][HPSJAM_DEF_SAMPLES];
+	float temp[2][HPSJAM_DEF_SAMPLES];
+	bool solo = false;
+	bool any = false;
 
-	if (valid == false)
-		return;
+	/* start with the audio mixed by the server, if any */
+	mix_source.in_audio[0].set_jitter_limit_in_ms(jitter);
+	mix_source.in_audio[1].set_jitter_limit_in_ms(jitter);
+	mix_source.drift.update(mix_source.in_audio[0].total,
+	    mix_source.in_audio[0].limit * HPSJAM_DEF_SAMPLES);
+	mix_source.in_audio[0].remSamplesDrift(mix[0], HPSJAM_DEF_SAMPLES, mix_source.drift);
+	mix_source.in_audio[1].remSamplesDrift(mix[1], HPSJAM_DEF_SAMPLES, mix_source.drift);
+	mix_source.drift.advance(HPSJAM_DEF_SAMPLES);
 
-	for (unsigned y = 0; y != hpsjam_num_server_peers; y++) {
-		if (bits[y] & HPSJAM_BIT_SOLO)
-			goto do_solo;
+	for (unsigned x = 0; x != HPSJAM_PEERS_MAX; x++) {
+		if (sfu_source[x]->valid && (mix_bits[x] & HPSJAM_BIT_SOLO))
+			solo = true;
 	}
 
-	for (unsigned y = 0; y != hpsjam_num_server_peers; y++) {
-		const class hpsjam_server_peer &other = hpsjam_server_peers[y];
-		const uint32_t gain = get_gain_from_bits(bits[y]);
+	for (unsigned x = 0; x != HPSJAM_PEERS_MAX; x++) {
+		struct hpsjam_client_source *src = sfu_source[x];
 
-		if (other.valid == false)
+		if (src->valid == false)
 			continue;
-		if (bits[y] & HPSJAM_BIT_MUTE)
+
+		/* forget sources which stopped sending */
+		if ((uint16_t)(hpsjam_ticks - src->ticks) >= 1000) {
+			src->clear();
 			continue;
-		if (bits[y] & HPSJAM_BIT_INVERT) {
-			for (unsigned z = 0; z != HPSJAM_DEF_SAMPLES; z++) {
-				out_audio[0][z] -= float_gain(other.tmp_audio[0][z], gain);
-				out_audio[1][z] -= float_gain(other.tmp_audio[1][z], gain);
-			}
-		} else {
-			for (unsigned z = 0; z != HPSJAM_DEF_SAMPLES; z++) {
-				out_audio[0][z] += float_gain(other.tmp_audio[0][z], gain);
-				out_audio[1][z] += float_gain(other.tmp_audio[1][z], gain);
-			}
 		}
-	}
-	return;
+		any = true;
+
+		src->in_audio[0].set_jitter_limit_in_ms(jitter);
+		src->in_audio[1].set_jitter_limit_in_ms(jitter);
 
-do_solo:
-	for (unsigned y = 0; y != hpsjam_num_server_peers; y++) {
-		const class hpsjam_server_peer &other = hpsjam_server_peers[y];
-		const uint32_t gain = get_gain_from_bits(bits[y]);
+		/* track the clock of this source, targeting the jitter limit */
+		src->drift.update(src->in_audio[0].total,
+		    src->in_audio[0].limit * HPSJAM_DEF_SAMPLES);
+		src->in_audio[0].remSamplesDrift(temp[0], HPSJAM_DEF_SAMPLES, src->drift);
+		src->in_audio[1].remSamplesDrift(temp[1], HPSJAM_DEF_SAMPLES, src->drift);
+		src->drift.advance(HPSJAM_DEF_SAMPLES);
 
-		if (other.valid == false)
+		if (mix_bits[x] & HPSJAM_BIT_MUTE)
 			continue;
-		if (~bits[y] & HPSJAM_BIT_SOLO)
+		if (solo && (~mix_bits[x] & HPSJAM_BIT_SOLO))
 			continue;
-		if (bits[y] & HPSJAM_BIT_INVERT) {
+
+		const uint32_t gain = get_gain_from_bits(mix_bits[x]);
+
+		if (mix_bits[x] & HPSJAM_BIT_INVERT) {
 			for (unsigned z = 0; z != HPSJAM_DEF_SAMPLES; z++) {
-				out_audio[0][z] -= float_gain(other.tmp_audio[0][z], gain);
-				out_audio[1][z] -= float_gain(other.tmp_audio[1][z], gain);
+				mix[0][z] -= float_gain(temp[0][z], gain);
+				mix[1][z] -= float_gain(temp[1][z], gain);
 			}
 		} else {
 			for (unsigned z = 0; z != HPSJAM_DEF_SAMPLES; z++) {
-				out_audio[0][z] += float_gain(other.tmp_audio[0][z], gain);
-				out_audio[1][z] += float_gain(other.tmp_audio[1][z], gain);
+				mix[0][z] += float_gain(temp[0][z], gain);
+				mix[1][z] += float_gain(temp[1][z], gain);
 			}
 		}
 	}
-}
-
-Q_DECL_EXPORT void
-hpsjam_server_tick()
-{
-	/* reset timer adjustment */
-	memset(hpsjam_server_adjust, 0, sizeof(hpsjam_server_adjust));
 
-	/* get audio */
-	for (unsigned x = 0; x != hpsjam_num_server_peers; x++)
-		hpsjam_server_peers[x].audio_export();
+	in_ring.addSamples(mix[0], mix[1], HPSJAM_DEF_SAMPLES);
+	in_level[0].addSamples(mix[0], HPSJAM_DEF_SAMPLES);
+	in_level[1].addSamples(mix[1], HPSJAM_DEF_SAMPLES);
 
-	/* send out levels, if any */
-	hpsjam_send_levels();
-
-	/* mix everything */
-	for (unsigned x = 0; x != hpsjam_num_server_peers; x++)
-		hpsjam_server_peers[x].audio_mixing();
-
-	/* send audio */
-	for (unsigned x = 0; x != hpsjam_num_server_peers; x++)
-		hpsjam_server_peers[x].audio_import();
-
-	/* adjust timer, if any */
-	if (hpsjam_server_adjust[1] >= hpsjam_server_adjust[0] &&
-	    hpsjam_server_adjust[1] >= hpsjam_server_adjust[2]) {
-		hpsjam_timer_adjust = 0;	/* go normal */
-	} else if (hpsjam_server_adjust[0] >= hpsjam_server_adjust[1] &&
-		   hpsjam_server_adjust[0] >= hpsjam_server_adjust[2]) {
-		hpsjam_timer_adjust = 1;	/* go slower */
-	} else {
-		hpsjam_timer_adjust = -1;	/* go faster */
+	if (any == false) {
+		sfu_active = false;
+		mix_source.clear();
 	}
 }
 
-void
-hpsjam_client_peer :: handle_pending_watchdog()
+static void
+hpsjam_send_direct(const struct hpsjam_socket_address &addr,
+    const struct hpsjam_packet_entry &entry)
 {
-	QMutexLocker locker(&lock);
+	union hpsjam_frame frame;
+	const size_t len = entry.packet.getBytes();
 
-	if (address.valid() && output_pkt.empty()) {
-		struct hpsjam_packet_entry *pkt = new struct hpsjam_packet_entry;
-		pkt->packet.setPing(0, hpsjam_ticks, 0);
-		pkt->packet.type = HPSJAM_TYPE_PING_REQUEST;
-		pkt->insert_tail(&output_pkt.head);
-	}
+	frame.hdr.clear();
+	memcpy(frame.start, entry.raw, len);
+	addr.sendto((const char *)&frame, sizeof(frame.hdr) + len);
 }
 
 void
-hpsjam_client_peer :: tick()
+hpsjam_client_peer :: receiveDirect(const struct hpsjam_socket_address &src,
+    const union hpsjam_frame &frame)
 {
-	QMutexLocker locker(&lock);
-
-	if (address.valid() == false)
-		return;
-
-	const union hpsjam_frame *pkt;
+	struct hpsjam_packet_entry entry;
 	const struct hpsjam_packet *ptr;
-	struct hpsjam_packet_entry *pres;
-	union {
-		float temp[HPSJAM_MAX_PKT];
-		float audio[2][HPSJAM_DEF_SAMPLES];
-	};
-	size_t num;
-	uint16_t jitter;
+	float temp[HPSJAM_MAX_PKT];
+	uint16_t packets;
+	uint16_t time_ms;
+	uint64_t passwd;
+	unsigned x;
 
-	input_pkt.recovery();
+	for (x = 0; x != HPSJAM_PEERS_MAX; x++) {
+		if (direct[x].valid && direct[x].address == src)
+			break;
+	}
+	if (x == HPSJAM_PEERS_MAX)
+		return;
 
-	/* update jitter */
-	jitter = input_pkt.jitter.get_jitter_in_ms();
-	out_audio[0].set_jitter_limit_in_ms(jitter);
-	out_audio[1].set_jitter_limit_in_ms(jitter);
+	struct hpsjam_client_direct &link = direct[x];
 
-	while ((pkt = input_pkt.first_pkt())) {
-		for (ptr = pkt->start; ptr->valid(pkt->end); ptr = ptr->next()) {
-			/* check for unsequenced packets */
-			if (HpsJamReceiveUnSequenced
-			    <class hpsjam_client_peer>(*this, ptr, temp))
-				continue;
-			/* check if other side received packet */
-			if (ptr->getPeerSeqNo() == output_pkt.pend_seqno)
-				output_pkt.advance();
-			/* check if sequence number matches */
-			if (ptr->getLocalSeqNo() != output_pkt.peer_seqno)
-				continue;
-			/* advance expected sequence number */
-			output_pkt.peer_seqno++;
-			output_pkt.send_ack = true;
-
-			switch (ptr->type) {
-			uint16_t packets;
-			uint16_t time_ms;
-			uint64_t passwd;
-			const char *data;
-			uint8_t mix;
-			uint8_t index;
-
-			case HPSJAM_TYPE_PING_REQUEST:
-				if (ptr->getPing(packets, time_ms, passwd) &&
-				    output_pkt.find(HPSJAM_TYPE_PING_REPLY) == 0) {
-					pres = new struct hpsjam_packet_entry;
-					pres->packet.setPing(0, time_ms, 0);
-					pres->packet.type = HPSJAM_TYPE_PING_REPLY;
-					pres->insert_tail(&output_pkt.head);
-				}
-				break;
-			case HPSJAM_TYPE_LYRICS_REPLY:
-				if (ptr->getRawData(&data, num)) {
-					QByteArray t(data, num);
-					emit receivedLyrics(new QString(QString::fromUtf8(t)));
-				}
-				break;
-			case HPSJAM_TYPE_CHAT_REPLY:
-				if (ptr->getRawData(&data, num)) {
-					QByteArray t(data, num);
-					emit receivedChat(new QString(QString::fromUtf8(t)));
-				}
-				break;
-			case HPSJAM_TYPE_FADER_ICON_REPLY:
-				if (ptr->getFaderData(mix, index, &data, num)) {
-					if (mix != 0)
-						break;
-					if (self_index == -1) {
-						self_index = index;
-						emit receivedFaderSelf(mix, index);
-					}
-					emit receivedFaderIcon(mix, index, new QByteArray(data, num));
-				}
-				break;
-			case HPSJAM_TYPE_FADER_NAME_REPLY:
-				if (ptr->getFaderData(mix, index, &data, num)) {
-					if (mix != 0)
-						break;
-					if (self_index == -1) {
-						self_index = index;
-						emit receivedFaderSelf(mix, index);
-					}
-					QByteArray t(data, num);
-					emit receivedFaderName(mix, index, new QString(QString::fromUtf8(t)));
-				}
-				break;
-			case HPSJAM_TYPE_FADER_GAIN_REPLY:
-				if (ptr->getFaderValue(mix, index, temp, num)) {
-					assert(num <= HPSJAM_MAX_PKT);
-					if (mix != 0 || num <= 0)
-						break;
-					if (index + num > HPSJAM_PEERS_MAX)
-						break;
-					for (size_t x = 0; x != num; x++)
-						emit receivedFaderGain(mix, index + x, temp[x]);
-				}
-				break;
-			case HPSJAM_TYPE_FADER_PAN_REPLY:
-				if (ptr->getFaderValue(mix, index, temp, num)) {
-					assert(num <= HPSJAM_MAX_PKT);
-					if (mix != 0 || num <= 0)
-						break;
-					if (index + num > HPSJAM_PEERS_MAX)
-						break;
-					for (size_t x = 0; x != num; x++)
-						emit receivedFaderPan(mix, index + x, temp[x]);
-				}
-				break;
-			case HPSJAM_TYPE_FADER_LEVEL_REPLY:
-				if (ptr->getFaderValue(mix, index, temp, num)) {
-					assert(num <= HPSJAM_MAX_PKT);
-					if (mix != 0 || (num % 2) != 0 || num <= 0)
-						break;
-					if (index + (num / 2) > HPSJAM_PEERS_MAX)
-						break;
-					for (size_t x = 0; x != (num / 2); x++)
-						emit receivedFaderLevel(mix, index + x, temp[2 * x], temp[2 * x + 1]);
-				}
-				break;
-			case HPSJAM_TYPE_LOCAL_GAIN_REPLY:
-				if (ptr->getFaderValue(mix, index, temp, num)) {
-					assert(num <= HPSJAM_MAX_PKT);
-					if (mix != 0 || index != 0 || num != 1)
-						break;
-					in_gain = temp[0];
-				}
-				break;
-			case HPSJAM_TYPE_LOCAL_PAN_REPLY:
-				if (ptr->getFaderValue(mix, index, temp, num)) {
-					assert(num <= HPSJAM_MAX_PKT);
-					if (mix != 0 || index != 0 || num != 1)
-						break;
-					in_pan = temp[0];
-				}
-				break;
-			case HPSJAM_TYPE_FADER_EQ_REPLY:
-				if (ptr->getFaderData(mix, index, &data, num)) {
-					if (mix != 0)
-						break;
-					QByteArray t(data, num);
-					emit receivedFaderEQ(mix, index, new QString(QString::fromLatin1(t)));
-				}
-				break;
-			case HPSJAM_TYPE_LOCAL_EQ_REPLY:
-				if (ptr->getFaderData(mix, index, &data, num)) {
-					if (mix != 0 || index != 0)
-						break;
-					char *ptr = new char [num + 1];
-					memcpy(ptr, data, num);
-					ptr[num] = 0;
-					eq.init(ptr);
-					delete [] ptr;
-				}
-				break;
-			case HPSJAM_TYPE_FADER_DISCONNECT_REPLY:
-				if (ptr->getFaderData(mix, index, &data, num)) {
-					if (mix != 0)
-						break;
-					emit receivedFaderDisconnect(mix, index);
-				}
-				break;
-			default:
-				break;
+	for (ptr = frame.start; ptr->valid(frame.end); ptr = ptr->next()) {
+		switch (ptr->type) {
+		case HPSJAM_TYPE_PING_REQUEST:
+			if (ptr->getPing(packets, time_ms, passwd)) {
+				entry.packet.setPing(0, time_ms, 0);
+				entry.packet.type = HPSJAM_TYPE_PING_REPLY;
+				hpsjam_send_direct(link.address, entry);
 			}
+			break;
+		case HPSJAM_TYPE_PING_REPLY:
+			if (ptr->getPing(packets, time_ms, passwd)) {
+				link.rtt = hpsjam_ticks - time_ms;
+				link.ping_ticks = hpsjam_ticks;
+			}
+			break;
+		case HPSJAM_TYPE_AUDIO_SFU ... HPSJAM_TYPE_AUDIO_SFU + HPSJAM_TYPE_AUDIO_32_BIT_2CH:
+			/* the server still mixes this peer, if not active */
+			if (link.active)
+				receiveSource(x, ptr, temp);
+			break;
+		default:
+			break;
 		}
 	}
+}
 
-	/* send a ping, if idle */
-	if (output_pkt.empty()) {
-		pres = new struct hpsjam_packet_entry;
-		pres->packet.setPing(0, hpsjam_ticks, 0);
-		pres->packet.type = HPSJAM_TYPE_PING_REQUEST;
-		pres->insert_tail(&output_pkt.head);
-	}
+void
+hpsjam_client_peer :: sendDirect(const struct hpsjam_packet_entry &entry)
+{
+	struct hpsjam_packet_entry copy;
+	bool any = false;
 
-	/* extract samples for this tick */
-	out_audio[0].remSamples(audio[0], HPSJAM_DEF_SAMPLES);
-	out_audio[1].remSamples(audio[1], HPSJAM_DEF_SAMPLES);
+	if (hpsjam_client_p2p == false || hpsjam_client_listen == true)
+		return;
 
-	/* check if we should adjust the timer */
-	switch (out_audio[0].getLowWater()) {
-	case 0:
-		hpsjam_timer_adjust = 1;	/* go slower */
-		break;
-	case 1:
-		hpsjam_timer_adjust = 0;	/* go normal */
-		break;
-	default:
-		hpsjam_timer_adjust = -1;	/* go faster */
-		break;
-	}
+	for (unsigned x = 0; x != HPSJAM_PEERS_MAX; x++) {
+		const struct hpsjam_client_direct &link = direct[x];
 
-	/* process output output */
-	HpsJamProcessOutputAudio
-	    <class hpsjam_client_peer>(*this, audio[0], audio[1]);
+		if (link.valid == false || link.isUp() == false)
+			continue;
 
-	/* send a packet */
-	HpsJamSendPacket
-	    <class hpsjam_client_peer>(*this);
+		/* send audio in the same format as forwarded audio */
+		if (any == false) {
+			memcpy(copy.raw, entry.raw, entry.packet.getBytes());
+			if (entry.packet.type == HPSJAM_TYPE_AUDIO_SILENCE)
+				copy.packet.type = HPSJAM_TYPE_AUDIO_SFU;
+			else
+				copy.packet.type += HPSJAM_TYPE_AUDIO_SFU;
+			any = true;
+		}
+		hpsjam_send_direct(link.address, copy);
+	}
 }
 
 void
-hpsjam_client_peer :: handleChat(QString *str)
+hpsjam_client_peer :: tickDirect()
 {
-	hpsjam_client->w_chat->append(*str);
-	delete str;
-}
+	struct hpsjam_packet_entry entry;
+	struct hpsjam_packet_entry *pkt;
 
-void
-hpsjam_client_peer :: handleLyrics(QString *str)
-{
-	hpsjam_client->w_lyrics->append(*str);
-	delete str;
+	/* the ticks may advance by several at a time, when audio clocked */
+	const bool ping = ((uint16_t)(hpsjam_ticks - direct_ticks) >= 64);
+	if (ping)
+		direct_ticks = hpsjam_ticks;
+
+	for (unsigned x = 0; x != HPSJAM_PEERS_MAX; x++) {
+		struct hpsjam_client_direct &link = direct[x];
+
+		if (link.valid == false)
+			continue;
+
+		/* ping the other client, which also opens the path through NAT */
+		if (ping) {
+			entry.packet.setPing(0, hpsjam_ticks, 0);
+			entry.packet.type = HPSJAM_TYPE_PING_REQUEST;
+			hpsjam_send_direct(link.address, entry);
+		}
+
+		/*
+		 * Use the direct path when it is faster than the path
+		 * through the server, with some hysteresis. Until the
+		 * server reports the other client's round trip time, only
+		 * our own is counted, which favours the server.
+		 */
+		const unsigned server_rtt = output_pkt.ping_time + link.server_rtt;
+		const bool want = link.isUp() && (link.active ?
+		    (link.rtt <= server_rtt) :
+		    ((unsigned)link.rtt + 1 < server_rtt));
+
+		if (want == link.active)
+			continue;
+		link.active = want;
+
+		/* tell the server to stop or resume mixing this peer */
+		const char value = want;
+		pkt = new struct hpsjam_packet_entry;
+		pkt->packet.setFaderData(0, x, &value, 1);
+		pkt->packet.type = HPSJAM_TYPE_DIRECT_REQUEST;
+		pkt->insert_tail(&output_pkt.head);
+	}
 }
 
 void
-hpsjam_cli_process(const struct hpsjam_socket_address &addr, const char *data, size_t len)
+hpsjam_client_cli_process(const char *data, size_t len)
 {
 	struct hpsjam_packet_entry *pkt;
 	QByteArray ba(data, len);
@@ -1212,22 +799,14 @@ hpsjam_cli_process(const struct hpsjam_socket_address &addr, const char *data, s
 		QByteArray temp = str.toUtf8();
 		assert(temp.length() >= 16);
 
-		if (hpsjam_num_server_peers == 0) {
-			QMutexLocker locker(&hpsjam_client_peer->lock);
+		QMutexLocker locker(&hpsjam_client_peer->lock);
 
-			if (hpsjam_client_peer->address.valid()) {
-				/* send text */
-				pkt = new struct hpsjam_packet_entry;
-				pkt->packet.setRawData(temp.constData() + 16, temp.length() - 16);
-				pkt->packet.type = HPSJAM_TYPE_LYRICS_REQUEST;
-				pkt->insert_tail(&hpsjam_client_peer->output_pkt.head);
-			}
-		} else {
+		if (hpsjam_client_peer->address.valid()) {
+			/* send text */
 			pkt = new struct hpsjam_packet_entry;
 			pkt->packet.setRawData(temp.constData() + 16, temp.length() - 16);
-			pkt->packet.type = HPSJAM_TYPE_LYRICS_REPLY;
-			hpsjam_server_broadcast(*pkt);
-			delete pkt;
+			pkt->packet.type = HPSJAM_TYPE_LYRICS_REQUEST;
+			pkt->insert_tail(&hpsjam_client_peer->output_pkt.head);
 		}
 	}
 }
@@ -1274,22 +853,20 @@ hpsjam_client_audio_effects :: hpsjam_client_audio_effects()
 
 	new_message_gain = 0.0f;
 	new_user_gain = 0.0f;
+	new_message_req = 0.0f;
+	new_user_req = 0.0f;
 }
 
 void
 hpsjam_client_audio_effects :: playNewMessage(float gain)
 {
-	if (new_message_off == new_message_max && gain > 0.0f) {
-		new_message_off = 0;
-		new_message_gain = gain;
-	}
+	if (gain > 0.0f)
+		new_message_req = gain;
 }
 
 void
 hpsjam_client_audio_effects :: playNewUser(float gain)
 {
-	if (new_user_off == new_user_max && gain > 0.0f) {
-		new_user_off = 0;
-		new_user_gain = gain;
-	}
+	if (gain > 0.0f)
+		new_user_req = gain;
 }
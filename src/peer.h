@@ -34,76 +34,23 @@
 #include "hpsjam.h"
 #include "audiobuffer.h"
 #include "equalizer.h"
+#include "compressor.h"
 #include "socket.h"
 #include "protocol.h"
+#include "server.h"
 
 #include <stdbool.h>
 
-class hpsjam_server_peer : public QObject {
-	Q_OBJECT;
-public:
-	QMutex lock;
-	struct hpsjam_socket_address address;
-	struct hpsjam_input_packetizer input_pkt;
-	class hpsjam_output_packetizer output_pkt;
-	class hpsjam_audio_buffer in_audio[2];
-	class hpsjam_audio_buffer out_buffer[2];
-	class hpsjam_audio_level in_level[2];
-#if (HPSJAM_DEF_SAMPLES > 64)
-#error "Please update the two arrays below"
-#endif
-	float tmp_audio[2][64];
-	float out_audio[2][64];
-
-	QString name;
-	QByteArray icon;
-	uint8_t bits[256];
-	float gain;
-	float pan;
-	float out_peak;
-	uint8_t output_fmt;
-	bool valid;
-	bool allow_mixer_access;
-
-	void init() {
-		address.clear();
-		input_pkt.init();
-		output_pkt.init();
-		in_audio[0].clear();
-		in_audio[1].clear();
-		out_buffer[0].clear();
-		out_buffer[1].clear();
-		in_level[0].clear();
-		in_level[1].clear();
-		memset(out_audio, 0, sizeof(out_audio));
-		name = QString();
-		icon = QByteArray();
-		memset(bits, 0, sizeof(bits));
-		output_fmt = HPSJAM_TYPE_AUDIO_SILENCE;
-		gain = 1.0f;
-		pan = 0.0f;
-		out_peak = 0.0f;
-		valid = false;
-		allow_mixer_access = false;
-	};
-
-	size_t serverID();
+#define	HPSJAM_CONTROL_MAX (2 * HPSJAM_SEQ_MAX)	/* received control packets */
 
-	void audio_export();
-	void audio_import();
-	void audio_mixing();
-	void send_welcome_message();
-
-	hpsjam_server_peer() {
-		init();
-		connect(&output_pkt, SIGNAL(pendingWatchdog()), this, SLOT(handle_pending_watchdog()));
-		connect(&output_pkt, SIGNAL(pendingTimeout()), this, SLOT(handle_pending_timeout()));
-	};
-public slots:
-	void handle_pending_watchdog();
-	void handle_pending_timeout();
+struct hpsjam_audio_format {
+	uint8_t format;
+	const char *descr;
+	int key;
 };
 
+extern const struct hpsjam_audio_format hpsjam_audio_format[HPSJAM_AUDIO_FORMAT_MAX];
+
 class hpsjam_client_audio_effects {
 public:
 	hpsjam_client_audio_effects();
@@ -123,6 +70,25 @@ public:
 	float *new_message_data;
 	float *new_user_data;
 
+	/* requests from the GUI thread, picked up by the audio thread */
+	std::atomic<float> new_message_req;
+	std::atomic<float> new_user_req;
+
+	void update() {
+		float gain;
+
+		gain = new_message_req.exchange(0.0f);
+		if (new_message_off == new_message_max && gain > 0.0f) {
+			new_message_off = 0;
+			new_message_gain = gain;
+		}
+		gain = new_user_req.exchange(0.0f);
+		if (new_user_off == new_user_max && gain > 0.0f) {
+			new_user_off = 0;
+			new_user_gain = gain;
+		}
+	};
+
 	bool isActive() {
 		return (new_message_off < new_message_max ||
 		    new_user_off < new_user_max);
@@ -138,38 +104,129 @@ public:
 	};
 };
 
+/*
+ * When the server forwards the audio of the other peers unchanged,
+ * the client jitter buffers each source and computes the personal
+ * mix itself.
+ */
+struct hpsjam_client_source {
+	class hpsjam_audio_buffer in_audio[2];
+	class hpsjam_audio_drift drift;
+	uint16_t ticks;		/* last tick audio was received */
+	bool valid;
+
+	void clear() {
+		in_audio[0].clear();
+		in_audio[1].clear();
+		drift.clear();
+		ticks = 0;
+		valid = false;
+	};
+};
+
+/*
+ * A direct audio path to another client, see --p2p. The server tells
+ * the clients about each others observed addresses and round trip
+ * times. The path is used when it works in both directions and has a
+ * lower round trip time than the path through the server, which is
+ * the sum of both clients' round trip times to the server.
+ */
+struct hpsjam_client_direct {
+	struct hpsjam_socket_address address;
+	uint16_t ping_ticks;	/* last tick a ping reply was received */
+	uint16_t rtt;		/* round trip time in ticks */
+	uint8_t server_rtt;	/* other client's round trip time to the server, 0 if unknown */
+	bool valid;
+	bool active;		/* server does not mix this peer */
+
+	void clear() {
+		address.clear();
+		ping_ticks = hpsjam_ticks - HPSJAM_DIRECT_TIMEOUT;
+		rtt = 65535;
+		server_rtt = 0;
+		valid = false;
+		active = false;
+	};
+
+	bool isUp() const {
+		return ((uint16_t)(hpsjam_ticks - ping_ticks) < HPSJAM_DIRECT_TIMEOUT);
+	};
+};
+
 class hpsjam_client_peer : public QObject {
 	Q_OBJECT;
 public:
 	QMutex lock;
 	struct hpsjam_socket_address address;
+	struct hpsjam_socket_address alt_address;	/* second path, see --multipath */
 	struct hpsjam_input_packetizer input_pkt;
 	class hpsjam_output_packetizer output_pkt;
-	class hpsjam_audio_buffer in_audio[2];
 	class hpsjam_audio_level in_level[2];
 	class hpsjam_audio_buffer out_buffer[2];
 	class hpsjam_audio_buffer out_audio[2];
 	class hpsjam_audio_level out_level[2];
 	class hpsjam_equalizer local_eq;
 	class hpsjam_equalizer eq;
-	class hpsjam_client_audio_effects audio_effects;
-	float mon_gain[2];
-	float mon_pan;
-	float in_gain;
-	float in_pan;
-	float in_peak;
-	float out_peak;
-	float local_peak;
+	struct hpsjam_stereo_limiter out_limiter;
 	int self_index;
-	uint8_t bits;
 	uint8_t output_fmt;
 
+	/* personal mix of forwarded audio, see --sfu, preallocated */
+	struct hpsjam_client_source *sfu_source[HPSJAM_PEERS_MAX];
+	struct hpsjam_client_source mix_source;	/* audio mixed by the server */
+	struct hpsjam_client_direct direct[HPSJAM_PEERS_MAX];
+	uint8_t mix_bits[HPSJAM_PEERS_MAX];
+	uint16_t direct_ticks;	/* last tick the direct paths were pinged */
+	bool sfu_active;
+
+	/*
+	 * The network tick may run on the audio thread, which must not
+	 * allocate memory nor emit signals. It passes received control
+	 * packets to tick_control() on the timer thread, using the
+	 * preallocated entries below. Acknowledged output packets are
+	 * freed by tick_control() too.
+	 */
+	hpsjam_packet_head_t ctrl_free;
+	hpsjam_packet_head_t ctrl_recv;
+	hpsjam_packet_head_t ctrl_done;
+	std::atomic<bool> audio_clocked;	/* network tick is run by the audio thread */
+
+	/*
+	 * The sound_process() function runs on the audio thread and
+	 * never takes the lock. Audio is exchanged with the network
+	 * tick through the wait-free rings below, and the parameters
+	 * are published atomically. The equalizers already swap their
+	 * filters atomically.
+	 */
+	class hpsjam_audio_ring in_ring;	/* network tick to audio thread */
+	class hpsjam_audio_ring out_ring;	/* audio thread to network tick */
+	std::atomic<float> mon_gain[2];
+	std::atomic<float> mon_pan;
+	std::atomic<float> in_gain;
+	std::atomic<float> in_pan;
+	std::atomic<uint16_t> in_jitter_limit;
+	std::atomic<uint8_t> bits;
+	std::atomic<bool> audio_valid;
+	std::atomic<bool> audio_reset;
+
+	/* owned by the audio thread */
+	class hpsjam_audio_buffer in_audio[2];
+	class hpsjam_client_audio_effects audio_effects;
+	struct hpsjam_stereo_limiter in_limiter;
+	struct hpsjam_stereo_limiter local_limiter;
+
+	/* copy of the receive buffer statistics for the GUI */
+	std::atomic<float> in_stats[HPSJAM_SEQ_MAX * 2];
+
 	void init() {
+		/* stop the audio thread first */
+		audio_valid = false;
+		audio_reset = true;
+
 		address.clear();
+		alt_address.clear();
 		input_pkt.init();
 		output_pkt.init();
-		in_audio[0].clear();
-		in_audio[1].clear();
 		in_level[0].clear();
 		in_level[1].clear();
 		out_buffer[0].clear();
@@ -178,29 +235,124 @@ public:
 		out_audio[1].clear();
 		out_level[0].clear();
 		out_level[1].clear();
+		out_ring.drain();
 		in_gain = 1.0f;
 		mon_gain[0] = 0.0f;
 		mon_gain[1] = 1.0f;
 		mon_pan = 0.0f;
 		in_pan = 0.0f;
-		in_peak = 0.0f;
-		out_peak = 0.0f;
-		local_peak = 0.0f;
+		in_jitter_limit = 3;
+		for (size_t x = 0; x != HPSJAM_SEQ_MAX * 2; x++)
+			in_stats[x] = 0.0f;
+		out_limiter.clear();
 		output_fmt = HPSJAM_TYPE_AUDIO_SILENCE;
 		bits = 0;
-		eq.cleanup();
-		local_eq.cleanup();
+		eq.reset();
+		local_eq.reset();
 		self_index = -1;
+		for (size_t x = 0; x != HPSJAM_PEERS_MAX; x++)
+			sfu_source[x]->clear();
+		mix_source.clear();
+		for (size_t x = 0; x != HPSJAM_PEERS_MAX; x++)
+			direct[x].clear();
+		direct_ticks = hpsjam_ticks;
+		memset(mix_bits, 0, sizeof(mix_bits));
+		sfu_active = false;
+		ctrl_drain();
 	};
-	hpsjam_client_peer() {
+	void ctrl_drain() {
+		struct hpsjam_packet_entry *pkt;
+
+		while ((pkt = TAILQ_FIRST(&ctrl_recv))) {
+			pkt->remove(&ctrl_recv);
+			pkt->insert_tail(&ctrl_free);
+		}
+		while ((pkt = TAILQ_FIRST(&ctrl_done))) {
+			pkt->remove(&ctrl_done);
+			delete pkt;
+		}
+	};
+	void receiveAudio(const float *left, const float *right, size_t num) {
+		/* the server mix is one of the sources, if any */
+		if (sfu_active) {
+			mix_source.in_audio[0].addSamples(left, num);
+			mix_source.in_audio[1].addSamples(right, num);
+			return;
+		}
+		in_ring.addSamples(left, right, num);
+		in_level[0].addSamples(left, num);
+		in_level[1].addSamples(right, num);
+	};
+	void receiveSilence(size_t num, bool lost) {
+		if (sfu_active) {
+			mix_source.in_audio[0].addSilence(num, lost);
+			mix_source.in_audio[1].addSilence(num, lost);
+			return;
+		}
+		in_ring.addSilence(num, lost);
+	};
+	void receiveForward(const struct hpsjam_packet *ptr, float *temp) {
+		receiveSource(ptr->getPeerSeqNo(), ptr, temp);
+	};
+	void receiveSource(uint8_t, const struct hpsjam_packet *, float *);
+	void receiveDirect(const struct hpsjam_socket_address &, const union hpsjam_frame &);
+	void sendDirect(const struct hpsjam_packet_entry &);
+	void tickDirect();
+	void mixForward(uint16_t);
+	void setMixBits(uint8_t index, uint8_t value) {
+		QMutexLocker locker(&lock);
+		mix_bits[index] = value;
+	};
+	hpsjam_client_peer() : audio_clocked(false) {
+		TAILQ_INIT(&ctrl_free);
+		TAILQ_INIT(&ctrl_recv);
+		TAILQ_INIT(&ctrl_done);
+		for (size_t x = 0; x != HPSJAM_CONTROL_MAX; x++)
+			(new struct hpsjam_packet_entry)->insert_tail(&ctrl_free);
+		for (size_t x = 0; x != HPSJAM_PEERS_MAX; x++)
+			sfu_source[x] = new struct hpsjam_client_source;
+		output_pkt.reclaim = &ctrl_done;
 		init();
+	};
+	~hpsjam_client_peer() {
+		struct hpsjam_packet_entry *pkt;
 
-		connect(&output_pkt, SIGNAL(pendingWatchdog()), this, SLOT(handle_pending_watchdog()));
-		connect(this, SIGNAL(receivedChat(QString *)), this, SLOT(handleChat(QString *)));
-		connect(this, SIGNAL(receivedLyrics(QString *)), this, SLOT(handleLyrics(QString *)));
+		output_pkt.init();
+		ctrl_drain();
+		while ((pkt = TAILQ_FIRST(&ctrl_free))) {
+			pkt->remove(&ctrl_free);
+			delete pkt;
+		}
+		for (size_t x = 0; x != HPSJAM_PEERS_MAX; x++)
+			delete sfu_source[x];
 	};
 	void sound_process(float *, float *, size_t);
-	void tick();
+	void tick() {
+		QMutexLocker locker(&lock);
+		tick_locked();
+		tick_control();
+	};
+	/* run from the timer thread, which advances the ticks, if owned */
+	void timer_tick() {
+		QMutexLocker locker(&lock);
+		if (audio_clocked == false) {
+			tick_locked();
+			hpsjam_ticks++;
+		}
+		tick_control();
+	};
+	/* run from the audio thread, which then owns the ticks */
+	bool try_tick() {
+		if (lock.tryLock() == false)
+			return (false);
+		audio_clocked = true;
+		tick_locked();
+		hpsjam_ticks++;
+		lock.unlock();
+		return (true);
+	};
+	void tick_locked();
+	void tick_control();
 	void send_single_pkt(struct hpsjam_packet_entry *pkt) {
 		QMutexLocker locker(&lock);
 		if (address.valid()) {
@@ -218,12 +370,8 @@ public:
 			delete pkt;
 		}
 	};
-public slots:
-	void handle_pending_watchdog();
-	void handleChat(QString *);
-	void handleLyrics(QString *);
-
 signals:
+	void pendingTimeout();
 	void receivedChat(QString *);
 	void receivedLyrics(QString *);
 	void receivedFaderLevel(uint8_t, uint8_t, float, float);
@@ -236,9 +384,8 @@ signals:
 	void receivedFaderSelf(uint8_t, uint8_t);
 };
 
-extern void hpsjam_cli_process(const struct hpsjam_socket_address &, const char *, size_t);
-extern void hpsjam_peer_receive(const struct hpsjam_socket_address &,
-    const union hpsjam_frame &);
-extern void hpsjam_server_tick();
+extern void hpsjam_client_receive(const struct hpsjam_socket_address &,
+    const union hpsjam_frame &, size_t);
+extern void hpsjam_client_cli_process(const char *, size_t);
 
 #endif		/* _HPSJAM_PEER_H_ */
@@ -26,8 +26,6 @@
 #ifndef	_HPSJAM_PROTOCOL_H_
 #define	_HPSJAM_PROTOCOL_H_
 
-#include <QObject>
-
 #include "hpsjam.h"
 #include "socket.h"
 #include "jitter.h"
@@ -78,8 +76,26 @@ enum {
 	HPSJAM_TYPE_LOCAL_GAIN_REPLY,
 	HPSJAM_TYPE_LOCAL_PAN_REPLY,
 	HPSJAM_TYPE_LOCAL_EQ_REPLY,
+	HPSJAM_TYPE_PEER_ADDRESS_REPLY,
+	HPSJAM_TYPE_DIRECT_REQUEST,
+	HPSJAM_TYPE_PEER_RTT_REPLY,
 };
 
+/*
+ * Audio forwarded unchanged by a selective forwarding server uses the
+ * audio types above offset by HPSJAM_TYPE_AUDIO_SFU. Forwarded silence
+ * uses HPSJAM_TYPE_AUDIO_SFU itself. The peer sequence number field
+ * holds the index of the source peer.
+ */
+#define	HPSJAM_TYPE_AUDIO_SFU 32
+
+/* flags in the packets field of the initial ping request */
+#define	HPSJAM_PING_LISTENER 0x8000	/* listen only */
+#define	HPSJAM_PING_TRUNK 0x4000	/* server to server trunk link */
+#define	HPSJAM_PING_P2P 0x2000		/* peer to peer audio capable */
+#define	HPSJAM_PING_MULTIPATH 0x1000	/* same ping is sent on two paths */
+#define	HPSJAM_PING_ROOM_MASK 0x00FF	/* room ID */
+
 struct hpsjam_header {
 	uint8_t sequence;
 	void clear() {
@@ -209,20 +225,26 @@ struct hpsjam_packet {
 	void setRawData(const char *, size_t, char pad = 0);
 	bool getRawData(const char **, size_t &) const;
 
-	bool getConfigure(uint8_t &out_format) const {
+	bool getConfigure(uint8_t &out_format, uint8_t &jitter_target) const {
 		if (length >= 2) {
 			out_format = getS8(0);
+			/* zero means default, for backwards compatibility */
+			jitter_target = getS8(1);
+			if (jitter_target == 0 || jitter_target > HPSJAM_JITTER_TARGET_MAX)
+				jitter_target = HPSJAM_JITTER_TARGET_DEFAULT;
+			else
+				jitter_target--;
 			return (true);
 		}
 		return (false);
 	};
 
-	void setConfigure(uint8_t out_format) {
+	void setConfigure(uint8_t out_format, uint8_t jitter_target) {
 		length = 2;
 		sequence[0] = 0;
 		sequence[1] = 0;
 		putS8(0, out_format);
-		putS8(1, 0);
+		putS8(1, jitter_target + 1);
 		putS8(2, 0);
 		putS8(3, 0);
 	};
@@ -246,6 +268,21 @@ struct hpsjam_packet {
 		putS32(4, (uint32_t)passwd);
 		putS32(8, (uint32_t)(passwd >> 32));
 	};
+
+	/* random token identifying the paths of a multipath client */
+	bool getPingToken(uint64_t &token) const {
+		if (length >= 6) {
+			token = ((uint64_t)(uint32_t)getS32(12)) | (((uint64_t)(uint32_t)getS32(16)) << 32);
+			return (token != 0);
+		}
+		return (false);
+	};
+
+	void setPingToken(uint64_t token) {
+		length = 6;
+		putS32(12, (uint32_t)token);
+		putS32(16, (uint32_t)(token >> 32));
+	};
 };
 
 struct hpsjam_packet_entry;
@@ -289,19 +326,49 @@ union hpsjam_frame {
 	void clear() {
 		memset(this, 0, sizeof(*this));
 	};
-	void do_xor(const union hpsjam_frame &other) {
-		for (size_t x = 0; x != (sizeof(*this) / 8); x++)
+
+	/*
+	 * The functions below only access the first "len" bytes of a
+	 * frame. They rely on all bytes beyond the used length being
+	 * zero, which is the case for all frames kept by the
+	 * packetizers.
+	 */
+	void clear(size_t len) {
+		memset(raw, 0, len);
+	};
+	/* zero the bytes left over from previous contents of length "old" */
+	void zero_tail(size_t len, size_t old) {
+		if (old > len)
+			memset(raw + len, 0, old - len);
+	};
+	void copy(const union hpsjam_frame &other, size_t len, size_t old) {
+		memcpy(raw, other.raw, len);
+		zero_tail(len, old);
+	};
+	void do_xor(const union hpsjam_frame &other, size_t len) {
+		/* round up to whole words, which are zero padded */
+		for (size_t x = 0; x != (len + 7) / 8; x++)
 			raw64[x] ^= other.raw64[x];
 	};
 };
 
-class hpsjam_output_packetizer : public QObject {
-	Q_OBJECT;
+/*
+ * Events reported by the output packetizer. They are collected by the
+ * owner of the packetizer after sending, because handling them
+ * requires the peer lock, which is held while sending.
+ */
+#define	HPSJAM_OUTPUT_WATCHDOG (1U << 0)	/* no reply for 1000 ticks */
+#define	HPSJAM_OUTPUT_TIMEOUT (1U << 1)	/* no reply for 2000 ticks */
+
+#define	HPSJAM_XOR_DISTANCE 2	/* default distance between XOR frames */
+
+class hpsjam_output_packetizer {
 public:
 	union hpsjam_frame current;
 	union hpsjam_frame mask;
 	hpsjam_packet_head_t head;
 	struct hpsjam_packet_entry *pending;
+	hpsjam_packet_head_t *reclaim;	/* acknowledged packets, if not freed at once */
 	uint16_t start_time; /* start time for message */
 	uint16_t ping_time; /* response time in ticks */
 	uint16_t pend_count; /* pending timeout counter */
@@ -310,6 +377,7 @@ public:
 	uint8_t d_cur;	/* current distance between XOR frames */
 	uint8_t d_max;	/* maximum distance between XOR frames */
 	uint8_t seqno;	/* current sequence number */
+	uint8_t events;	/* see HPSJAM_OUTPUT_XXX */
 	bool send_ack;
 	size_t offset;	/* current data offset */
 	size_t d_len;	/* maximum XOR frame length */
@@ -317,6 +385,7 @@ public:
 	hpsjam_output_packetizer() {
 		TAILQ_INIT(&head);
 		pending = 0;
+		reclaim = 0;
 		init();
 	};
 
@@ -333,7 +402,7 @@ public:
 		return (0);
 	};
 
-	void init(uint8_t distance = 2) {
+	void init(uint8_t distance = HPSJAM_XOR_DISTANCE) {
 		struct hpsjam_packet_entry *pkt;
 		d_cur = 0;
 		d_max = distance % HPSJAM_SEQ_MAX;
@@ -343,8 +412,10 @@ public:
 		pend_seqno = 0;
 		peer_seqno = 0;
 		seqno = 0;
+		events = 0;
 		send_ack = false;
 		offset = 0;
+		d_len = 0;
 		current.clear();
 		mask.clear();
 
@@ -390,7 +461,10 @@ public:
 	void advance() {
 		if (pending == 0)
 			return;
-		delete pending;
+		if (reclaim != 0)
+			pending->insert_tail(reclaim);
+		else
+			delete pending;
 		pending = 0;
 		ping_time = hpsjam_ticks - start_time;
 	};
@@ -399,12 +473,43 @@ public:
 		return (d_cur == d_max);
 	};
 
-	void send(const struct hpsjam_socket_address &addr) {
+	uint8_t getEvents() {
+		const uint8_t retval = events;
+		events = 0;
+		return (retval);
+	};
+
+	/* number of bytes left in the current frame */
+	size_t remainder() const {
+		return (sizeof(current) - sizeof(current.hdr) - offset);
+	};
+
+	/* number of bytes send() may need for control packets */
+	size_t control_bytes() const {
+		size_t len = 4;		/* ACK */
+
+		if (pending == 0) {
+			if (TAILQ_FIRST(&head) != 0)
+				len += TAILQ_FIRST(&head)->packet.getBytes();
+		} else if ((pend_count % 64) == 0) {
+			len += pending->packet.getBytes();
+		}
+		return (len);
+	};
+
+	void send(const struct hpsjam_socket_address &addr,
+	    const struct hpsjam_socket_address *alt = 0) {
+		/* check for a second path */
+		if (alt != 0 && alt->valid() == false)
+			alt = 0;
+
 		if (d_cur == d_max) {
 			/* finalize XOR packet */
 			mask.hdr.setSequence(seqno, d_max);
 			addr.sendto((const char *)&mask, d_len + sizeof(mask.hdr));
-			mask.clear();
+			if (alt != 0)
+				alt->sendto((const char *)&mask, d_len + sizeof(mask.hdr));
+			mask.clear(d_len + sizeof(mask.hdr));
 			d_cur = 0;
 			d_len = 0;
 		} else {
@@ -434,17 +539,19 @@ public:
 				}
 			}
 			if (pend_count == 1000)
-				emit pendingWatchdog();
+				events |= HPSJAM_OUTPUT_WATCHDOG;
 			else if (pend_count == 2000)
-				emit pendingTimeout();
+				events |= HPSJAM_OUTPUT_TIMEOUT;
 
 			/* check if we need to send an ACK */
 			if (send_ack && append_ack())
 				send_ack = false;
 			current.hdr.setSequence(seqno, 0);
 			addr.sendto((const char *)&current, offset + sizeof(current.hdr));
-			mask.do_xor(current);
-			current.clear();
+			if (alt != 0)
+				alt->sendto((const char *)&current, offset + sizeof(current.hdr));
+			mask.do_xor(current, offset + sizeof(current.hdr));
+			current.clear(offset + sizeof(current.hdr));
 			seqno++;
 			d_cur++;
 			/* keep track of maximum XOR length */
@@ -453,26 +560,49 @@ public:
 			offset = 0;
 		}
 	};
-signals:
-	void pendingWatchdog();
-	void pendingTimeout();
 };
 
 struct hpsjam_input_packetizer {
 	struct hpsjam_jitter jitter;
 	union hpsjam_frame current[HPSJAM_SEQ_MAX];
 	union hpsjam_frame mask[HPSJAM_SEQ_MAX];
+	uint16_t current_len[HPSJAM_SEQ_MAX];	/* used bytes, including header */
+	uint16_t mask_len[HPSJAM_SEQ_MAX];
+	uint16_t current_ticks[HPSJAM_SEQ_MAX];	/* receive time, for duplicates */
+	uint16_t mask_ticks[HPSJAM_SEQ_MAX];
 	uint8_t valid[HPSJAM_SEQ_MAX];
 	uint8_t last_red;
+	bool lost;	/* last frame was synthesized for a loss */
 
 	void init() {
 		jitter.clear();
 		for (size_t x = 0; x != HPSJAM_SEQ_MAX; x++) {
 			current[x].clear();
 			mask[x].clear();
+			current_len[x] = 0;
+			mask_len[x] = 0;
+			current_ticks[x] = hpsjam_ticks - HPSJAM_SEQ_MAX;
+			mask_ticks[x] = hpsjam_ticks - HPSJAM_SEQ_MAX;
 		}
 		memset(valid, 0, sizeof(valid));
 		last_red = 2;
+		lost = false;
+	};
+
+	/*
+	 * A frame is a duplicate, for example received on a second path,
+	 * when it is equal to the frame stored in the same slot and was
+	 * received less than half a sequence period earlier.
+	 */
+	static bool isDuplicate(const union hpsjam_frame &stored, size_t stored_len,
+	    uint16_t ticks, const union hpsjam_frame &frame, size_t len) {
+		return ((uint16_t)(hpsjam_ticks - ticks) < (HPSJAM_SEQ_MAX / 2) &&
+		    stored_len == len && memcmp(&stored, &frame, len) == 0);
+	};
+
+	/* audio buffer limit, including time to recover one lost frame */
+	uint16_t get_jitter_limit_in_ms() {
+		return (jitter.get_jitter_in_ms() + last_red + 1);
 	};
 
 	const union hpsjam_frame *first_pkt() {
@@ -525,11 +655,15 @@ struct hpsjam_input_packetizer {
 					 * carries one chunk:
 					 */
 					valid[z] |= 1 | 4 | 8;
-					current[z].clear();
+					current[z].clear(current_len[z]);
 					current[z].start[0].putSilence(HPSJAM_NOM_SAMPLES);
+					current_len[z] = sizeof(current[z].hdr) +
+					    current[z].start[0].getBytes();
+					lost = true;
 					return (current + z);
 				case 1:
 					valid[z] |= 1 | 4;
+					lost = false;
 					return (current + z);
 				default:
 					break;
@@ -575,14 +709,18 @@ struct hpsjam_input_packetizer {
 				/* one frame missing */
 				for (uint8_t y = 0; y != last_red; y++) {
 					const uint8_t z = (HPSJAM_SEQ_MAX + x - y - 1) % HPSJAM_SEQ_MAX;
-					if (valid[z] & 1)
-						mask[x].do_xor(current[z]);
+					if (~valid[z] & 1)
+						continue;
+					mask[x].do_xor(current[z], current_len[z]);
+					if (mask_len[x] < current_len[z])
+						mask_len[x] = current_len[z];
 				}
 				/* recover the missing frame */
 				for (uint8_t y = 0; y != last_red; y++) {
 					const uint8_t z = (HPSJAM_SEQ_MAX + x - y - 1) % HPSJAM_SEQ_MAX;
 					if (~valid[z] & 1) {
-						current[z] = mask[x];
+						current[z].copy(mask[x], mask_len[x], current_len[z]);
+						current_len[z] = mask_len[x];
 						/* invalidate headers */
 						mask[x].hdr.clear();
 						current[z].hdr.clear();
@@ -594,19 +732,31 @@ struct hpsjam_input_packetizer {
 		}
 	};
 
-	void receive(const union hpsjam_frame &frame) {
+	void receive(const union hpsjam_frame &frame, size_t len) {
 		const uint8_t rx_seqno = frame.hdr.getSeqNo();
 		const uint8_t rx_red = frame.hdr.getRedNo();
 
+		assert(len <= sizeof(frame));
+
 		if (rx_red != 0) {
 			/* check that the redundancy count is valid */
 			if ((HPSJAM_SEQ_MAX % rx_red) == 0 && (rx_seqno % rx_red) == 0) {
+				if (isDuplicate(mask[rx_seqno], mask_len[rx_seqno],
+				    mask_ticks[rx_seqno], frame, len))
+					return;
 				last_red = rx_red;
-				mask[rx_seqno] = frame;
+				mask[rx_seqno].copy(frame, len, mask_len[rx_seqno]);
+				mask_len[rx_seqno] = len;
+				mask_ticks[rx_seqno] = hpsjam_ticks;
 				valid[rx_seqno] |= 2;
 			}
 		} else {
-			current[rx_seqno] = frame;
+			if (isDuplicate(current[rx_seqno], current_len[rx_seqno],
+			    current_ticks[rx_seqno], frame, len))
+				return;
+			current[rx_seqno].copy(frame, len, current_len[rx_seqno]);
+			current_len[rx_seqno] = len;
+			current_ticks[rx_seqno] = hpsjam_ticks;
 			valid[rx_seqno] |= 1;
 		}
 
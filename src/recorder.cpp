@@ -0,0 +1,327 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsjam.h"
+#include "recorder.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#endif
+
+#ifndef _WIN32
+#include <err.h>
+#include <sys/resource.h>
+#endif
+
+#include <atomic>
+
+/*
+ * The server tick thread only copies audio into a lock-free ring
+ * buffer per track. A separate low priority thread opens the files
+ * and writes the rings to disk in large sequential chunks, so that
+ * slow storage never delays the tick. All files are 32-bit floating
+ * point stereo WAV files, aligned to the start of the recording.
+ */
+#define	HPSJAM_RECORD_PERIOD 50000	/* writer period in microseconds */
+#define	HPSJAM_RECORD_HEADER 44		/* bytes */
+#define	HPSJAM_RECORD_PREALLOC (16U << 20)	/* bytes */
+
+struct hpsjam_record_track {
+	float ring[HPSJAM_RECORD_RING][2];
+	std::atomic<size_t> producer;	/* samples pushed by the tick thread */
+	std::atomic<size_t> consumer;	/* samples written by the writer */
+	std::atomic<bool> active;	/* set when the first audio is pushed */
+	uint64_t start;		/* first sample, relative to start of recording */
+	size_t gap;		/* samples lost on overrun, owned by the tick thread */
+	FILE *file;		/* owned by the writer */
+	uint64_t samples;	/* samples in file */
+	uint64_t allocated;	/* preallocated bytes */
+	bool failed;
+
+	hpsjam_record_track() : producer(0), consumer(0), active(false) {
+		start = 0;
+		gap = 0;
+		file = 0;
+		samples = 0;
+		allocated = 0;
+		failed = false;
+	};
+};
+
+const char *hpsjam_record_dir;
+
+static struct hpsjam_record_track *hpsjam_record_tracks[HPSJAM_RECORD_TRACKS];
+static uint64_t hpsjam_record_position;	/* owned by the tick thread */
+static char hpsjam_record_prefix[32];
+
+static void
+hpsjam_recorder_put_le32(uint8_t *ptr, uint32_t value)
+{
+	ptr[0] = value;
+	ptr[1] = value >> 8;
+	ptr[2] = value >> 16;
+	ptr[3] = value >> 24;
+}
+
+static void
+hpsjam_recorder_header(struct hpsjam_record_track &track)
+{
+	uint8_t hdr[HPSJAM_RECORD_HEADER];
+	const uint64_t bytes = track.samples * 8;
+	/* saturate sizes beyond the limits of the file format */
+	const uint32_t data = (bytes > 0xFFFFFFFFULL - HPSJAM_RECORD_HEADER) ?
+	    (0xFFFFFFFFU - HPSJAM_RECORD_HEADER) : (uint32_t)bytes;
+
+	memcpy(hdr + 0, "RIFF", 4);
+	hpsjam_recorder_put_le32(hdr + 4, data + HPSJAM_RECORD_HEADER - 8);
+	memcpy(hdr + 8, "WAVEfmt ", 8);
+	hpsjam_recorder_put_le32(hdr + 16, 16);
+	hpsjam_recorder_put_le32(hdr + 20, 3 | (2 << 16));	/* IEEE float, stereo */
+	hpsjam_recorder_put_le32(hdr + 24, HPSJAM_SAMPLE_RATE);
+	hpsjam_recorder_put_le32(hdr + 28, HPSJAM_SAMPLE_RATE * 8);
+	hpsjam_recorder_put_le32(hdr + 32, 8 | (32 << 16));	/* block align, bits */
+	memcpy(hdr + 36, "data", 4);
+	hpsjam_recorder_put_le32(hdr + 40, data);
+
+	fseek(track.file, 0, SEEK_SET);
+	fwrite(hdr, sizeof(hdr), 1, track.file);
+	fseek(track.file, 0, SEEK_END);
+}
+
+static void
+hpsjam_recorder_write(struct hpsjam_record_track &track, const float *ptr, size_t num)
+{
+#if defined(__linux__)
+	const uint64_t need = HPSJAM_RECORD_HEADER + (track.samples + num) * 8;
+
+	/* preallocate disk space in large chunks, without changing the file size */
+	if (need > track.allocated) {
+		fflush(track.file);
+		if (fallocate(fileno(track.file), FALLOC_FL_KEEP_SIZE,
+		    track.allocated, HPSJAM_RECORD_PREALLOC) == 0)
+			track.allocated += HPSJAM_RECORD_PREALLOC;
+		else
+			track.allocated = -1ULL;
+	}
+#endif
+	fwrite(ptr, sizeof(float) * 2, num, track.file);
+	track.samples += num;
+}
+
+static bool
+hpsjam_recorder_open(struct hpsjam_record_track &track, unsigned index)
+{
+	static const float zero[HPSJAM_SAMPLE_RATE / 10][2] = {};
+	char fname[1024];
+
+	if (index < HPSJAM_PEERS_MAX) {
+		snprintf(fname, sizeof(fname), "%s/%s-track-%03u.wav",
+		    hpsjam_record_dir, hpsjam_record_prefix, index);
+	} else {
+		snprintf(fname, sizeof(fname), "%s/%s-master-room-%03u.wav",
+		    hpsjam_record_dir, hpsjam_record_prefix, index - HPSJAM_PEERS_MAX);
+	}
+
+	track.file = fopen(fname, "wb");
+	if (track.file == 0) {
+		warn("Cannot create recording file %s", fname);
+		return (false);
+	}
+	setvbuf(track.file, 0, _IOFBF, 1U << 20);
+
+	hpsjam_recorder_header(track);
+
+	/* align the track to the start of the recording */
+	for (uint64_t left = track.start; left != 0; ) {
+		const size_t num = (left > HPSJAM_SAMPLE_RATE / 10) ?
+		    (HPSJAM_SAMPLE_RATE / 10) : left;
+		hpsjam_recorder_write(track, zero[0], num);
+		left -= num;
+	}
+	return (true);
+}
+
+/* let the writer run only when the CPU is otherwise idle */
+static void
+hpsjam_recorder_set_priority()
+{
+#ifndef _WIN32
+#if defined(SCHED_IDLE)
+	struct sched_param param;
+
+	memset(&param, 0, sizeof(param));
+	if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) == 0)
+		return;
+#endif
+#if defined(__linux__)
+	/* the nice value is per thread on Linux */
+	if (setpriority(PRIO_PROCESS, 0, 19) != 0)
+		warn("Cannot lower the priority of the recorder thread");
+#else
+	struct sched_param param_min;
+	int policy;
+
+	pthread_getschedparam(pthread_self(), &policy, &param_min);
+	param_min.sched_priority = sched_get_priority_min(policy);
+	pthread_setschedparam(pthread_self(), policy, &param_min);
+#endif
+#endif
+}
+
+static void *
+hpsjam_recorder_loop(void *)
+{
+	unsigned count = 0;
+
+	hpsjam_recorder_set_priority();
+
+	while (1) {
+		usleep(HPSJAM_RECORD_PERIOD);
+
+		/* update the file headers about once per second */
+		const bool update = ((++count % (1000000 / HPSJAM_RECORD_PERIOD)) == 0);
+
+		for (unsigned x = 0; x != HPSJAM_RECORD_TRACKS; x++) {
+			struct hpsjam_record_track *ptr = hpsjam_record_tracks[x];
+
+			if (ptr == 0 || ptr->failed ||
+			    ptr->active.load(std::memory_order_acquire) == false)
+				continue;
+			if (ptr->file == 0 && hpsjam_recorder_open(*ptr, x) == false) {
+				ptr->failed = true;
+				continue;
+			}
+
+			const size_t prod = ptr->producer.load(std::memory_order_acquire);
+			size_t cons = ptr->consumer.load(std::memory_order_relaxed);
+
+			while (cons != prod) {
+				const size_t off = cons % HPSJAM_RECORD_RING;
+				size_t num = HPSJAM_RECORD_RING - off;
+
+				if (num > prod - cons)
+					num = prod - cons;
+				hpsjam_recorder_write(*ptr, ptr->ring[off], num);
+				cons += num;
+			}
+			ptr->consumer.store(cons, std::memory_order_release);
+
+			if (update)
+				hpsjam_recorder_header(*ptr);
+		}
+	}
+	return (0);
+}
+
+Q_DECL_EXPORT void
+hpsjam_recorder_init()
+{
+	pthread_t pt;
+	time_t now;
+	int ret;
+
+	if (hpsjam_record_dir == 0)
+		return;
+
+	now = time(0);
+	strftime(hpsjam_record_prefix, sizeof(hpsjam_record_prefix),
+	    "hpsjam-%Y%m%d-%H%M%S", localtime(&now));
+
+	/*
+	 * Allocate the tracks of all peer slots and configured rooms
+	 * up front, so that the tick thread never allocates memory:
+	 */
+	for (unsigned x = 0; x != hpsjam_num_server_peers; x++)
+		hpsjam_record_tracks[x] = new struct hpsjam_record_track();
+	for (unsigned x = 0; x != HPSJAM_ROOMS_MAX; x++) {
+		if (hpsjam_rooms[x].valid == false)
+			continue;
+		hpsjam_record_tracks[HPSJAM_PEERS_MAX + x] = new struct hpsjam_record_track();
+	}
+
+	ret = pthread_create(&pt, 0, &hpsjam_recorder_loop, 0);
+	assert(ret == 0);
+}
+
+/*
+ * Push audio to a track from the tick thread. If the left channel is
+ * NULL, silence is pushed to active tracks only. Audio lost on
+ * overrun is replaced by silence, to keep the tracks aligned.
+ */
+Q_DECL_EXPORT void
+hpsjam_recorder_push(unsigned index, const float *left, const float *right, size_t num)
+{
+	struct hpsjam_record_track *ptr;
+
+	if (hpsjam_record_dir == 0)
+		return;
+
+	ptr = hpsjam_record_tracks[index];
+	if (ptr == 0)
+		return;
+	if (ptr->active.load(std::memory_order_relaxed) == false) {
+		if (left == 0)
+			return;
+		/* the track starts with its first audio */
+		ptr->start = hpsjam_record_position;
+		ptr->active.store(true, std::memory_order_release);
+	}
+
+	size_t prod = ptr->producer.load(std::memory_order_relaxed);
+	const size_t cons = ptr->consumer.load(std::memory_order_acquire);
+	size_t space = HPSJAM_RECORD_RING - (prod - cons);
+
+	/* fill in lost audio first */
+	for (; ptr->gap != 0 && space != 0; ptr->gap--, space--, prod++) {
+		ptr->ring[prod % HPSJAM_RECORD_RING][0] = 0.0f;
+		ptr->ring[prod % HPSJAM_RECORD_RING][1] = 0.0f;
+	}
+
+	if (ptr->gap != 0 || num > space) {
+		ptr->gap += num;
+	} else {
+		for (size_t x = 0; x != num; x++, prod++) {
+			ptr->ring[prod % HPSJAM_RECORD_RING][0] = left ? left[x] : 0.0f;
+			ptr->ring[prod % HPSJAM_RECORD_RING][1] = left ? right[x] : 0.0f;
+		}
+	}
+	ptr->producer.store(prod, std::memory_order_release);
+}
+
+/* advance the recording position, once per tick */
+Q_DECL_EXPORT void
+hpsjam_recorder_tick(size_t num)
+{
+	hpsjam_record_position += num;
+}
@@ -0,0 +1,1447 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsjam.h"
+#include "server.h"
+#include "transport.h"
+#include "timer.h"
+#include "recorder.h"
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+struct hpsjam_server_mix hpsjam_server_mix;
+
+static size_t
+hpsjam_cache_align(size_t size)
+{
+	return ((size + HPSJAM_CACHE_LINE - 1) & ~(size_t)(HPSJAM_CACHE_LINE - 1));
+}
+
+/*
+ * Allocate the mixing state of the given number of peers as one
+ * zeroed block, with each array starting on a cache line.
+ */
+void
+hpsjam_server_mix_alloc(unsigned num)
+{
+	struct hpsjam_server_mix &mix = hpsjam_server_mix;
+	const size_t stride = hpsjam_cache_align(num);
+	const size_t audio = hpsjam_cache_align(sizeof(float[2][64]) * num);
+	const size_t matrix = hpsjam_cache_align(stride * num);
+	const size_t array = hpsjam_cache_align(num);
+	const size_t size = 2 * audio + matrix + matrix * sizeof(bool) +
+	    array * sizeof(bool) + array;
+	uint8_t *ptr = new uint8_t [size + HPSJAM_CACHE_LINE];
+
+	memset(ptr, 0, size + HPSJAM_CACHE_LINE);
+
+	/* align start of block */
+	ptr += hpsjam_cache_align((uintptr_t)ptr) - (uintptr_t)ptr;
+
+	mix.tmp_audio = (float (*)[2][64])ptr;
+	ptr += audio;
+	mix.out_audio = (float (*)[2][64])ptr;
+	ptr += audio;
+	mix.bits = ptr;
+	ptr += matrix;
+	mix.direct = (bool *)ptr;
+	ptr += matrix * sizeof(bool);
+	mix.valid = (bool *)ptr;
+	ptr += array * sizeof(bool);
+	mix.room = ptr;
+	mix.stride = stride;
+}
+
+/*
+ * Truncate a UTF-8 string to the given number of characters.
+ */
+static void
+hpsjam_utf8_truncate(std::string &str, size_t max)
+{
+	for (size_t x = 0; x != str.length(); x++) {
+		/* skip continuation bytes */
+		if ((str[x] & 0xC0) == 0x80)
+			continue;
+		if (max-- == 0) {
+			str.resize(x);
+			break;
+		}
+	}
+}
+
+
+/*
+ * Tell a peer to peer capable client and the other peer to peer
+ * capable clients in the same room about each others addresses, as
+ * observed by the server.
+ */
+static void
+hpsjam_server_rendezvous(unsigned index)
+{
+	class hpsjam_server_peer &peer = hpsjam_server_peers[index];
+	struct hpsjam_packet_entry *pkt;
+	uint8_t data[32];
+	size_t len;
+
+	std::unique_lock<std::mutex> locker(peer.lock);
+	if (peer.valid == false || peer.p2p == false)
+		return;
+	const uint8_t room = peer.room;
+	const size_t peer_len = peer.address.toBytes(data);
+	locker.unlock();
+
+	for (unsigned x = 0; x != hpsjam_num_server_peers; x++) {
+		if (x == index)
+			continue;
+
+		class hpsjam_server_peer &other = hpsjam_server_peers[x];
+		std::unique_lock<std::mutex> other_locker(other.lock);
+
+		if (other.valid == false || other.p2p == false || other.room != room)
+			continue;
+
+		/* tell other peer about new peer */
+		pkt = new struct hpsjam_packet_entry;
+		pkt->packet.setFaderData(0, index, (const char *)data, peer_len);
+		pkt->packet.type = HPSJAM_TYPE_PEER_ADDRESS_REPLY;
+		pkt->insert_tail(&other.output_pkt.head);
+
+		/* tell new peer about other peer */
+		uint8_t other_data[32];
+		len = other.address.toBytes(other_data);
+		other_locker.unlock();
+
+		pkt = new struct hpsjam_packet_entry;
+		pkt->packet.setFaderData(0, x, (const char *)other_data, len);
+		pkt->packet.type = HPSJAM_TYPE_PEER_ADDRESS_REPLY;
+
+		locker.lock();
+		if (peer.valid)
+			pkt->insert_tail(&peer.output_pkt.head);
+		else
+			delete pkt;
+		locker.unlock();
+	}
+}
+
+Q_DECL_EXPORT void
+hpsjam_server_receive(const struct hpsjam_socket_address &src,
+    const union hpsjam_frame &frame, size_t len)
+{
+	const struct hpsjam_packet *ptr;
+
+	for (unsigned x = hpsjam_num_server_peers; x--; ) {
+		class hpsjam_server_peer &peer = hpsjam_server_peers[x];
+
+		std::unique_lock<std::mutex> locker(peer.lock);
+
+		if (peer.valid && (peer.address == src ||
+		    (peer.alt_address.valid() && peer.alt_address == src))) {
+			peer.input_pkt.receive(frame, len);
+			return;
+		}
+	}
+
+	for (unsigned x = hpsjam_num_server_listeners; x--; ) {
+		class hpsjam_server_listener &listener = hpsjam_server_listeners[x];
+
+		std::unique_lock<std::mutex> locker(listener.lock);
+
+		if (listener.valid && listener.address == src) {
+			listener.input_pkt.receive(frame, len);
+			return;
+		}
+	}
+
+	/*
+	 * All new connections must start on a ping request
+	 * having sequence number zero:
+	 */
+	for (ptr = frame.start; ptr->valid(frame.end); ptr = ptr->next()) {
+		if (ptr->type == HPSJAM_TYPE_PING_REQUEST &&
+		    ptr->sequence[0] == 0 && ptr->sequence[1] == 0)
+			break;
+	}
+
+	/* check if we have a valid chunk */
+	if (ptr->valid(frame.end) == false)
+		return;
+
+	uint16_t packets;
+	uint16_t time_ms;
+	uint64_t passwd;
+	uint64_t token;
+
+	/* check if ping message is valid */
+	if (ptr->getPing(packets, time_ms, passwd) == false)
+		return;
+
+	/* a second path must present the token of the first path */
+	if (ptr->getPingToken(token) == false)
+		packets &= ~HPSJAM_PING_MULTIPATH;
+
+	const uint8_t room = packets & HPSJAM_PING_ROOM_MASK;
+
+	/* check if room exists */
+	if (hpsjam_rooms[room].valid == false)
+		return;
+
+	/* don't respond if password is invalid */
+	if (hpsjam_rooms[room].passwd != 0 && passwd != hpsjam_rooms[room].passwd) {
+		if (hpsjam_mixer_passwd == 0 || passwd != hpsjam_mixer_passwd)
+			return;
+	}
+
+	/* check for the second path of an existing peer, if any */
+	if (packets & HPSJAM_PING_MULTIPATH) {
+		for (unsigned x = hpsjam_num_server_peers; x--; ) {
+			class hpsjam_server_peer &peer = hpsjam_server_peers[x];
+			std::unique_lock<std::mutex> locker(peer.lock);
+
+			if (peer.valid == false || peer.multipath == false ||
+			    peer.alt_address.valid() || peer.room != room ||
+			    peer.multipath_token != token)
+				continue;
+
+			peer.alt_address = src;
+			peer.input_pkt.receive(frame, len);
+			return;
+		}
+	}
+
+	/* create new listener, if any */
+	if (packets & HPSJAM_PING_LISTENER) {
+		for (unsigned x = hpsjam_num_server_listeners; x--; ) {
+			class hpsjam_server_listener &listener = hpsjam_server_listeners[x];
+			std::unique_lock<std::mutex> locker(listener.lock);
+
+			if (listener.valid == true)
+				continue;
+
+			listener.room = room;
+			listener.synced = false;
+			listener.valid = true;
+			listener.address = src;
+			listener.input_pkt.receive(frame, len);
+			return;
+		}
+		return;
+	}
+
+	/* create new connection, if any */
+	for (unsigned x = hpsjam_num_server_peers; x--; ) {
+		class hpsjam_server_peer &peer = hpsjam_server_peers[x];
+		std::unique_lock<std::mutex> peer_locker(peer.lock);
+
+		if (peer.valid == true)
+			continue;
+
+		peer.trunk = (packets & HPSJAM_PING_TRUNK) != 0;
+		peer.p2p = (packets & HPSJAM_PING_P2P) != 0 && peer.trunk == false;
+		peer.allow_mixer_access = (peer.trunk == false) &&
+		    (hpsjam_mixer_passwd == 0 || hpsjam_mixer_passwd == passwd);
+		peer.multipath = (packets & HPSJAM_PING_MULTIPATH) != 0;
+		peer.multipath_token = peer.multipath ? token : 0;
+		peer.room = room;
+		peer.valid = true;
+		peer.address = src;
+		peer.input_pkt.receive(frame, len);
+		if (peer.trunk == false)
+			peer.send_welcome_message();
+
+		/* drop lock */
+		peer_locker.unlock();
+
+		/* reset bits for this client */
+		for (unsigned y = hpsjam_num_server_peers; y--; ) {
+			class hpsjam_server_peer &other = hpsjam_server_peers[y];
+			std::unique_lock<std::mutex> other_locker(other.lock);
+			other.mixBits()[x] = 0;
+			other.mixDirect()[x] = false;
+		}
+
+		/* exchange addresses for direct audio, if any */
+		hpsjam_server_rendezvous(x);
+		return;
+	}
+}
+
+/*
+ * Broadcast a packet to all peers in a room. A negative room selects
+ * all rooms. By default the room of the excepted peer is used. Trunk
+ * links only carry audio and are skipped.
+ */
+static void
+hpsjam_server_broadcast(const struct hpsjam_packet_entry &entry,
+    class hpsjam_server_peer *except = 0, bool single = false, int room = -1)
+{
+	struct hpsjam_packet_entry *ptr;
+
+	if (room < 0 && except != 0)
+		room = except->room;
+
+	for (unsigned x = 0; x != hpsjam_num_server_peers; x++) {
+		if (hpsjam_server_peers + x == except)
+			continue;
+
+		class hpsjam_server_peer &peer = hpsjam_server_peers[x];
+		std::unique_lock<std::mutex> locker(peer.lock);
+
+		if (peer.valid == false || peer.trunk == true)
+			continue;
+		if (room > -1 && peer.room != room)
+			continue;
+
+		/* check if a level packet is already pending */
+		if (single && peer.output_pkt.find(entry.packet.type))
+			continue;
+		/* duplicate packet */
+		ptr = new struct hpsjam_packet_entry;
+		*ptr = entry;
+		ptr->insert_tail(&peer.output_pkt.head);
+	}
+}
+
+size_t
+hpsjam_server_peer :: serverID()
+{
+	return (this - hpsjam_server_peers);
+}
+
+/*
+ * Handle the events of the output packetizer, after the peer lock
+ * has been dropped.
+ */
+void
+hpsjam_server_peer :: handle_events()
+{
+	std::unique_lock<std::mutex> locker(lock);
+	const uint8_t events = output_pkt.getEvents();
+	locker.unlock();
+
+	if (events & HPSJAM_OUTPUT_WATCHDOG)
+		handle_pending_watchdog();
+	if (events & HPSJAM_OUTPUT_TIMEOUT)
+		handle_pending_timeout();
+}
+
+void
+hpsjam_server_peer :: handle_pending_watchdog()
+{
+	std::unique_lock<std::mutex> locker(lock);
+
+	if (address.valid() && output_pkt.empty()) {
+		struct hpsjam_packet_entry *pkt = new struct hpsjam_packet_entry;
+		pkt->packet.setPing(0, hpsjam_ticks, 0);
+		pkt->packet.type = HPSJAM_TYPE_PING_REQUEST;
+		pkt->insert_tail(&output_pkt.head);
+	}
+}
+
+void
+hpsjam_server_peer :: handle_pending_timeout()
+{
+	struct hpsjam_packet_entry *pkt;
+
+	std::unique_lock<std::mutex> locker(lock);
+	const uint8_t old_room = room;
+	init();
+	mix_clear();
+	/* outgoing trunk links reconnect forever */
+	trunk_connect();
+	const std::string t = name;
+	locker.unlock();
+
+	/* tell other clients in the same room about disconnect */
+	pkt = new struct hpsjam_packet_entry;
+	pkt->packet.setFaderData(0, serverID(), 0, 0);
+	pkt->packet.type = HPSJAM_TYPE_FADER_DISCONNECT_REPLY;
+	hpsjam_server_broadcast(*pkt, this, false, old_room);
+
+	/* tell other clients in the same room about the new trunk */
+	if (t.length() != 0) {
+		pkt->packet.setFaderData(0, serverID(), t.data(), t.length());
+		pkt->packet.type = HPSJAM_TYPE_FADER_NAME_REPLY;
+		hpsjam_server_broadcast(*pkt, this, false, old_room);
+	}
+	delete pkt;
+}
+
+/*
+ * Connect an outgoing trunk link to another server, if any. The
+ * other server sees the trunk as a peer in its default room and
+ * sends back the sum of all its other peers. This server does the
+ * same in the opposite direction. The peer lock must be held.
+ */
+void
+hpsjam_server_peer :: trunk_connect()
+{
+	struct hpsjam_packet_entry *pkt;
+
+	if (trunk_address.valid() == false)
+		return;
+
+	address = trunk_address;
+	output_fmt = HPSJAM_TRUNK_FORMAT;
+	name = "[trunk]";
+	room = 0;
+	trunk = true;
+	valid = true;
+
+	/* send initial ping */
+	pkt = new struct hpsjam_packet_entry;
+	pkt->packet.setPing(HPSJAM_PING_TRUNK | room, hpsjam_ticks,
+	    hpsjam_rooms[room].passwd);
+	pkt->packet.type = HPSJAM_TYPE_PING_REQUEST;
+	pkt->insert_tail(&output_pkt.head);
+
+	/* send initial configuration */
+	pkt = new struct hpsjam_packet_entry;
+	pkt->packet.setConfigure(HPSJAM_TRUNK_FORMAT, HPSJAM_JITTER_TARGET_DEFAULT);
+	pkt->packet.type = HPSJAM_TYPE_CONFIGURE_REQUEST;
+	pkt->insert_tail(&output_pkt.head);
+
+	/* send name */
+	pkt = new struct hpsjam_packet_entry;
+	pkt->packet.setRawData(name.data(), name.length());
+	pkt->packet.type = HPSJAM_TYPE_NAME_REQUEST;
+	pkt->insert_tail(&output_pkt.head);
+}
+
+void
+hpsjam_server_peer :: audio_export()
+{
+	const union hpsjam_frame *pkt;
+	const struct hpsjam_packet *ptr;
+	struct hpsjam_packet_entry *pres;
+	float temp[HPSJAM_MAX_PKT];
+	uint16_t jitter;
+	size_t num;
+
+	std::unique_lock<std::mutex> locker(lock);
+
+	const size_t id = serverID();
+
+	/* snapshot the state used by the mixing loops */
+	hpsjam_server_mix.valid[id] = valid;
+	hpsjam_server_mix.room[id] = room;
+
+	if (valid == false) {
+		memset(tmpAudio(), 0, sizeof(tmpAudio()));
+		return;
+	}
+
+	/* forget the uplink audio of the previous tick */
+	sfu_clear(&sfu_recv);
+
+	input_pkt.recovery();
+
+	/* update jitter */
+	jitter = input_pkt.get_jitter_limit_in_ms();
+	in_audio[0].set_jitter_limit_in_ms(jitter);
+	in_audio[1].set_jitter_limit_in_ms(jitter);
+
+	while ((pkt = input_pkt.first_pkt())) {
+		for (ptr = pkt->start; ptr->valid(pkt->end); ptr = ptr->next()) {
+			/*
+			 * Keep a copy of the uplink audio for forwarding.
+			 * Lost audio is not forwarded, so that the clients
+			 * conceal it instead of playing silence.
+			 */
+			if (hpsjam_server_sfu && input_pkt.lost == false &&
+			    ((ptr->type >= HPSJAM_TYPE_AUDIO_8_BIT_1CH &&
+			      ptr->type <= HPSJAM_TYPE_AUDIO_32_BIT_2CH) ||
+			     ptr->type == HPSJAM_TYPE_AUDIO_SILENCE)) {
+				pres = new struct hpsjam_packet_entry;
+				memcpy(pres->raw, ptr, ptr->getBytes());
+				if (ptr->type == HPSJAM_TYPE_AUDIO_SILENCE)
+					pres->packet.type = HPSJAM_TYPE_AUDIO_SFU;
+				else
+					pres->packet.type += HPSJAM_TYPE_AUDIO_SFU;
+				pres->packet.setPeerSeqNo(serverID());
+				pres->insert_tail(&sfu_recv);
+			}
+			/* check for unsequenced packets */
+			if (HpsJamReceiveUnSequenced
+			    <class hpsjam_server_peer>(*this, ptr, temp))
+				continue;
+			/* check if other side received packet */
+			if (ptr->getPeerSeqNo() == output_pkt.pend_seqno)
+				output_pkt.advance();
+			/* check if sequence number matches */
+			if (ptr->getLocalSeqNo() != output_pkt.peer_seqno)
+				continue;
+			/* advance expected sequence number */
+			output_pkt.peer_seqno++;
+			output_pkt.send_ack = true;
+			/*
+			 * Only the initial ping is sent on both paths
+			 * before the first reply. Don't attach a second
+			 * path after further control traffic.
+			 */
+			if (output_pkt.peer_seqno > 1)
+				multipath = false;
+
+			switch (ptr->type) {
+			uint16_t packets;
+			uint16_t time_ms;
+			uint64_t passwd;
+			uint8_t mix;
+			uint8_t index;
+			uint8_t target;
+			const char *data;
+			size_t len;
+
+			case HPSJAM_TYPE_CONFIGURE_REQUEST:
+				if (ptr->getConfigure(output_fmt, target)) {
+					input_pkt.jitter.setTarget(target);
+					break;
+				}
+				output_fmt = HPSJAM_TYPE_AUDIO_SILENCE;
+				break;
+			case HPSJAM_TYPE_PING_REQUEST:
+				if (ptr->getPing(packets, time_ms, passwd) &&
+				    output_pkt.find(HPSJAM_TYPE_PING_REPLY) == 0) {
+					pres = new struct hpsjam_packet_entry;
+					pres->packet.setPing(0, time_ms, 0);
+					pres->packet.type = HPSJAM_TYPE_PING_REPLY;
+					pres->insert_tail(&output_pkt.head);
+				}
+				break;
+			case HPSJAM_TYPE_ICON_REQUEST:
+				if (ptr->getRawData(&data, len)) {
+					/* prepend username */
+					icon.assign(data, len);
+
+					pres = new struct hpsjam_packet_entry;
+					pres->packet.setFaderData(0, serverID(), icon.data(), icon.length());
+					pres->packet.type = HPSJAM_TYPE_FADER_ICON_REPLY;
+					pres->insert_tail(&output_pkt.head);
+					hpsjam_server_broadcast(*pres, this);
+
+					/* tell this client about other icons */
+					for (unsigned x = 0; x != hpsjam_num_server_peers; x++) {
+						if (hpsjam_server_peers + x == this)
+							continue;
+						class hpsjam_server_peer &peer = hpsjam_server_peers[x];
+						std::unique_lock<std::mutex> locker(peer.lock);
+						if (peer.valid == false || peer.room != room)
+							continue;
+						const std::string &t = peer.icon;
+						pres = new struct hpsjam_packet_entry;
+						pres->packet.setFaderData(0, x, t.data(), t.length());
+						pres->packet.type = HPSJAM_TYPE_FADER_ICON_REPLY;
+						pres->insert_tail(&output_pkt.head);
+					}
+				}
+				break;
+			case HPSJAM_TYPE_NAME_REQUEST:
+				if (ptr->getRawData(&data, len)) {
+					/* prepend username */
+					name.assign(data, len);
+
+					pres = new struct hpsjam_packet_entry;
+					pres->packet.setFaderData(0, serverID(), name.data(), name.length());
+					pres->packet.type = HPSJAM_TYPE_FADER_NAME_REPLY;
+					pres->insert_tail(&output_pkt.head);
+					hpsjam_server_broadcast(*pres, this);
+
+					/* tell this client about other names */
+					for (unsigned x = 0; x != hpsjam_num_server_peers; x++) {
+						if (hpsjam_server_peers + x == this)
+							continue;
+						class hpsjam_server_peer &peer = hpsjam_server_peers[x];
+						std::unique_lock<std::mutex> locker(peer.lock);
+						if (peer.valid == false || peer.room != room)
+							continue;
+						const std::string &t = peer.name;
+						pres = new struct hpsjam_packet_entry;
+						pres->packet.setFaderData(0, x, t.data(), t.length());
+						pres->packet.type = HPSJAM_TYPE_FADER_NAME_REPLY;
+						pres->insert_tail(&output_pkt.head);
+					}
+				}
+				break;
+			case HPSJAM_TYPE_LYRICS_REQUEST:
+				pres = new struct hpsjam_packet_entry;
+				if (ptr->getRawData(&data, len)) {
+					/* echo back lyrics */
+					pres = new struct hpsjam_packet_entry;
+					pres->packet.setRawData(data, len);
+					pres->packet.type = HPSJAM_TYPE_LYRICS_REPLY;
+					pres->insert_tail(&output_pkt.head);
+					hpsjam_server_broadcast(*pres, this);
+				}
+				break;
+			case HPSJAM_TYPE_CHAT_REQUEST:
+				if (ptr->getRawData(&data, len)) {
+					/* prepend username */
+					std::string t = "[" + name + "]: ";
+					t.append(data, len);
+					hpsjam_utf8_truncate(t, 128 + 32 + 4);
+
+					/* echo back text */
+					pres = new struct hpsjam_packet_entry;
+					pres->packet.setRawData(t.data(), t.length());
+					pres->packet.type = HPSJAM_TYPE_CHAT_REPLY;
+					pres->insert_tail(&output_pkt.head);
+					hpsjam_server_broadcast(*pres, this);
+				}
+				break;
+			case HPSJAM_TYPE_FADER_GAIN_REQUEST:
+				if (allow_mixer_access == false)
+					break;
+				if (ptr->getFaderValue(mix, index, temp, num)) {
+					assert(num <= HPSJAM_MAX_PKT);
+					if (mix != 0 || num <= 0)
+						break;
+					if (index + num > hpsjam_num_server_peers)
+						break;
+
+					/* echo gain */
+					pres = new struct hpsjam_packet_entry;
+					pres->packet.setFaderValue(mix, index, temp, num);
+					pres->packet.type = HPSJAM_TYPE_FADER_GAIN_REPLY;
+					hpsjam_server_broadcast(*pres, this);
+					delete pres;
+
+					/* local gain */
+					for (size_t x = 0; x != num; x++) {
+						pres = new struct hpsjam_packet_entry;
+						pres->packet.setFaderValue(0, 0, temp + x, 1);
+						pres->packet.type = HPSJAM_TYPE_LOCAL_GAIN_REPLY;
+
+						if (index + x == serverID()) {
+							pres->insert_tail(&output_pkt.head);
+						} else {
+							class hpsjam_server_peer &peer = hpsjam_server_peers[index + x];
+							std::unique_lock<std::mutex> other(peer.lock);
+							/* only control peers in the same room */
+							if (peer.room == room)
+								pres->insert_tail(&peer.output_pkt.head);
+							else
+								delete pres;
+						}
+					}
+				}
+				break;
+			case HPSJAM_TYPE_FADER_PAN_REQUEST:
+				if (allow_mixer_access == false)
+					break;
+				if (ptr->getFaderValue(mix, index, temp, num)) {
+					assert(num <= HPSJAM_MAX_PKT);
+					if (mix != 0 || num <= 0)
+						break;
+					if (index + num > hpsjam_num_server_peers)
+						break;
+
+					/* echo pan */
+					pres = new struct hpsjam_packet_entry;
+					pres->packet.setFaderValue(mix, index, temp, num);
+					pres->packet.type = HPSJAM_TYPE_FADER_PAN_REPLY;
+					hpsjam_server_broadcast(*pres, this);
+					delete pres;
+
+					/* local pan */
+					for (size_t x = 0; x != num; x++) {
+						pres = new struct hpsjam_packet_entry;
+						pres->packet.setFaderValue(0, 0, temp + x, 1);
+						pres->packet.type = HPSJAM_TYPE_LOCAL_PAN_REPLY;
+
+						if (index + x == serverID()) {
+							pres->insert_tail(&output_pkt.head);
+						} else {
+							class hpsjam_server_peer &peer = hpsjam_server_peers[index + x];
+							std::unique_lock<std::mutex> other(peer.lock);
+							/* only control peers in the same room */
+							if (peer.room == room)
+								pres->insert_tail(&peer.output_pkt.head);
+							else
+								delete pres;
+						}
+					}
+				}
+				break;
+			case HPSJAM_TYPE_FADER_EQ_REQUEST:
+				if (allow_mixer_access == false)
+					break;
+				if (ptr->getFaderData(mix, index, &data, num)) {
+					if (mix != 0 || num <= 0)
+						break;
+					if (index >= hpsjam_num_server_peers)
+						break;
+
+					/* echo EQ */
+					pres = new struct hpsjam_packet_entry;
+					pres->packet.setFaderData(mix, index, data, num);
+					pres->packet.type = HPSJAM_TYPE_FADER_EQ_REPLY;
+					hpsjam_server_broadcast(*pres, this);
+
+					pres->packet.setFaderData(0, 0, data, num);
+					pres->packet.type = HPSJAM_TYPE_LOCAL_EQ_REPLY;
+
+					/* local EQ */
+					if (index == serverID()) {
+						pres->insert_tail(&output_pkt.head);
+					} else {
+						class hpsjam_server_peer &peer = hpsjam_server_peers[index];
+						std::unique_lock<std::mutex> other(peer.lock);
+						/* only control peers in the same room */
+						if (peer.room == room)
+							pres->insert_tail(&peer.output_pkt.head);
+						else
+							delete pres;
+					}
+				}
+				break;
+
+			case HPSJAM_TYPE_FADER_BITS_REQUEST:
+				if (ptr->getFaderData(mix, index, &data, num)) {
+					if (mix != 0 || num <= 0)
+						break;
+					if (index + num > hpsjam_num_server_peers)
+						break;
+					/* copy bits in place */
+					memcpy(mixBits() + index, data, num);
+				}
+				break;
+			case HPSJAM_TYPE_DIRECT_REQUEST:
+				if (ptr->getFaderData(mix, index, &data, num)) {
+					if (mix != 0 || num <= 0)
+						break;
+					if (index + num > hpsjam_num_server_peers)
+						break;
+					/* peers received directly are not mixed */
+					for (size_t x = 0; x != num; x++)
+						mixDirect()[index + x] = (data[x] != 0);
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	/* send a ping, if idle */
+	if (output_pkt.empty()) {
+		pres = new struct hpsjam_packet_entry;
+		pres->packet.setPing(0, hpsjam_ticks, 0);
+		pres->packet.type = HPSJAM_TYPE_PING_REQUEST;
+		pres->insert_tail(&output_pkt.head);
+	}
+
+	/* track the clock of this peer, targeting the jitter limit */
+	drift.update(in_audio[0].total, in_audio[0].limit * HPSJAM_DEF_SAMPLES);
+
+	/* extract samples for this tick */
+	float (&tmp_audio)[2][64] = tmpAudio();
+	in_audio[0].remSamplesDrift(tmp_audio[0], HPSJAM_DEF_SAMPLES, drift);
+	in_audio[1].remSamplesDrift(tmp_audio[1], HPSJAM_DEF_SAMPLES, drift);
+	drift.advance(HPSJAM_DEF_SAMPLES);
+
+	/* clear output audio */
+	memset(outAudio(), 0, sizeof(outAudio()));
+}
+
+void
+hpsjam_server_peer :: audio_import()
+{
+	std::unique_lock<std::mutex> locker(lock);
+
+	if (valid == false)
+		return;
+
+	/* forward audio, if any */
+	if (hpsjam_server_sfu && trunk == false) {
+		send_forward();
+		return;
+	}
+
+	/* process output audio */
+	float (&out_audio)[2][64] = outAudio();
+	HpsJamProcessOutputAudio
+	    <class hpsjam_server_peer>(*this, out_audio[0], out_audio[1]);
+
+	/* send a packet */
+	HpsJamSendPacket
+	    <class hpsjam_server_peer>(*this);
+}
+
+void
+hpsjam_server_peer :: send_welcome_message()
+{
+	const char *fname = hpsjam_rooms[room].welcome_message_file;
+
+	if (fname == 0)
+		return;
+
+	FILE *fp = fopen(fname, "r");
+	char line[1024];
+	bool more = false;
+
+	if (fp == 0)
+		return;
+
+	while (fgets(line, sizeof(line), fp) != 0) {
+		size_t len = strlen(line);
+		const bool skip = more;
+
+		/* check for end of line */
+		more = (len == 0 || line[len - 1] != '\n');
+		while (len != 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+
+		/* skip the remainder of long lines */
+		if (skip)
+			continue;
+
+		std::string t(line, len);
+		hpsjam_utf8_truncate(t, 128);
+
+		struct hpsjam_packet_entry *pres = new struct hpsjam_packet_entry;
+		pres->packet.setRawData(t.data(), t.length());
+		pres->packet.type = HPSJAM_TYPE_CHAT_REPLY;
+		pres->insert_tail(&output_pkt.head);
+	}
+	fclose(fp);
+}
+
+static void
+hpsjam_send_levels()
+{
+	constexpr size_t maxLevel = 32;
+	static unsigned group;
+	struct hpsjam_packet_entry entry;
+	float level[maxLevel][2];
+	float temp[maxLevel][2];
+	int room[maxLevel];
+
+	if (hpsjam_ticks % 128)
+		return;
+
+	for (unsigned x = 0; x != maxLevel; x++) {
+		unsigned index = x + group * maxLevel;
+
+		level[x][0] = 0.0f;
+		level[x][1] = 0.0f;
+		room[x] = -1;
+
+		if (index >= hpsjam_num_server_peers)
+			continue;
+
+		std::unique_lock<std::mutex> locker(hpsjam_server_peers[index].lock);
+		if (hpsjam_server_peers[index].valid) {
+			level[x][0] = hpsjam_server_peers[index].in_level[0].getLevel();
+			level[x][1] = hpsjam_server_peers[index].in_level[1].getLevel();
+			room[x] = hpsjam_server_peers[index].room;
+		}
+	}
+
+	/* send levels to each room present in this group */
+	for (unsigned x = 0; x != maxLevel; x++) {
+		const int r = room[x];
+
+		if (r < 0)
+			continue;
+		for (unsigned y = 0; y != maxLevel; y++) {
+			if (room[y] == r) {
+				temp[y][0] = level[y][0];
+				temp[y][1] = level[y][1];
+				room[y] = -1;
+			} else {
+				temp[y][0] = 0.0f;
+				temp[y][1] = 0.0f;
+			}
+		}
+		entry.packet.setFaderValue(0, group * maxLevel, temp[0], 2 * maxLevel);
+		entry.packet.type = HPSJAM_TYPE_FADER_LEVEL_REPLY;
+		hpsjam_server_broadcast(entry, 0, true, r);
+	}
+
+	/* advance to next group */
+	group++;
+	if ((group * maxLevel) >= hpsjam_num_server_peers)
+		group = 0;
+}
+
+/*
+ * Send the round trip times of the peer to peer capable clients to
+ * the other clients in the same room, so that they can compare their
+ * direct paths against the full path through the server.
+ */
+static void
+hpsjam_send_rtts()
+{
+	constexpr size_t maxRtt = 32;
+	static unsigned group;
+	struct hpsjam_packet_entry entry;
+	char rtt[maxRtt];
+	char temp[maxRtt];
+	int room[maxRtt];
+
+	if ((hpsjam_ticks % 128) != 64)
+		return;
+
+	for (unsigned x = 0; x != maxRtt; x++) {
+		unsigned index = x + group * maxRtt;
+
+		rtt[x] = 0;
+		room[x] = -1;
+
+		if (index >= hpsjam_num_server_peers)
+			continue;
+
+		std::unique_lock<std::mutex> locker(hpsjam_server_peers[index].lock);
+		if (hpsjam_server_peers[index].valid && hpsjam_server_peers[index].p2p) {
+			const uint16_t value = hpsjam_server_peers[index].output_pkt.ping_time;
+			/* zero means unknown */
+			rtt[x] = (value > 255) ? 255 : (value < 1) ? 1 : value;
+			room[x] = hpsjam_server_peers[index].room;
+		}
+	}
+
+	/* send round trip times to each room present in this group */
+	for (unsigned x = 0; x != maxRtt; x++) {
+		const int r = room[x];
+
+		if (r < 0)
+			continue;
+		for (unsigned y = 0; y != maxRtt; y++) {
+			if (room[y] == r) {
+				temp[y] = rtt[y];
+				room[y] = -1;
+			} else {
+				temp[y] = 0;
+			}
+		}
+		entry.packet.setFaderData(0, group * maxRtt, temp, maxRtt);
+		entry.packet.type = HPSJAM_TYPE_PEER_RTT_REPLY;
+		hpsjam_server_broadcast(entry, 0, true, r);
+	}
+
+	/* advance to next group */
+	group++;
+	if ((group * maxRtt) >= hpsjam_num_server_peers)
+		group = 0;
+}
+
+void
+hpsjam_server_peer :: audio_mixing()
+{
+	std::unique_lock<std::mutex> locker(lock);
+
+	if (valid == false)
+		return;
+
+	const struct hpsjam_server_mix &mix = hpsjam_server_mix;
+	const size_t id = serverID();
+	const uint8_t *bits = mix.bits + id * mix.stride;
+	const bool *direct = mix.direct + id * mix.stride;
+	float (&out_audio)[2][64] = mix.out_audio[id];
+
+	/*
+	 * A trunk link receives the unity gain sum of all other peers
+	 * in the room, including other trunk links. The trunk links
+	 * must therefore form a tree to avoid feedback.
+	 */
+	if (trunk) {
+		for (unsigned y = 0; y != hpsjam_num_server_peers; y++) {
+			if (y == id || mix.valid[y] == false || mix.room[y] != room)
+				continue;
+			for (unsigned z = 0; z != HPSJAM_DEF_SAMPLES; z++) {
+				out_audio[0][z] += mix.tmp_audio[y][0][z];
+				out_audio[1][z] += mix.tmp_audio[y][1][z];
+			}
+		}
+		return;
+	}
+
+	/* selective forwarding replaces mixing */
+	if (hpsjam_server_sfu) {
+		audio_forward();
+		return;
+	}
+
+	for (unsigned y = 0; y != hpsjam_num_server_peers; y++) {
+		if ((bits[y] & HPSJAM_BIT_SOLO) && mix.room[y] == room)
+			goto do_solo;
+	}
+
+	for (unsigned y = 0; y != hpsjam_num_server_peers; y++) {
+		const uint32_t gain = get_gain_from_bits(bits[y]);
+
+		if (mix.valid[y] == false || mix.room[y] != room)
+			continue;
+		if (bits[y] & HPSJAM_BIT_MUTE || direct[y])
+			continue;
+		if (bits[y] & HPSJAM_BIT_INVERT) {
+			for (unsigned z = 0; z != HPSJAM_DEF_SAMPLES; z++) {
+				out_audio[0][z] -= float_gain(mix.tmp_audio[y][0][z], gain);
+				out_audio[1][z] -= float_gain(mix.tmp_audio[y][1][z], gain);
+			}
+		} else {
+			for (unsigned z = 0; z != HPSJAM_DEF_SAMPLES; z++) {
+				out_audio[0][z] += float_gain(mix.tmp_audio[y][0][z], gain);
+				out_audio[1][z] += float_gain(mix.tmp_audio[y][1][z], gain);
+			}
+		}
+	}
+	return;
+
+do_solo:
+	for (unsigned y = 0; y != hpsjam_num_server_peers; y++) {
+		const uint32_t gain = get_gain_from_bits(bits[y]);
+
+		if (mix.valid[y] == false || mix.room[y] != room)
+			continue;
+		if (~bits[y] & HPSJAM_BIT_SOLO || direct[y])
+			continue;
+		if (bits[y] & HPSJAM_BIT_INVERT) {
+			for (unsigned z = 0; z != HPSJAM_DEF_SAMPLES; z++) {
+				out_audio[0][z] -= float_gain(mix.tmp_audio[y][0][z], gain);
+				out_audio[1][z] -= float_gain(mix.tmp_audio[y][1][z], gain);
+			}
+		} else {
+			for (unsigned z = 0; z != HPSJAM_DEF_SAMPLES; z++) {
+				out_audio[0][z] += float_gain(mix.tmp_audio[y][0][z], gain);
+				out_audio[1][z] += float_gain(mix.tmp_audio[y][1][z], gain);
+			}
+		}
+	}
+}
+
+#define	HPSJAM_SFU_QUEUE_MAX 32	/* maximum number of queued packets */
+
+/*
+ * In selective forwarding mode, the uplink audio of the other peers
+ * in the room is queued unchanged, respecting the mute and solo bits
+ * of this peer. The personal mix is computed by the client.
+ */
+void
+hpsjam_server_peer :: audio_forward()
+{
+	struct hpsjam_packet_entry *ptr;
+	struct hpsjam_packet_entry *pres;
+	const uint8_t *bits = mixBits();
+	const bool *direct = mixDirect();
+	bool solo = false;
+
+	for (unsigned y = 0; y != hpsjam_num_server_peers; y++) {
+		if ((bits[y] & HPSJAM_BIT_SOLO) &&
+		    hpsjam_server_mix.room[y] == room)
+			solo = true;
+	}
+
+	for (unsigned y = 0; y != hpsjam_num_server_peers; y++) {
+		class hpsjam_server_peer &other = hpsjam_server_peers[y];
+
+		if (&other == this || direct[y])
+			continue;
+		if (bits[y] & HPSJAM_BIT_MUTE)
+			continue;
+		if (solo && (~bits[y] & HPSJAM_BIT_SOLO))
+			continue;
+
+		std::unique_lock<std::mutex> other_locker(other.lock);
+
+		if (other.valid == false || other.room != room)
+			continue;
+
+		TAILQ_FOREACH(ptr, &other.sfu_recv, entry) {
+			pres = new struct hpsjam_packet_entry;
+			memcpy(pres->raw, ptr->raw, ptr->packet.getBytes());
+			pres->insert_tail(&sfu_send);
+			sfu_count++;
+		}
+	}
+
+	/* drop the oldest audio when the downlink cannot keep up */
+	while (sfu_count > HPSJAM_SFU_QUEUE_MAX) {
+		ptr = TAILQ_FIRST(&sfu_send);
+		ptr->remove(&sfu_send);
+		delete ptr;
+		sfu_count--;
+	}
+}
+
+void
+hpsjam_server_peer :: send_forward()
+{
+	struct hpsjam_packet_entry *ptr;
+
+	/* fill the frame, leaving room for control packets */
+	if (output_pkt.isXorFrame() == false) {
+		const size_t reserve = output_pkt.control_bytes();
+
+		while ((ptr = TAILQ_FIRST(&sfu_send)) != 0) {
+			if (output_pkt.remainder() < ptr->packet.getBytes() + reserve)
+				break;
+			output_pkt.append_pkt(*ptr);
+			ptr->remove(&sfu_send);
+			delete ptr;
+			sfu_count--;
+		}
+	}
+
+	/* send a packet */
+	output_pkt.send(address, &alt_address);
+}
+
+/*
+ * The master mix for the listeners is the sum of all peers in a
+ * room. It is computed at most once per tick and encoded at most once
+ * per tick for each audio format in use. The XOR frames of all
+ * listeners are aligned to the same sequence, so that the encoded
+ * audio can be shared. The listener packetizers use the default XOR
+ * distance, HPSJAM_XOR_DISTANCE.
+ */
+
+struct hpsjam_listener_mix {
+	class hpsjam_audio_buffer out_buffer[2];
+	struct hpsjam_stereo_limiter out_limiter;
+	struct hpsjam_packet_entry entry[HPSJAM_TYPE_AUDIO_32_BIT_2CH + 1];
+	float temp[3][HPSJAM_NOM_SAMPLES];
+	uint16_t encoded;	/* bitmask of encoded formats */
+	uint16_t ticks;		/* last tick the mix was computed */
+
+	hpsjam_listener_mix() {
+		encoded = 0;
+		ticks = hpsjam_ticks - 1;
+	};
+
+	void compute(uint8_t, bool);
+	const struct hpsjam_packet_entry &getAudio(uint8_t);
+};
+
+static struct hpsjam_listener_mix *hpsjam_listener_mixes[HPSJAM_ROOMS_MAX];
+static uint8_t hpsjam_listener_d_cur;	/* current distance between XOR frames */
+
+void
+hpsjam_listener_mix :: compute(uint8_t room, bool xor_frame)
+{
+	float mix[2][HPSJAM_DEF_SAMPLES] = {};
+
+	for (unsigned y = 0; y != hpsjam_num_server_peers; y++) {
+		if (hpsjam_server_mix.valid[y] == false ||
+		    hpsjam_server_mix.room[y] != room)
+			continue;
+		for (unsigned z = 0; z != HPSJAM_DEF_SAMPLES; z++) {
+			mix[0][z] += hpsjam_server_mix.tmp_audio[y][0][z];
+			mix[1][z] += hpsjam_server_mix.tmp_audio[y][1][z];
+		}
+	}
+
+	out_limiter.doit(HPSJAM_SAMPLE_RATE, mix[0], mix[1], HPSJAM_DEF_SAMPLES);
+	out_buffer[0].addSamples(mix[0], HPSJAM_DEF_SAMPLES);
+	out_buffer[1].addSamples(mix[1], HPSJAM_DEF_SAMPLES);
+
+	/* get back correct amount of samples, unless sending XOR data */
+	encoded = 0;
+	if (xor_frame == false) {
+		out_buffer[0].remSamples(temp[0], HPSJAM_NOM_SAMPLES);
+		out_buffer[1].remSamples(temp[1], HPSJAM_NOM_SAMPLES);
+	}
+	ticks = hpsjam_ticks;
+}
+
+const struct hpsjam_packet_entry &
+hpsjam_listener_mix :: getAudio(uint8_t format)
+{
+	if (format < HPSJAM_TYPE_AUDIO_8_BIT_1CH ||
+	    format > HPSJAM_TYPE_AUDIO_32_BIT_2CH)
+		format = 0;
+
+	if (encoded & (1U << format))
+		return (entry[format]);
+	encoded |= (1U << format);
+
+	switch (format) {
+	case HPSJAM_TYPE_AUDIO_8_BIT_1CH:
+	case HPSJAM_TYPE_AUDIO_16_BIT_1CH:
+	case HPSJAM_TYPE_AUDIO_24_BIT_1CH:
+	case HPSJAM_TYPE_AUDIO_32_BIT_1CH:
+		/* downsample to mono */
+		for (unsigned x = 0; x != HPSJAM_NOM_SAMPLES; x++)
+			temp[2][x] = (temp[0][x] + temp[1][x]) / 2.0f;
+		hpsjam_encode_audio(entry[format], format, temp[2], temp[2]);
+		break;
+	default:
+		hpsjam_encode_audio(entry[format], format, temp[0], temp[1]);
+		break;
+	}
+	return (entry[format]);
+}
+
+static void
+hpsjam_send_listeners()
+{
+	const bool xor_frame = (hpsjam_listener_d_cur == HPSJAM_XOR_DISTANCE);
+
+	for (unsigned x = 0; x != hpsjam_num_server_listeners; x++)
+		hpsjam_server_listeners[x].audio_import(xor_frame);
+
+	if (xor_frame)
+		hpsjam_listener_d_cur = 0;
+	else
+		hpsjam_listener_d_cur++;
+}
+
+void
+hpsjam_server_listener :: audio_import(bool xor_frame)
+{
+	const union hpsjam_frame *pkt;
+	const struct hpsjam_packet *ptr;
+	struct hpsjam_packet_entry *pres;
+	float temp[HPSJAM_MAX_PKT];
+
+	std::unique_lock<std::mutex> locker(lock);
+
+	if (valid == false)
+		return;
+
+	/* compute the mix of the room, if not done yet */
+	struct hpsjam_listener_mix * &pmix = hpsjam_listener_mixes[room];
+
+	if (pmix == 0)
+		pmix = new struct hpsjam_listener_mix;
+	if (pmix->ticks != hpsjam_ticks)
+		pmix->compute(room, xor_frame);
+
+	/*
+	 * Align XOR frames with the shared audio. The sequence number
+	 * is advanced by the same amount, because the receiver only
+	 * accepts XOR frames at multiples of the XOR distance.
+	 */
+	if (synced == false) {
+		output_pkt.d_cur = hpsjam_listener_d_cur;
+		output_pkt.seqno += hpsjam_listener_d_cur;
+		synced = true;
+	}
+
+	input_pkt.recovery();
+
+	while ((pkt = input_pkt.first_pkt())) {
+		for (ptr = pkt->start; ptr->valid(pkt->end); ptr = ptr->next()) {
+			/* check for unsequenced packets */
+			if (HpsJamReceiveUnSequenced
+			    <class hpsjam_server_listener>(*this, ptr, temp))
+				continue;
+			/* check if other side received packet */
+			if (ptr->getPeerSeqNo() == output_pkt.pend_seqno)
+				output_pkt.advance();
+			/* check if sequence number matches */
+			if (ptr->getLocalSeqNo() != output_pkt.peer_seqno)
+				continue;
+			/* advance expected sequence number */
+			output_pkt.peer_seqno++;
+			output_pkt.send_ack = true;
+
+			switch (ptr->type) {
+			uint16_t packets;
+			uint16_t time_ms;
+			uint64_t passwd;
+			uint8_t target;
+
+			case HPSJAM_TYPE_CONFIGURE_REQUEST:
+				if (ptr->getConfigure(output_fmt, target))
+					break;
+				output_fmt = HPSJAM_TYPE_AUDIO_SILENCE;
+				break;
+			case HPSJAM_TYPE_PING_REQUEST:
+				if (ptr->getPing(packets, time_ms, passwd) &&
+				    output_pkt.find(HPSJAM_TYPE_PING_REPLY) == 0) {
+					pres = new struct hpsjam_packet_entry;
+					pres->packet.setPing(0, time_ms, 0);
+					pres->packet.type = HPSJAM_TYPE_PING_REPLY;
+					pres->insert_tail(&output_pkt.head);
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	/* send a ping, if idle */
+	if (output_pkt.empty()) {
+		pres = new struct hpsjam_packet_entry;
+		pres->packet.setPing(0, hpsjam_ticks, 0);
+		pres->packet.type = HPSJAM_TYPE_PING_REQUEST;
+		pres->insert_tail(&output_pkt.head);
+	}
+
+	/* add the shared audio, unless sending XOR data */
+	if (output_pkt.isXorFrame() == false)
+		output_pkt.append_pkt(pmix->getAudio(output_fmt));
+
+	/* send a packet */
+	output_pkt.send(address);
+}
+
+void
+hpsjam_server_listener :: handle_events()
+{
+	std::unique_lock<std::mutex> locker(lock);
+	const uint8_t events = output_pkt.getEvents();
+	locker.unlock();
+
+	if (events & HPSJAM_OUTPUT_WATCHDOG)
+		handle_pending_watchdog();
+	if (events & HPSJAM_OUTPUT_TIMEOUT)
+		handle_pending_timeout();
+}
+
+void
+hpsjam_server_listener :: handle_pending_watchdog()
+{
+	std::unique_lock<std::mutex> locker(lock);
+
+	if (address.valid() && output_pkt.empty()) {
+		struct hpsjam_packet_entry *pkt = new struct hpsjam_packet_entry;
+		pkt->packet.setPing(0, hpsjam_ticks, 0);
+		pkt->packet.type = HPSJAM_TYPE_PING_REQUEST;
+		pkt->insert_tail(&output_pkt.head);
+	}
+}
+
+void
+hpsjam_server_listener :: handle_pending_timeout()
+{
+	std::unique_lock<std::mutex> locker(lock);
+	init();
+}
+
+/*
+ * Record the decoded input audio of each peer and the master mix of
+ * each room. Tracks of empty peer slots and rooms continue as silence.
+ */
+static void
+hpsjam_server_record()
+{
+	static float master[HPSJAM_ROOMS_MAX][2][HPSJAM_DEF_SAMPLES];
+	bool active[HPSJAM_ROOMS_MAX] = {};
+
+	for (unsigned x = 0; x != hpsjam_num_server_peers; x++) {
+		if (hpsjam_server_mix.valid[x] == false) {
+			hpsjam_recorder_push(x, 0, 0, HPSJAM_DEF_SAMPLES);
+			continue;
+		}
+
+		const float (&tmp_audio)[2][64] = hpsjam_server_mix.tmp_audio[x];
+		const uint8_t room = hpsjam_server_mix.room[x];
+
+		hpsjam_recorder_push(x, tmp_audio[0], tmp_audio[1], HPSJAM_DEF_SAMPLES);
+
+		float (&mix)[2][HPSJAM_DEF_SAMPLES] = master[room];
+
+		if (active[room] == false) {
+			active[room] = true;
+			memset(mix, 0, sizeof(mix));
+		}
+		for (unsigned z = 0; z != HPSJAM_DEF_SAMPLES; z++) {
+			mix[0][z] += tmp_audio[0][z];
+			mix[1][z] += tmp_audio[1][z];
+		}
+	}
+
+	for (unsigned x = 0; x != HPSJAM_ROOMS_MAX; x++) {
+		if (active[x]) {
+			hpsjam_recorder_push(HPSJAM_PEERS_MAX + x,
+			    master[x][0], master[x][1], HPSJAM_DEF_SAMPLES);
+		} else {
+			hpsjam_recorder_push(HPSJAM_PEERS_MAX + x, 0, 0, HPSJAM_DEF_SAMPLES);
+		}
+	}
+	hpsjam_recorder_tick(HPSJAM_DEF_SAMPLES);
+}
+
+Q_DECL_EXPORT void
+hpsjam_server_tick()
+{
+	/* get audio */
+	for (unsigned x = 0; x != hpsjam_num_server_peers; x++)
+		hpsjam_server_peers[x].audio_export();
+
+	/* record audio, if any */
+	if (hpsjam_record_dir != 0)
+		hpsjam_server_record();
+
+	/* send out levels, if any */
+	hpsjam_send_levels();
+
+	/* send out round trip times for direct audio, if any */
+	hpsjam_send_rtts();
+
+	/* mix everything */
+	for (unsigned x = 0; x != hpsjam_num_server_peers; x++)
+		hpsjam_server_peers[x].audio_mixing();
+
+	/* send audio */
+	for (unsigned x = 0; x != hpsjam_num_server_peers; x++)
+		hpsjam_server_peers[x].audio_import();
+
+	/* send audio to listeners, if any */
+	if (hpsjam_num_server_listeners != 0)
+		hpsjam_send_listeners();
+
+	/* handle peers and listeners not responding, if any */
+	for (unsigned x = 0; x != hpsjam_num_server_peers; x++)
+		hpsjam_server_peers[x].handle_events();
+	for (unsigned x = 0; x != hpsjam_num_server_listeners; x++)
+		hpsjam_server_listeners[x].handle_events();
+
+	/* advance the capture clock, if any */
+	if (hpsjam_capture_file != 0)
+		hpsjam_capture_tick();
+
+	/*
+	 * The server timer runs at the nominal rate. Each peer
+	 * compensates for its own clock drift in audio_export().
+	 */
+	hpsjam_timer_adjust = 0;
+}
+
+void
+hpsjam_server_cli_process(const char *data, size_t len)
+{
+	static const char prefix[] = "set lyrics.text=";
+	struct hpsjam_packet_entry *pkt;
+
+	if (len < sizeof(prefix) - 1 ||
+	    memcmp(data, prefix, sizeof(prefix) - 1) != 0)
+		return;
+
+	std::string str(data + sizeof(prefix) - 1, len - (sizeof(prefix) - 1));
+	hpsjam_utf8_truncate(str, 128);
+
+	pkt = new struct hpsjam_packet_entry;
+	pkt->packet.setRawData(str.data(), str.length());
+	pkt->packet.type = HPSJAM_TYPE_LYRICS_REPLY;
+	hpsjam_server_broadcast(*pkt);
+	delete pkt;
+}
@@ -0,0 +1,241 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	_HPSJAM_SERVER_H_
+#define	_HPSJAM_SERVER_H_
+
+#include "hpsjam.h"
+#include "audiobuffer.h"
+#include "compressor.h"
+#include "socket.h"
+#include "protocol.h"
+
+#include <stdbool.h>
+
+#include <mutex>
+#include <string>
+
+#define	HPSJAM_CACHE_LINE 64	/* bytes */
+
+#if (HPSJAM_DEF_SAMPLES > 64)
+#error "Please update the audio arrays below"
+#endif
+
+/*
+ * The state needed by the mixing loops of each tick is kept in
+ * contiguous, cache line aligned arrays outside the peer class, so
+ * that mixing doesn't stride across the much larger packet and audio
+ * buffers of every peer. The matrices have one row per peer, and the
+ * valid and room arrays are a snapshot taken by audio_export().
+ */
+struct hpsjam_server_mix {
+	float (*tmp_audio)[2][64];	/* decoded input audio */
+	float (*out_audio)[2][64];	/* mixed output audio */
+	uint8_t *bits;			/* mixer bits */
+	bool *direct;			/* audio is received peer to peer */
+	bool *valid;
+	uint8_t *room;
+	size_t stride;			/* row length of the matrices */
+};
+
+extern struct hpsjam_server_mix hpsjam_server_mix;
+extern void hpsjam_server_mix_alloc(unsigned);
+
+class hpsjam_server_peer {
+public:
+	std::mutex lock;
+	struct hpsjam_socket_address address;
+	struct hpsjam_socket_address alt_address;	/* second path, if valid */
+	struct hpsjam_socket_address trunk_address;	/* outgoing trunk, if valid */
+	struct hpsjam_input_packetizer input_pkt;
+	class hpsjam_output_packetizer output_pkt;
+	class hpsjam_audio_buffer in_audio[2];
+	class hpsjam_audio_drift drift;
+	class hpsjam_audio_buffer out_buffer[2];
+	class hpsjam_audio_level in_level[2];
+
+	std::string name;	/* UTF-8 */
+	std::string icon;
+	float gain;
+	float pan;
+	struct hpsjam_stereo_limiter out_limiter;
+	uint8_t output_fmt;
+	uint8_t room;
+	bool valid;
+	bool allow_mixer_access;
+	bool trunk;
+	bool p2p;
+	bool multipath;		/* second path may still attach */
+	uint64_t multipath_token;	/* token of the initial ping */
+
+	/* selective forwarding, see --sfu */
+	hpsjam_packet_head_t sfu_recv;	/* uplink audio of this tick */
+	hpsjam_packet_head_t sfu_send;	/* audio from other peers */
+	size_t sfu_count;		/* number of entries in sfu_send */
+
+	void sfu_clear(hpsjam_packet_head_t *phead) {
+		struct hpsjam_packet_entry *pkt;
+
+		while ((pkt = TAILQ_FIRST(phead))) {
+			pkt->remove(phead);
+			delete pkt;
+		}
+	};
+
+	void init() {
+		address.clear();
+		alt_address.clear();
+		input_pkt.init();
+		output_pkt.init();
+		in_audio[0].clear();
+		in_audio[1].clear();
+		drift.clear();
+		out_buffer[0].clear();
+		out_buffer[1].clear();
+		in_level[0].clear();
+		in_level[1].clear();
+		name.clear();
+		icon.clear();
+		output_fmt = HPSJAM_TYPE_AUDIO_SILENCE;
+		gain = 1.0f;
+		pan = 0.0f;
+		out_limiter.clear();
+		room = 0;
+		valid = false;
+		allow_mixer_access = false;
+		trunk = false;
+		p2p = false;
+		multipath = false;
+		multipath_token = 0;
+		sfu_clear(&sfu_recv);
+		sfu_clear(&sfu_send);
+		sfu_count = 0;
+	};
+
+	size_t serverID();
+	void trunk_connect();
+
+	float (&tmpAudio())[2][64] {
+		return (hpsjam_server_mix.tmp_audio[serverID()]);
+	};
+	float (&outAudio())[2][64] {
+		return (hpsjam_server_mix.out_audio[serverID()]);
+	};
+	uint8_t *mixBits() {
+		return (hpsjam_server_mix.bits + serverID() * hpsjam_server_mix.stride);
+	};
+	bool *mixDirect() {
+		return (hpsjam_server_mix.direct + serverID() * hpsjam_server_mix.stride);
+	};
+	void mix_clear() {
+		memset(outAudio(), 0, sizeof(outAudio()));
+		memset(mixBits(), 0, hpsjam_server_mix.stride);
+		memset(mixDirect(), 0, hpsjam_server_mix.stride * sizeof(bool));
+	};
+
+	void receiveAudio(const float *left, const float *right, size_t num) {
+		in_audio[0].addSamples(left, num);
+		in_audio[1].addSamples(right, num);
+		in_level[0].addSamples(left, num);
+		in_level[1].addSamples(right, num);
+	};
+	void receiveSilence(size_t num, bool lost) {
+		in_audio[0].addSilence(num, lost);
+		in_audio[1].addSilence(num, lost);
+	};
+	/* clients don't send forwarded audio */
+	void receiveForward(const struct hpsjam_packet *, float *) {
+	};
+	void sendDirect(const struct hpsjam_packet_entry &) {
+	};
+
+	void audio_export();
+	void audio_import();
+	void audio_mixing();
+	void audio_forward();
+	void send_forward();
+	void send_welcome_message();
+
+	hpsjam_server_peer() {
+		TAILQ_INIT(&sfu_recv);
+		TAILQ_INIT(&sfu_send);
+		trunk_address.clear();
+		init();
+	};
+	void handle_events();
+	void handle_pending_watchdog();
+	void handle_pending_timeout();
+};
+
+/*
+ * A listener only receives the master mix of all peers in its
+ * room. The master mix is computed and encoded once per tick, room
+ * and audio format, and is shared by all listeners in the room.
+ */
+class hpsjam_server_listener {
+public:
+	std::mutex lock;
+	struct hpsjam_socket_address address;
+	struct hpsjam_input_packetizer input_pkt;
+	class hpsjam_output_packetizer output_pkt;
+	uint8_t output_fmt;
+	uint8_t room;
+	bool valid;
+	bool synced;
+
+	void init() {
+		address.clear();
+		input_pkt.init();
+		output_pkt.init();
+		output_fmt = HPSJAM_TYPE_AUDIO_SILENCE;
+		room = 0;
+		valid = false;
+		synced = false;
+	};
+
+	/* listeners don't send any audio */
+	void receiveAudio(const float *, const float *, size_t) {
+	};
+	void receiveSilence(size_t, bool) {
+	};
+	void receiveForward(const struct hpsjam_packet *, float *) {
+	};
+
+	void audio_import(bool);
+
+	hpsjam_server_listener() {
+		init();
+	};
+	void handle_events();
+	void handle_pending_watchdog();
+	void handle_pending_timeout();
+};
+
+extern void hpsjam_server_receive(const struct hpsjam_socket_address &,
+    const union hpsjam_frame &, size_t);
+extern void hpsjam_server_cli_process(const char *, size_t);
+extern void hpsjam_server_tick();
+
+#endif		/* _HPSJAM_SERVER_H_ */
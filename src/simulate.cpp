@@ -0,0 +1,377 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsjam.h"
+#include "simulate.h"
+
+struct hpsjam_simulate_config hpsjam_simulate_cfg;
+
+#ifndef _WIN32
+
+#include "peer.h"
+#include "timer.h"
+
+#include <QMutexLocker>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+
+#include <chrono>
+#include <map>
+
+/*
+ * The simulator runs the server and a number of clients in a single
+ * thread on a virtual clock, which advances to the next event as
+ * soon as the previous one has been processed. Each client has its
+ * own network clock, which follows the timer adjustments of the
+ * client, and its own audio clock, which drifts by a fixed amount
+ * relative to the server. The frames are exchanged through loopback
+ * UDP sockets and are then delayed and dropped by the simulator, to
+ * emulate network jitter and packet loss. Like on a real network
+ * path, the frames of each direction never overtake each other.
+ * The result is reproducible, because all random numbers come from
+ * a fixed seed.
+ */
+#define	HPSJAM_SIM_TICK 1000000ULL	/* nanoseconds */
+
+struct hpsjam_sim_frame {
+	struct hpsjam_socket_address src;
+	union hpsjam_frame frame;
+	size_t length;
+	int dst;		/* receiving client, or -1 for the server */
+};
+
+struct hpsjam_sim_client {
+	class hpsjam_client_peer peer;
+	struct hpsjam_socket_address sock;
+	struct hpsjam_clock clock;
+	uint64_t next_tick;	/* network clock, in nanoseconds */
+	uint64_t next_audio;	/* audio clock, in nanoseconds */
+	uint64_t last_up;	/* last delivery to the server */
+	uint64_t last_down;	/* last delivery to the client */
+	uint64_t audio_period;
+	uint64_t adjust[3];	/* ticks going faster, normal and slower */
+	uint64_t samples;
+	double power;
+	float phase;
+	int drift_ppm;
+};
+
+static std::multimap<uint64_t, struct hpsjam_sim_frame *> hpsjam_sim_queue;
+static uint64_t hpsjam_sim_lost;
+static uint32_t hpsjam_sim_seed = 1;
+
+static uint32_t
+hpsjam_sim_random()
+{
+	hpsjam_sim_seed = hpsjam_sim_seed * 1103515245U + 12345U;
+	return (hpsjam_sim_seed >> 8);
+}
+
+static void
+hpsjam_sim_socket(struct hpsjam_socket_address &sock)
+{
+	socklen_t len = sizeof(sock.v4);
+
+	sock.init(AF_INET);
+	sock.v4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (sock.socket(hpsjam_udp_buffer_size) < 0 || sock.bind() < 0)
+		errx(1, "Cannot create loopback UDP socket");
+
+	/* get the assigned port number */
+	getsockname(sock.fd, (struct sockaddr *)&sock.v4, &len);
+
+	fcntl(sock.fd, F_SETFL, fcntl(sock.fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* queue all frames received on a socket, applying loss and jitter */
+static void
+hpsjam_sim_drain(struct hpsjam_sim_client *pc, const struct hpsjam_socket_address &sock,
+    int dst, uint64_t now)
+{
+	const struct hpsjam_simulate_config &cfg = hpsjam_simulate_cfg;
+
+	while (1) {
+		struct hpsjam_sim_frame *pf = new struct hpsjam_sim_frame;
+		ssize_t ret;
+
+		pf->src = sock;
+		ret = pf->src.recvfrom((char *)&pf->frame, sizeof(pf->frame));
+		if (ret < 0) {
+			delete pf;
+			break;
+		}
+		if (ret < (ssize_t)sizeof(pf->frame.hdr) ||
+		    (hpsjam_sim_random() % 1000) < cfg.loss) {
+			hpsjam_sim_lost++;
+			delete pf;
+			continue;
+		}
+		memset(pf->frame.raw + ret, 0, sizeof(pf->frame) - ret);
+		pf->length = ret;
+		pf->dst = dst;
+
+		uint64_t *plast = 0;
+
+		/* find the network path */
+		if (dst < 0) {
+			for (unsigned x = 0; x != cfg.clients; x++) {
+				if (pc[x].sock == pf->src) {
+					plast = &pc[x].last_up;
+					break;
+				}
+			}
+			if (plast == 0) {
+				delete pf;
+				continue;
+			}
+		} else {
+			plast = &pc[dst].last_down;
+		}
+
+		uint64_t when = now;
+		if (cfg.jitter_ms != 0)
+			when += (hpsjam_sim_random() % (cfg.jitter_ms * 1000 + 1)) * 1000ULL;
+		if (when < *plast)
+			when = *plast;
+		*plast = when;
+
+		hpsjam_sim_queue.insert(std::make_pair(when, pf));
+	}
+}
+
+static void
+hpsjam_sim_deliver(struct hpsjam_sim_client *pc, struct hpsjam_clock &server_clock,
+    struct hpsjam_sim_frame *pf)
+{
+	if (pf->dst < 0) {
+		server_clock.enter();
+		hpsjam_server_receive(pf->src, pf->frame, pf->length);
+		server_clock.leave();
+	} else {
+		struct hpsjam_sim_client &client = pc[pf->dst];
+
+		client.clock.enter();
+		QMutexLocker locker(&client.peer.lock);
+		if (client.peer.address.valid() && client.peer.address == pf->src)
+			client.peer.input_pkt.receive(pf->frame, pf->length);
+		client.clock.leave();
+	}
+	delete pf;
+}
+
+static void
+hpsjam_sim_connect(struct hpsjam_sim_client &client, unsigned index,
+    const struct hpsjam_socket_address &server)
+{
+	struct hpsjam_packet_entry *pkt;
+	char name[16];
+
+	QMutexLocker locker(&client.peer.lock);
+
+	/* set destination address */
+	client.peer.address = server;
+	client.peer.address.fd = client.sock.fd;
+
+	/* send initial ping */
+	pkt = new struct hpsjam_packet_entry;
+	pkt->packet.setPing(0, client.clock.ticks, hpsjam_server_passwd);
+	pkt->packet.type = HPSJAM_TYPE_PING_REQUEST;
+	pkt->insert_tail(&client.peer.output_pkt.head);
+
+	/* send initial configuration */
+	pkt = new struct hpsjam_packet_entry;
+	pkt->packet.setConfigure(HPSJAM_TYPE_AUDIO_16_BIT_2CH, HPSJAM_JITTER_TARGET_DEFAULT);
+	pkt->packet.type = HPSJAM_TYPE_CONFIGURE_REQUEST;
+	pkt->insert_tail(&client.peer.output_pkt.head);
+
+	/* send name */
+	snprintf(name, sizeof(name), "sim-%u", index);
+	pkt = new struct hpsjam_packet_entry;
+	pkt->packet.setRawData(name, strlen(name));
+	pkt->packet.type = HPSJAM_TYPE_NAME_REQUEST;
+	pkt->insert_tail(&client.peer.output_pkt.head);
+
+	client.peer.output_fmt = HPSJAM_TYPE_AUDIO_16_BIT_2CH;
+}
+
+/* run one audio period of a client, with a sine tone as input */
+static void
+hpsjam_sim_audio(struct hpsjam_sim_client &client, unsigned index)
+{
+	const float step = 2.0f * (float)M_PI * 220.0f * (index + 1) / HPSJAM_SAMPLE_RATE;
+	float left[HPSJAM_DEF_SAMPLES];
+	float right[HPSJAM_DEF_SAMPLES];
+
+	for (unsigned x = 0; x != HPSJAM_DEF_SAMPLES; x++) {
+		left[x] = right[x] = 0.25f * sinf(client.phase);
+		client.phase += step;
+		if (client.phase > 2.0f * (float)M_PI)
+			client.phase -= 2.0f * (float)M_PI;
+	}
+
+	client.peer.sound_process(left, right, HPSJAM_DEF_SAMPLES);
+
+	for (unsigned x = 0; x != HPSJAM_DEF_SAMPLES; x++)
+		client.power += left[x] * left[x] + right[x] * right[x];
+	client.samples += HPSJAM_DEF_SAMPLES;
+}
+
+Q_DECL_EXPORT int
+hpsjam_simulate()
+{
+	const struct hpsjam_simulate_config &cfg = hpsjam_simulate_cfg;
+	const uint64_t end = cfg.seconds * 1000000000ULL;
+	struct hpsjam_socket_address server;
+	struct hpsjam_clock server_clock;
+	struct hpsjam_sim_client *pc;
+	uint64_t next_server = 0;
+	uint64_t ticks = 0;
+
+	hpsjam_sim_socket(server);
+	server_clock.clear();
+
+	pc = new struct hpsjam_sim_client [cfg.clients];
+
+	for (unsigned x = 0; x != cfg.clients; x++) {
+		struct hpsjam_sim_client &client = pc[x];
+
+		hpsjam_sim_socket(client.sock);
+		client.clock.clear();
+		client.next_tick = (HPSJAM_SIM_TICK * x) / cfg.clients;
+		client.next_audio = client.next_tick;
+		client.last_up = 0;
+		client.last_down = 0;
+		client.drift_ppm = (cfg.clients > 1) ?
+		    -cfg.drift_ppm + (2 * cfg.drift_ppm * (int)x) / (int)(cfg.clients - 1) :
+		    cfg.drift_ppm;
+		client.audio_period = (HPSJAM_SIM_TICK * 1000000ULL) /
+		    (uint64_t)(1000000LL + client.drift_ppm);
+		memset(client.adjust, 0, sizeof(client.adjust));
+		client.samples = 0;
+		client.power = 0.0;
+		client.phase = 0.0f;
+
+		hpsjam_sim_connect(client, x, server);
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+
+	while (1) {
+		uint64_t now = next_server;
+		int which = -1;
+		bool audio = false;
+
+		/* find the next event */
+		for (unsigned x = 0; x != cfg.clients; x++) {
+			if (pc[x].next_tick < now) {
+				now = pc[x].next_tick;
+				which = x;
+				audio = false;
+			}
+			if (pc[x].next_audio < now) {
+				now = pc[x].next_audio;
+				which = x;
+				audio = true;
+			}
+		}
+
+		/* deliver frames first */
+		if (hpsjam_sim_queue.empty() == false &&
+		    hpsjam_sim_queue.begin()->first <= now) {
+			struct hpsjam_sim_frame *pf = hpsjam_sim_queue.begin()->second;
+			hpsjam_sim_queue.erase(hpsjam_sim_queue.begin());
+			hpsjam_sim_deliver(pc, server_clock, pf);
+			continue;
+		}
+
+		if (now >= end)
+			break;
+
+		if (which < 0) {
+			server_clock.enter();
+			hpsjam_server_tick();
+			hpsjam_ticks++;
+			server_clock.leave();
+
+			next_server += HPSJAM_SIM_TICK;
+			ticks++;
+
+			/* collect frames sent to the clients */
+			for (unsigned x = 0; x != cfg.clients; x++)
+				hpsjam_sim_drain(pc, pc[x].sock, x, now);
+		} else if (audio) {
+			struct hpsjam_sim_client &client = pc[which];
+
+			hpsjam_sim_audio(client, which);
+			client.next_audio += client.audio_period;
+		} else {
+			struct hpsjam_sim_client &client = pc[which];
+
+			client.clock.enter();
+			client.peer.tick();
+			hpsjam_ticks++;
+			client.clock.leave();
+
+			/* the timer adjustment is one microsecond per tick */
+			client.adjust[client.clock.adjust + 1]++;
+			client.next_tick += HPSJAM_SIM_TICK + client.clock.adjust * 1000LL;
+
+			/* collect frames sent to the server */
+			hpsjam_sim_drain(pc, server, -1, now);
+		}
+	}
+
+	const double wall = std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - start).count();
+
+	printf("HpsJam: simulated %u seconds with %u clients in %.3f seconds "
+	    "wall time, %llu server ticks, %llu frames lost by the network\n",
+	    cfg.seconds, cfg.clients, wall, (unsigned long long)ticks,
+	    (unsigned long long)hpsjam_sim_lost);
+
+	for (unsigned x = 0; x != cfg.clients; x++) {
+		struct hpsjam_sim_client &client = pc[x];
+		const uint64_t total = client.adjust[0] + client.adjust[1] + client.adjust[2];
+		const double power = client.samples ? client.power / (2 * client.samples) : 0.0;
+
+		printf("HpsJam: client %u: drift %+d ppm, jitter %u ms, "
+		    "packets lost %llu, timer faster %.1f%% slower %.1f%%, "
+		    "output level %.1f dB\n", x, client.drift_ppm,
+		    client.peer.input_pkt.jitter.get_jitter_in_ms(),
+		    (unsigned long long)client.peer.input_pkt.jitter.packet_loss,
+		    total ? (100.0 * client.adjust[0]) / total : 0.0,
+		    total ? (100.0 * client.adjust[2]) / total : 0.0,
+		    (power > 0.0) ? 10.0 * log10(power) : -INFINITY);
+	}
+	return (0);
+}
+
+#endif
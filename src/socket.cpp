@@ -25,21 +25,38 @@
 
 #include "hpsjam.h"
 
+#ifdef HPSJAM_SERVER_ONLY
+#include "server.h"
+#else
 #include "peer.h"
+#endif
+#include "timer.h"
+#include "capture.h"
 
 #include <pthread.h>
 #include <err.h>
 
-static void
-hpsjam_socket_set_priority()
+Q_DECL_EXPORT void
+hpsjam_peer_receive(const struct hpsjam_socket_address &src,
+    const union hpsjam_frame &frame, size_t len)
 {
-	pthread_t pt = pthread_self();
-	struct sched_param param;
-	int policy;
+	if (hpsjam_num_server_peers != 0)
+		hpsjam_server_receive(src, frame, len);
+#ifndef HPSJAM_SERVER_ONLY
+	else
+		hpsjam_client_receive(src, frame, len);
+#endif
+}
 
-	pthread_getschedparam(pt, &policy, &param);
-	param.sched_priority = sched_get_priority_max(policy);
-	pthread_setschedparam(pt, policy, &param);
+Q_DECL_EXPORT void
+hpsjam_cli_process(const struct hpsjam_socket_address &, const char *data, size_t len)
+{
+	if (hpsjam_num_server_peers != 0)
+		hpsjam_server_cli_process(data, len);
+#ifndef HPSJAM_SERVER_ONLY
+	else
+		hpsjam_client_cli_process(data, len);
+#endif
 }
 
 static void *
@@ -49,9 +66,10 @@ hpsjam_socket_receive(void *arg)
 	struct hpsjam_socket_address self;
 	int tries = (hpsjam_num_server_peers ? 1 : 128);
 	union hpsjam_frame frame;
+	size_t last = 0;
 	ssize_t ret;
 
-	hpsjam_socket_set_priority();
+	hpsjam_thread_set_priority(hpsjam_rt_cpu_receive);
 
 	frame.clear();
 
@@ -78,10 +96,14 @@ hpsjam_socket_receive(void *arg)
 	} else while (1) {
 		ret = ps->recvfrom((char *)&frame, sizeof(frame));
 		if (*ps != self && ret >= (int)sizeof(frame.hdr)) {
-			/* zero end of frame to avoid garbage */
-			memset(frame.raw + ret, 0, sizeof(frame) - ret);
+			/* zero end of previous frame to avoid garbage */
+			frame.zero_tail(ret, last);
+			last = ret;
+			/* capture frame, if any */
+			if (hpsjam_capture_file != 0)
+				hpsjam_capture_frame(*ps, frame, ret);
 			/* process frame */
-			hpsjam_peer_receive(*ps, frame);
+			hpsjam_peer_receive(*ps, frame, ret);
 		}
 	}
 done:
@@ -99,7 +121,7 @@ hpsjam_cli_receive(void *arg)
 	char port[8];
 	ssize_t ret;
 
-	hpsjam_socket_set_priority();
+	hpsjam_thread_set_priority();
 
 	ps->setup();
 
@@ -202,6 +224,41 @@ hpsjam_socket_init(unsigned short port, unsigned short cliport)
 	ret = pthread_create(&pt, NULL, &hpsjam_socket_receive, &hpsjam_v6);
 	assert(ret == 0);
 
+	/* create a second socket, bound to another local address, if any */
+	hpsjam_alt.clear();
+	if (hpsjam_client_multipath != 0 && hpsjam_num_server_peers == 0) {
+		struct addrinfo hints;
+		struct addrinfo *res;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_flags = AI_NUMERICHOST;
+
+		if (getaddrinfo(hpsjam_client_multipath, NULL, &hints, &res) != 0) {
+			warnx("Cannot resolve multipath address %s", hpsjam_client_multipath);
+		} else {
+			switch (res->ai_family) {
+			case AF_INET:
+				hpsjam_alt.init(AF_INET);
+				hpsjam_alt.v4.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+				break;
+			case AF_INET6:
+				hpsjam_alt.init(AF_INET6);
+				hpsjam_alt.v6.sin6_addr = ((struct sockaddr_in6 *)res->ai_addr)->sin6_addr;
+				break;
+			default:
+				break;
+			}
+			freeaddrinfo(res);
+
+			if (hpsjam_alt.v4.sin_family != 0) {
+				ret = pthread_create(&pt, NULL, &hpsjam_socket_receive, &hpsjam_alt);
+				assert(ret == 0);
+			}
+		}
+	}
+
 	if (cliport != 0) {
 		hpsjam_cli.init(AF_INET, cliport);
 		ret = pthread_create(&pt, NULL, &hpsjam_cli_receive, &hpsjam_cli);
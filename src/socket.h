@@ -232,6 +232,38 @@ struct hpsjam_socket_address {
 	bool operator <=(const struct hpsjam_socket_address &other) const {
 		return (compare(other) <= 0);
 	};
+	/* serialize family, port and address, returns number of bytes */
+	size_t toBytes(uint8_t *ptr) const {
+		switch (v4.sin_family) {
+		case AF_INET:
+			ptr[0] = 4;
+			memcpy(ptr + 1, &v4.sin_port, 2);
+			memcpy(ptr + 3, &v4.sin_addr, 4);
+			return (3 + 4);
+		case AF_INET6:
+			ptr[0] = 6;
+			memcpy(ptr + 1, &v6.sin6_port, 2);
+			memcpy(ptr + 3, &v6.sin6_addr, 16);
+			return (3 + 16);
+		default:
+			return (0);
+		}
+	};
+	bool fromBytes(const uint8_t *ptr, size_t len) {
+		clear();
+		if (len >= 3 + 4 && ptr[0] == 4) {
+			v4.sin_family = AF_INET;
+			memcpy(&v4.sin_port, ptr + 1, 2);
+			memcpy(&v4.sin_addr, ptr + 3, 4);
+			return (true);
+		} else if (len >= 3 + 16 && ptr[0] == 6) {
+			v6.sin6_family = AF_INET6;
+			memcpy(&v6.sin6_port, ptr + 1, 2);
+			memcpy(&v6.sin6_addr, ptr + 3, 16);
+			return (true);
+		}
+		return (false);
+	};
 	bool operator == (const struct hpsjam_socket_address &other) const {
 		return (compare(other) == 0);
 	};
@@ -240,4 +272,10 @@ struct hpsjam_socket_address {
 	};
 };
 
+union hpsjam_frame;
+
+extern void hpsjam_peer_receive(const struct hpsjam_socket_address &,
+    const union hpsjam_frame &, size_t);
+extern void hpsjam_cli_process(const struct hpsjam_socket_address &, const char *, size_t);
+
 #endif		/* _HPSJAM_SOCKET_H_ */
@@ -31,40 +31,186 @@
 #include <mach/mach_error.h>
 #include <mach/mach_time.h>
 #elif defined(_WIN32)
-#include <QThread>
-#include <QElapsedTimer>
+#include <chrono>
+#include <thread>
 static int16_t hpsjam_timer_remainder;
 static int16_t hpsjam_timer_next;
-static QElapsedTimer hpsjam_timer;
+static std::chrono::steady_clock::time_point hpsjam_timer;
 #else
 #include <sys/time.h>
 #endif
 
+#ifndef _WIN32
+#include <err.h>
+#include <string.h>
+#include <stdio.h>
+#endif
+
+#if defined(__FreeBSD__)
+#include <pthread_np.h>
+#include <sys/cpuset.h>
+#endif
+
 #include "hpsjam.h"
 #include "timer.h"
+#ifdef HPSJAM_SERVER_ONLY
+#include "server.h"
+#else
 #include "peer.h"
+#endif
 
 uint16_t hpsjam_ticks;
 int hpsjam_timer_adjust;
+bool hpsjam_audio_clock;
 
-static void
-hpsjam_timer_set_priority()
+int hpsjam_rt_priority;
+int hpsjam_rt_cpu_timer = -1;
+int hpsjam_rt_cpu_receive = -1;
+int hpsjam_rt_spin_us;
+bool hpsjam_rt_report;
+
+/*
+ * Raise the priority of the current thread. If a realtime priority
+ * is configured use SCHED_FIFO, else use the maximum priority of the
+ * current policy. Optionally pin the thread to the given CPU.
+ */
+Q_DECL_EXPORT void
+hpsjam_thread_set_priority(int cpu)
 {
 #ifndef _WIN32
 	pthread_t pt = pthread_self();
 	struct sched_param param;
 	int policy;
 
-	pthread_getschedparam(pt, &policy, &param);
-	param.sched_priority = sched_get_priority_max(policy);
-	pthread_setschedparam(pt, policy, &param);
+	if (hpsjam_rt_priority != 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = hpsjam_rt_priority;
+		if (param.sched_priority > sched_get_priority_max(SCHED_FIFO))
+			param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+		if (pthread_setschedparam(pt, SCHED_FIFO, &param) != 0)
+			warnx("Cannot set SCHED_FIFO priority %d", param.sched_priority);
+	} else {
+		pthread_getschedparam(pt, &policy, &param);
+		param.sched_priority = sched_get_priority_max(policy);
+		pthread_setschedparam(pt, policy, &param);
+	}
+
+	if (cpu < 0)
+		return;
+#if defined(__linux__)
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pt, sizeof(set), &set) != 0)
+		warnx("Cannot pin thread to CPU %d", cpu);
+#elif defined(__FreeBSD__)
+	cpuset_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pt, sizeof(set), &set) != 0)
+		warnx("Cannot pin thread to CPU %d", cpu);
+#else
+	warnx("Pinning threads to a CPU is not supported");
 #endif
+#endif
+}
+
+#if !defined(__APPLE__) && !defined(__MACOSX) && !defined(_WIN32)
+#define	HPSJAM_TIMER_HIST 256	/* microseconds */
+#define	HPSJAM_TIMER_REPORT 10000	/* ticks */
+
+/* statistics about the wakeup accuracy, in microseconds */
+static struct {
+	uint32_t hist[HPSJAM_TIMER_HIST + 1];
+	uint64_t sum;
+	uint32_t max;
+	uint32_t count;
+} hpsjam_timer_stats;
+
+static void
+hpsjam_timer_account(uint32_t late)
+{
+	if (late > hpsjam_timer_stats.max)
+		hpsjam_timer_stats.max = late;
+	hpsjam_timer_stats.sum += late;
+	hpsjam_timer_stats.hist[(late > HPSJAM_TIMER_HIST) ? HPSJAM_TIMER_HIST : late]++;
+
+	if (++hpsjam_timer_stats.count != HPSJAM_TIMER_REPORT)
+		return;
+
+	static const uint32_t pct[3] = { 500, 990, 999 };	/* per mille */
+	uint32_t value[3];
+	uint32_t sum = 0;
+	unsigned x = 0;
+
+	for (unsigned y = 0; y != 3; y++) {
+		while (x != HPSJAM_TIMER_HIST &&
+		    (uint64_t)(sum + hpsjam_timer_stats.hist[x]) * 1000 <
+		    (uint64_t)pct[y] * HPSJAM_TIMER_REPORT)
+			sum += hpsjam_timer_stats.hist[x++];
+		value[y] = x;
+	}
+
+	fprintf(stderr, "HpsJam: timer wakeup late by "
+	    "mean %.1fus, P50 %uus, P99 %uus, P99.9 %uus, max %uus\n",
+	    (double)hpsjam_timer_stats.sum / HPSJAM_TIMER_REPORT,
+	    value[0], value[1], value[2], hpsjam_timer_stats.max);
+
+	memset(&hpsjam_timer_stats, 0, sizeof(hpsjam_timer_stats));
+}
+
+static int64_t
+hpsjam_timer_diff_ns(const struct timespec &a, const struct timespec &b)
+{
+	return ((int64_t)(a.tv_sec - b.tv_sec) * 1000000000LL +
+	    (int64_t)(a.tv_nsec - b.tv_nsec));
 }
 
+/*
+ * Sleep until the given absolute time. If spinning is enabled, sleep
+ * until the given number of microseconds before the deadline and
+ * then busy wait the rest of the time, which hides the wakeup latency
+ * of the kernel.
+ */
+static void
+hpsjam_timer_wait(const struct timespec &next)
+{
+	struct timespec now;
+
+	if (hpsjam_rt_spin_us != 0) {
+		struct timespec early = next;
+
+		early.tv_nsec -= hpsjam_rt_spin_us * 1000L;
+		if (early.tv_nsec < 0) {
+			early.tv_sec--;
+			early.tv_nsec += 1000000000L;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &early, 0);
+
+		do {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while (hpsjam_timer_diff_ns(now, next) < 0);
+	} else {
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0);
+
+		if (hpsjam_rt_report == false)
+			return;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}
+
+	if (hpsjam_rt_report) {
+		const int64_t late = hpsjam_timer_diff_ns(now, next) / 1000;
+		hpsjam_timer_account(late < 0 ? 0 : (uint32_t)late);
+	}
+}
+#endif
+
 static void *
 hpsjam_timer_loop(void *arg)
 {
-	hpsjam_timer_set_priority();
+	hpsjam_thread_set_priority(hpsjam_rt_cpu_timer);
 
 #if defined(__APPLE__) || defined(__MACOSX)
 	struct mach_timebase_info time_base_info;
@@ -80,8 +226,7 @@ hpsjam_timer_loop(void *arg)
 
 	next = mach_absolute_time();
 #elif defined(_WIN32)
-	hpsjam_timer.start();
-	hpsjam_timer.restart();
+	hpsjam_timer = std::chrono::steady_clock::now();
 #else
 	static const long delay[3] = {
 	     999000L,
@@ -115,10 +260,12 @@ hpsjam_timer_loop(void *arg)
 			hpsjam_timer_next += 1;
 		}
 		while (1) {
-			int16_t delta = hpsjam_timer_next - hpsjam_timer.elapsed();
+			int16_t delta = hpsjam_timer_next -
+			    std::chrono::duration_cast<std::chrono::milliseconds>(
+			    std::chrono::steady_clock::now() - hpsjam_timer).count();
 			if (delta <= 0)
 				break;
-			QThread::msleep(1);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
 		}
 #else
 		if (hpsjam_timer_adjust < 0)
@@ -133,18 +280,56 @@ hpsjam_timer_loop(void *arg)
 			next.tv_nsec -= 1000000000L;
 		}
 
-		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0);
+		hpsjam_timer_wait(next);
 #endif
-		if (hpsjam_num_server_peers == 0)
-			hpsjam_client_peer->tick();
-		else
+		if (hpsjam_num_server_peers != 0) {
 			hpsjam_server_tick();
-
-		hpsjam_ticks++;
+			hpsjam_ticks++;
+		}
+#ifndef HPSJAM_SERVER_ONLY
+		else {
+			/* advances the ticks, unless the audio thread owns them */
+			hpsjam_client_peer->timer_tick();
+		}
+#endif
 	}
 	return (0);
 }
 
+#ifndef HPSJAM_SERVER_ONLY
+/*
+ * In audio clocked mode the client network tick is run from the audio
+ * callback, one tick per HPSJAM_DEF_SAMPLES samples, right after the
+ * recorded audio has been queued and before the received audio is
+ * played back. This removes the clock drift correction and one
+ * buffer stage. If the audio period is not a multiple of
+ * HPSJAM_DEF_SAMPLES the timer thread keeps running the tick. The
+ * audio thread never waits for the peer lock. Ticks which could not
+ * be run are retried on the next callback. The audio thread takes
+ * over the ticks, including incrementing hpsjam_ticks, under the peer
+ * lock, and the timer thread then only handles the control packets.
+ */
+Q_DECL_EXPORT void
+hpsjam_timer_audio_clock(class hpsjam_client_peer *peer, size_t samples)
+{
+	static unsigned pending;
+
+	if (hpsjam_audio_clock == false || samples == 0 ||
+	    (samples % HPSJAM_DEF_SAMPLES) != 0) {
+		peer->audio_clocked = false;
+		pending = 0;
+		return;
+	}
+
+	pending += samples / HPSJAM_DEF_SAMPLES;
+	if (pending > HPSJAM_SEQ_MAX)
+		pending = HPSJAM_SEQ_MAX;
+
+	while (pending != 0 && peer->try_tick())
+		pending--;
+}
+#endif
+
 Q_DECL_EXPORT void
 hpsjam_timer_init()
 {
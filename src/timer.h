@@ -28,9 +28,43 @@
 
 #include <stdint.h>
 
+#include <stddef.h>
+
 extern uint16_t hpsjam_ticks;
 extern int hpsjam_timer_adjust;
+extern bool hpsjam_audio_clock;
+extern int hpsjam_rt_priority;
+extern int hpsjam_rt_cpu_timer;
+extern int hpsjam_rt_cpu_receive;
+extern int hpsjam_rt_spin_us;
+extern bool hpsjam_rt_report;
+
+/*
+ * The network code reads the clock of the current peer through the
+ * globals above. When several peers run on the same thread, like in
+ * the simulator, each peer has its own clock, which is switched in
+ * before, and saved after, running any code on behalf of that peer.
+ */
+struct hpsjam_clock {
+	uint16_t ticks;
+	int adjust;
+
+	void clear() {
+		ticks = 0;
+		adjust = 0;
+	};
+	void enter() const {
+		hpsjam_ticks = ticks;
+		hpsjam_timer_adjust = adjust;
+	};
+	void leave() {
+		ticks = hpsjam_ticks;
+		adjust = hpsjam_timer_adjust;
+	};
+};
 
 extern void hpsjam_timer_init();
+extern void hpsjam_thread_set_priority(int = -1);
+extern void hpsjam_timer_audio_clock(class hpsjam_client_peer *, size_t);
 
 #endif		/* _HPSJAM_TIMER_H_ */
@@ -0,0 +1,244 @@
+/*-
+ * Copyright (c) 2020 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	_HPSJAM_TRANSPORT_H_
+#define	_HPSJAM_TRANSPORT_H_
+
+/*
+ * Audio encoding and packet handling shared by the client and the
+ * server peers. The peer classes provide the receive and send hooks.
+ */
+
+#include "hpsjam.h"
+#include "protocol.h"
+
+#include <assert.h>
+#include <math.h>
+
+static inline float
+float_gain(float value, uint32_t gain)
+{
+	return (value * gain) * (1.0f / 256.0f);
+}
+
+static inline uint32_t
+get_gain_from_bits(uint8_t value)
+{
+	int32_t temp = HPSJAM_BIT_GAIN_GET(value);
+
+	/* sign extend to fit float exponent */
+	temp <<= (32 - 5);
+	temp >>= (32 - 5);
+
+	return (powf(256.0f, (temp + 16) / 16.0f));
+}
+
+template <typename T>
+void HpsJamProcessOutputAudio(T &s, float *left, float *right)
+{
+	/* check if we should downsample to mono */
+	switch (s.output_fmt) {
+	case HPSJAM_TYPE_AUDIO_8_BIT_1CH:
+	case HPSJAM_TYPE_AUDIO_16_BIT_1CH:
+	case HPSJAM_TYPE_AUDIO_24_BIT_1CH:
+	case HPSJAM_TYPE_AUDIO_32_BIT_1CH:
+		for (unsigned int x = 0; x != HPSJAM_DEF_SAMPLES; x++)
+			left[x] = right[x] = (left[x] + right[x]) / 2.0f;
+		break;
+	default:
+		break;
+	}
+
+	/* run limiter */
+	s.out_limiter.doit(HPSJAM_SAMPLE_RATE, left, right, HPSJAM_DEF_SAMPLES);
+
+	/* add samples to final output buffer */
+	s.out_buffer[0].addSamples(left, HPSJAM_DEF_SAMPLES);
+	s.out_buffer[1].addSamples(right, HPSJAM_DEF_SAMPLES);
+}
+
+static inline void
+hpsjam_encode_audio(struct hpsjam_packet_entry &entry, uint8_t format,
+    float *left, float *right)
+{
+	/* select output format */
+	switch (format) {
+	case HPSJAM_TYPE_AUDIO_8_BIT_1CH:
+		entry.packet.put8Bit1ChSample(left, HPSJAM_NOM_SAMPLES);
+		break;
+	case HPSJAM_TYPE_AUDIO_16_BIT_1CH:
+		entry.packet.put16Bit1ChSample(left, HPSJAM_NOM_SAMPLES);
+		break;
+	case HPSJAM_TYPE_AUDIO_24_BIT_1CH:
+		entry.packet.put24Bit1ChSample(left, HPSJAM_NOM_SAMPLES);
+		break;
+	case HPSJAM_TYPE_AUDIO_32_BIT_1CH:
+		entry.packet.put32Bit1ChSample(left, HPSJAM_NOM_SAMPLES);
+		break;
+	case HPSJAM_TYPE_AUDIO_8_BIT_2CH:
+		entry.packet.put8Bit2ChSample(left, right, HPSJAM_NOM_SAMPLES);
+		break;
+	case HPSJAM_TYPE_AUDIO_16_BIT_2CH:
+		entry.packet.put16Bit2ChSample(left, right, HPSJAM_NOM_SAMPLES);
+		break;
+	case HPSJAM_TYPE_AUDIO_24_BIT_2CH:
+		entry.packet.put24Bit2ChSample(left, right, HPSJAM_NOM_SAMPLES);
+		break;
+	case HPSJAM_TYPE_AUDIO_32_BIT_2CH:
+		entry.packet.put32Bit2ChSample(left, right, HPSJAM_NOM_SAMPLES);
+		break;
+	default:
+		entry.packet.putSilence(HPSJAM_NOM_SAMPLES);
+		break;
+	}
+}
+
+/*
+ * Decode an audio packet of the given type. Mono audio is returned in
+ * both channels. Returns the number of samples.
+ */
+static inline size_t
+hpsjam_decode_audio(const struct hpsjam_packet *ptr, uint8_t type,
+    float *left, float * &right)
+{
+	right = left + (HPSJAM_MAX_PKT / 2);
+
+	switch (type) {
+	case HPSJAM_TYPE_AUDIO_8_BIT_1CH:
+		right = left;
+		return (ptr->get8Bit1ChSample(left));
+	case HPSJAM_TYPE_AUDIO_16_BIT_1CH:
+		right = left;
+		return (ptr->get16Bit1ChSample(left));
+	case HPSJAM_TYPE_AUDIO_24_BIT_1CH:
+		right = left;
+		return (ptr->get24Bit1ChSample(left));
+	case HPSJAM_TYPE_AUDIO_32_BIT_1CH:
+		right = left;
+		return (ptr->get32Bit1ChSample(left));
+	case HPSJAM_TYPE_AUDIO_8_BIT_2CH:
+		return (ptr->get8Bit2ChSample(left, right));
+	case HPSJAM_TYPE_AUDIO_16_BIT_2CH:
+		return (ptr->get16Bit2ChSample(left, right));
+	case HPSJAM_TYPE_AUDIO_24_BIT_2CH:
+		return (ptr->get24Bit2ChSample(left, right));
+	case HPSJAM_TYPE_AUDIO_32_BIT_2CH:
+		return (ptr->get32Bit2ChSample(left, right));
+	default:
+		return (0);
+	}
+}
+
+template <typename T>
+void HpsJamSendPacket(T &s)
+{
+	struct hpsjam_packet_entry entry;
+	float temp[2][HPSJAM_NOM_SAMPLES];
+
+	/* check if we are sending XOR data */
+	if (s.output_pkt.isXorFrame())
+		goto done;
+
+	/* get back correct amount of samples */
+	s.out_buffer[0].remSamples(temp[0], HPSJAM_NOM_SAMPLES);
+	s.out_buffer[1].remSamples(temp[1], HPSJAM_NOM_SAMPLES);
+
+	hpsjam_encode_audio(entry, s.output_fmt, temp[0], temp[1]);
+	s.output_pkt.append_pkt(entry);
+	s.sendDirect(entry);
+done:
+	/* send a packet */
+	s.output_pkt.send(s.address, &s.alt_address);
+}
+
+template <typename T>
+bool HpsJamReceiveUnSequenced(T &s, const struct hpsjam_packet *ptr, float *temp)
+{
+	size_t num;
+
+	switch (ptr->type) {
+	case HPSJAM_TYPE_AUDIO_8_BIT_1CH:
+		num = ptr->get8Bit1ChSample(temp);
+		assert(num <= HPSJAM_MAX_PKT);
+		s.receiveAudio(temp, temp, num);
+		return (true);
+	case HPSJAM_TYPE_AUDIO_16_BIT_1CH:
+		num = ptr->get16Bit1ChSample(temp);
+		assert(num <= HPSJAM_MAX_PKT);
+		s.receiveAudio(temp, temp, num);
+		return (true);
+	case HPSJAM_TYPE_AUDIO_24_BIT_1CH:
+		num = ptr->get24Bit1ChSample(temp);
+		assert(num <= HPSJAM_MAX_PKT);
+		s.receiveAudio(temp, temp, num);
+		return (true);
+	case HPSJAM_TYPE_AUDIO_32_BIT_1CH:
+		num = ptr->get32Bit1ChSample(temp);
+		assert(num <= HPSJAM_MAX_PKT);
+		s.receiveAudio(temp, temp, num);
+		return (true);
+	case HPSJAM_TYPE_AUDIO_8_BIT_2CH:
+		num = ptr->get8Bit2ChSample(temp, temp + (HPSJAM_MAX_PKT / 2));
+		assert(num <= (HPSJAM_MAX_PKT / 2));
+		s.receiveAudio(temp, temp + (HPSJAM_MAX_PKT / 2), num);
+		return (true);
+	case HPSJAM_TYPE_AUDIO_16_BIT_2CH:
+		num = ptr->get16Bit2ChSample(temp, temp + (HPSJAM_MAX_PKT / 2));
+		assert(num <= (HPSJAM_MAX_PKT / 2));
+		s.receiveAudio(temp, temp + (HPSJAM_MAX_PKT / 2), num);
+		return (true);
+	case HPSJAM_TYPE_AUDIO_24_BIT_2CH:
+		num = ptr->get24Bit2ChSample(temp, temp + (HPSJAM_MAX_PKT / 2));
+		assert(num <= (HPSJAM_MAX_PKT / 2));
+		s.receiveAudio(temp, temp + (HPSJAM_MAX_PKT / 2), num);
+		return (true);
+	case HPSJAM_TYPE_AUDIO_32_BIT_2CH:
+		num = ptr->get32Bit2ChSample(temp, temp + (HPSJAM_MAX_PKT / 2));
+		assert(num <= (HPSJAM_MAX_PKT / 2));
+		s.receiveAudio(temp, temp + (HPSJAM_MAX_PKT / 2), num);
+		return (true);
+	case HPSJAM_TYPE_AUDIO_SFU ... HPSJAM_TYPE_AUDIO_SFU + HPSJAM_TYPE_AUDIO_32_BIT_2CH:
+		s.receiveForward(ptr, temp);
+		return (true);
+	case HPSJAM_TYPE_AUDIO_32_BIT_2CH + 1 ... HPSJAM_TYPE_AUDIO_SFU - 1:
+	case HPSJAM_TYPE_AUDIO_SFU + HPSJAM_TYPE_AUDIO_32_BIT_2CH + 1 ... HPSJAM_TYPE_AUDIO_MAX:
+		/* for the future */
+		s.receiveSilence(HPSJAM_NOM_SAMPLES, false);
+		return (true);
+	case HPSJAM_TYPE_AUDIO_SILENCE:
+		num = ptr->getSilence();
+		s.receiveSilence(num, s.input_pkt.lost);
+		return (true);
+	case HPSJAM_TYPE_ACK:
+		/* check if other side received packet */
+		if (ptr->getPeerSeqNo() == s.output_pkt.pend_seqno)
+			s.output_pkt.advance();
+		return (true);
+	default:
+		return (false);
+	}
+}
+
+#endif		/* _HPSJAM_TRANSPORT_H_ */